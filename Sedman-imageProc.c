@@ -2,49 +2,426 @@
 // Sedman, Jason
 // Image Processing Program CW
 // A simple C program for PPM image manipulation 
+// Compile with: gcc -O2 -pthread Sedman-imageProc.c -o imageproc -lm
 //
 
+#define _GNU_SOURCE // readahead() and sync_file_range() for the read-ahead fallback (see ASYNC I/O)
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 #include <unistd.h>
 #include <math.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <pthread.h>
+#include <libgen.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <signal.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define HAVE_IO_URING 1 // Read-ahead and write-behind go through io_uring when the kernel allows it
+#endif
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1 // SSE2/AVX2 kernels are built and picked at startup by 'selectKernelsPPM'
+#endif
 
 #define MAX_FILENAME_LENGTH 200
 #define MAX_WIDTH 1920
 #define MAX_HEIGHT 1080
+#define WRITE_BUFFER_SIZE (1 << 20)
+#define READ_BUFFER_SIZE (1 << 20)
+#define READ_MARGIN 16 // Readable bytes kept in front of a chunk buffer for the tokenizer to look back at
+#define BAND_BYTES (256 * 1024) // Rough size of the row bands handed to each worker thread
+#define POOL_CLASSES 80 // Buffer pool size classes: 4 KB up to 1.75 * 2^31 bytes in quarter-power-of-two steps
+#define POOL_LIMIT_MB 512 // Default most memory the pool keeps cached (IMAGEPROC_POOL_MB overrides)
+#define INDEX_ROWS 1 // Rows between entries of a region index (IMAGEPROC_INDEX_ROWS overrides; see 'readRegionPPM')
+#define INDEX_COLUMNS 256 // Pixels between the column offsets kept for each indexed row
+#define PREFETCH_DEPTH 4 // Files read ahead of the one being processed (--prefetch overrides)
+#define PREVIEW_ROWS 40 // Most rows of text the preview printed by 'displayPPM' may take
+#define HISTOGRAM_BUCKETS 64 // Columns in each histogram printed by 'displayPPM'
+#define IO_QUEUE 256 // Read-ahead and write-behind requests that can be waiting at once
+#define IO_THREADS 4 // Threads doing them when io_uring is not available
+#define SAMPLE_BYTES(max_colour) ((max_colour) > 255 ? 2 : 1) // Bytes per sample held in 'data' (see PPMImage)
+#define PLANE_ALIGN 64 // Alignment of pixel buffers and of each row of a planar image
+#define PLANE_ROW(image, plane, y) ((image)->data + ((size_t)(plane) * (image)->height + (size_t)(y)) * (image)->stride)
+#ifndef IMAGEPROC_TRACE
+#define IMAGEPROC_TRACE 1 // Build with -DIMAGEPROC_TRACE=0 to compile the instrumentation out (see 'enableTracePPM')
+#endif
+#define TRACE_EVENTS (1 << 18) // Most spans kept for a Chrome trace; later ones are only totalled
 
 //----------------STRUCTURES----------------//
 //------------------------------------------//
 // Structure to store PPM image data with a pointer to pixel data.
 // As the data will be allocated in a one-dimensional data array, this will be very efficient
-typedef struct {
+// Binary (P5/P6) images are memory-mapped, so 'data' points straight into the mapped file
+// Images with a max colour above 255 hold 16-bit samples: 'data' is then really a uint16_t array,
+// in the machine's own byte order (files store them most significant byte first)
+// Images are created with 'allocPPM' (or read with 'readPPM') and released with 'freePPM', which
+// hands headers and pixel buffers back to the buffer pool for the next image of a similar size
+// RGB images may instead be planar (see 'toPlanarPPM'): all the red samples, then all the green, then
+// all the blue, with each row of each plane starting on a PLANE_ALIGN boundary 'stride' bytes apart
+typedef struct PPMImage {
     char format[3];
     int width, height, max_colour;
+    int channels; // 1 for grayscale (P2/P5), 3 for RGB (P3/P6)
+    int planar; // 1 if the samples are held as separate R, G and B planes (use PLANE_ROW to find a row)
+    size_t stride; // Bytes from one row of a plane to the next (planar images only)
     unsigned char *data;
+    void *map; // Start of the file mapping behind 'data' (NULL when 'data' was allocated)
+    size_t mapLength; // Length of the file mapping in bytes
+    int poolClass; // Buffer pool size class of 'data', or -1 if it was malloc'd directly
+    struct PPMArena *arena; // Arena that owns the image, if any
+    struct PPMImage *next, *prev; // Neighbours in the arena's list (or the pool's free list)
 } PPMImage;
 
+// Per-job arena: every image allocated on a thread while its arena is current is recorded here,
+// and whatever has not been freed by the end of the job is released in one call
+typedef struct PPMArena {
+    PPMImage *images; // Live images, linked through 'next' and 'prev'
+} PPMArena;
+
+// Cursor over the pixel data of a PPM file, used by the tokenizer in 'readSamplesPPM'.
+// Either the whole file is already in memory (fd is -1), or it is streamed from 'fd' in chunks
+typedef struct {
+    const unsigned char *pos; // Next unread byte
+    const unsigned char *end; // One past the last readable byte
+    int fd; // File being streamed, or -1
+    unsigned char *buffer; // Chunk buffer for streamed files
+    size_t capacity; // Size of the chunk buffer
+} PPMReader;
+
+// Output buffer used by 'savePPM' and 'displayPPM', so pixel text is sent in a few large writes
+typedef struct {
+    int fd; // Destination file descriptor
+    size_t used; // Bytes waiting in the buffer
+    int failed; // Set once any write fails
+    int binary; // Pixels are written as raw bytes (P5/P6) rather than text
+    int channels; // Samples per pixel, for laying out ASCII text
+    int depth; // Bytes per sample (see SAMPLE_BYTES)
+    char buffer[WRITE_BUFFER_SIZE];
+} PPMWriter;
+
+// Position (top-left corner) of one pattern match
+typedef struct {
+    int x, y;
+    double score; // Match quality for approximate searches (see 'matchPPM')
+    int pattern; // Which needle was found, for searches for several at once (see 'findPatternsPPM')
+} PPMMatch;
+
+// Kernels, border modes and gradient magnitudes of the convolution engine (see 'filterPPM')
+#define FILTER_SOBEL 0 // 3x3 gradient
+#define FILTER_SCHARR 1 // 3x3 gradient, more accurate in direction
+#define FILTER_LAPLACIAN 2 // 3x3 second derivative (absolute value)
+#define FILTER_GAUSSIAN 3 // 5x5 binomial blur
+#define FILTER_BOX 4 // 3x3 mean
+#define FILTERS 5
+#define BORDER_NONE 0 // Pixels without every neighbour the kernel needs are left black, as 'edgePPM' always has
+#define BORDER_CLAMP 1 // Beyond the edge, the edge pixel repeats
+#define BORDER_REFLECT 2 // Beyond the edge, the image is mirrored about the edge pixel (which is not repeated)
+#define BORDER_ZERO 3 // Beyond the edge, everything is black
+#define MAGNITUDE_L1 0 // Gradient strength (|x| + |y|), scaled like Sobel's (|x| + |y|) / 2
+#define MAGNITUDE_L2 1 // Gradient strength sqrt(x^2 + y^2), scaled the same way
+
+// Scoring used by the approximate search in 'matchPPM'
+#define MATCH_SAD 0 // Mean absolute difference per sample: lower is better, 0 is exact
+#define MATCH_NCC 1 // Normalised cross-correlation: higher is better, 1 is a perfect match
+
+// Row kernel for Sobel edge detection, with one version per instruction set (see 'selectKernelsPPM')
+typedef void (*EdgeRowKernel)(const unsigned char *above, const unsigned char *row, const unsigned char *below,
+                              unsigned char *out, int first, int last, int step, int max_colour);
+typedef void (*EdgeRow16Kernel)(const uint16_t *above, const uint16_t *row, const uint16_t *below,
+                                uint16_t *out, int first, int last, int step, int max_colour);
+
+// Row function of the convolution engine, likewise (see 'filterRowBodyPPM')
+#define FILTER_ROW_PARAMETERS int filter, int depth, const unsigned char *const *rows, unsigned char *out, int width, int step, \
+                              int first, int last, int border, int magnitude, int max_colour, int32_t *sums
+#define FILTER_ROW_ARGUMENTS filter, depth, rows, out, width, step, first, last, border, magnitude, max_colour, sums
+typedef void (*FilterRowKernel)(FILTER_ROW_PARAMETERS);
+
+// Whole-row edge function for one sample size ('edgeRowPPM' or 'edgeRow16PPM'), picked once per image
+typedef void (*EdgeRowFunction)(const unsigned char *above, const unsigned char *row, const unsigned char *below,
+                                unsigned char *out, int width, int channels, int max_colour);
+
+// One unit of work for the batch runner (see 'runBatchPPM')
+typedef struct PPMJob {
+    const char *operation; // read, save, edge, add, pattern or match
+    const char *inputs[2];
+    int inputCount;
+    char *output; // NULL for operations that write nothing
+    int binary; // 1 for P5/P6 output, 0 for P2/P3, -1 to keep the encoding of the first input
+    int stream; // Edge detect a row at a time instead of loading the image
+    int planar; // Edge detect or add RGB images as separate planes (see 'toPlanarPPM')
+    const char *steps; // Operators for 'chain', e.g. "add,edge,threshold=64"
+    const char *region; // "X,Y,WxH": only this window of the first input is loaded (see 'readRegionPPM')
+    const char *filter; // Kernel, border and magnitude for 'edge', e.g. "scharr,reflect,l2" (see 'parseFilterPPM'), or NULL for Sobel
+    struct PPMJob *ahead; // Job whose inputs are read ahead when this one starts, or NULL
+    int status; // 0 once the job has succeeded
+} PPMJob;
+
+// Running (optionally weighted) sum of many frames, for averaging them one at a time (see 'accumulatePPM')
+typedef struct {
+    char format[3];
+    int width, height, max_colour, channels;
+    uint32_t *sums; // One per sample
+    int poolClass; // Buffer pool class of 'sums'
+    uint32_t weight; // Total weight of the frames so far
+} PPMAccumulator;
+
+// Summary of an image gathered in one pass by 'statsPPM', and shown by 'displayPPM'
+typedef struct {
+    int channels;
+    int bins; // Histogram bins per channel: every value a sample can hold (256, or 65536 for 16-bit)
+    uint64_t *histogram; // 'bins' counts for each channel in turn
+    int min[3], max[3];
+    double mean[3], deviation[3]; // Mean and standard deviation
+    uint64_t outOfRange[3]; // Samples above max_colour
+    int previewWidth, previewHeight;
+    unsigned char *preview; // Brightness (0-255) of each preview cell, box filtered from the image
+} PPMStats;
+
+// Operators of a fused pipeline (see 'savePipelinePPM')
+#define PIPE_STAGES 16 // Most stages one pipeline can hold
+#define PIPE_SOURCE 0 // An image already in memory
+#define PIPE_ADD 1 // Average of two stages, as 'addPPM'
+#define PIPE_EDGE 2 // Sobel edges of a stage, as 'edgePPM'
+#define PIPE_THRESHOLD 3 // Samples at or above 'level' become max_colour, the rest 0
+#define PIPE_BOXES 4 // A stage with a box drawn around every match, as 'boxMatchesPPM'
+
+// One operator in a pipeline. Inputs are indices of earlier stages
+typedef struct {
+    int operation;
+    int inputs[2];
+    char format[3];
+    int width, height, max_colour, channels;
+    PPMImage *image; // PIPE_SOURCE
+    int level; // PIPE_THRESHOLD
+    const PPMMatch *matches; // PIPE_BOXES: boxes of boxWidth x boxHeight at each match
+    int count, boxWidth, boxHeight;
+} PipeStage;
+
+// Chain of operators evaluated lazily, a row band at a time, so no full-size intermediate images are made
+typedef struct {
+    PipeStage stages[PIPE_STAGES];
+    int count;
+} PPMPipeline;
+
+// Stages timed by the instrumentation, and the counters it keeps (see 'enableTracePPM')
+#define TRACE_READ 0 // 'readPPM', including the header and any decoding
+#define TRACE_DECODE 1 // Turning ASCII or 16-bit file data into samples
+#define TRACE_ALLOC 2 // Pool misses that had to go to malloc
+#define TRACE_SAVE 3
+#define TRACE_EDGE 4
+#define TRACE_STREAM 5 // 'edgeStreamPPM'
+#define TRACE_ADD 6
+#define TRACE_PATTERN 7
+#define TRACE_MATCH 8
+#define TRACE_AVERAGE 9 // One frame added by 'accumulatePPM'
+#define TRACE_PIPELINE 10
+#define TRACE_JOB 11 // One batch job, from reading its inputs to writing its output
+#define TRACE_BAND 12 // One band run by the thread pool
+#define TRACE_STATS 13 // Histograms and preview gathered by 'statsPPM'
+#define TRACE_STAGES 14
+#define TRACE_BYTES_READ 0
+#define TRACE_BYTES_WRITTEN 1
+#define TRACE_PIXELS 2 // Pixels produced by edge, add, average and pipeline stages
+#define TRACE_CANDIDATES 3 // Offsets tested by the pattern searches
+#define TRACE_VERIFIED 4 // Exact search offsets whose hash matched and were compared byte by byte
+#define TRACE_POOL_HITS 5
+#define TRACE_POOL_MISSES 6
+#define TRACE_CACHE_HITS 7
+#define TRACE_CACHE_MISSES 8
+#define TRACE_COUNTERS 9
+
+// One timed stage in progress, from TRACE_BEGIN to TRACE_END
+typedef struct {
+    int stage; // -1 if tracing was off when the span began
+    uint64_t wall, cpu; // Start times in nanoseconds
+} TraceSpan;
+
+// Spans and counters only cost a test of 'traceEnabled' until tracing is switched on,
+// and nothing at all when built with IMAGEPROC_TRACE set to 0
+#if IMAGEPROC_TRACE
+#define TRACE_BEGIN(name, id) TraceSpan name; name.stage = -1; if (traceEnabled) traceBeginPPM(&name, id)
+#define TRACE_END(name) do { if (name.stage >= 0) traceEndPPM(&name); } while (0)
+#define TRACE_COUNT(counter, amount) do { if (traceEnabled) traceCountPPM(counter, (uint64_t)(amount)); } while (0)
+#else
+#define TRACE_BEGIN(name, id) do { } while (0)
+#define TRACE_END(name) do { } while (0)
+#define TRACE_COUNT(counter, amount) do { } while (0)
+#endif
+
+// Work shared out by the thread pool: 'task' is called once for each band number in [0, bands)
+typedef void (*BandTask)(void *arg, int band);
+
+// Persistent pool of worker threads, created on first use and kept for the life of the program
+typedef struct {
+    pthread_t *threads;
+    int threadCount; // Worker threads (the thread posting a job also works on it)
+    pthread_mutex_t lock;
+    pthread_cond_t start; // Signalled when a job is posted
+    pthread_cond_t finish; // Signalled when the last band of a job is done
+    pthread_mutex_t busy; // Held by the thread whose job is running
+    unsigned long job; // Counts posted jobs, so workers can tell a new one has arrived
+    BandTask task;
+    void *arg;
+    int bands, nextBand, bandsDone;
+} ThreadPool;
+
 //-----------------FUNCTION-----------------//
 //----------------PROTOTYPES----------------//
 // Instanciating the functions before main to avoid errors
 PPMImage *readPPM(const char *filename); // Task 1
-void savePPM(const char *filename, PPMImage *image); // Task 2
+int savePPM(const char *filename, PPMImage *image, int binary); // Task 2
 void displayPPM(PPMImage *image); // Task 3
+void dumpPPM(PPMImage *image);
 PPMImage *addPPM(PPMImage *image1, PPMImage *image2); // Task 4
 PPMImage *edgePPM(PPMImage *image); // Task 5
 PPMImage *patternPPM(PPMImage *image1, PPMImage *image2); // Task 6
 PPMImage *drawBox(PPMImage *image, int width, int height, int x, int y, int boxWidth, int boxHeight);
+int findPatternPPM(PPMImage *image1, PPMImage *image2, PPMMatch **matches);
+PPMImage *filterPPM(PPMImage *image, int filter, int border, int magnitude);
+int parseFilterPPM(const char *spec, int *filter, int *border, int *magnitude);
+int findPatternsPPM(PPMImage *image1, PPMImage **needles, int count, PPMMatch **matches);
+PPMImage *patternsPPM(PPMImage *image1, PPMImage **needles, int count, const char **names);
+PPMImage *boxPatternsPPM(PPMImage *image1, PPMImage **needles, const PPMMatch *matches, int count);
+PPMImage *boxMatchesPPM(PPMImage *image1, PPMImage *image2, const PPMMatch *matches, int count);
+int matchPPM(PPMImage *image1, PPMImage *image2, int mode, double threshold, int topK, PPMMatch **matches);
+PPMImage *approxPatternPPM(PPMImage *image1, PPMImage *image2, int mode, double threshold, int topK);
+PPMImage *mapPPM(const char *filename);
+int readSamplesPPM(PPMReader *reader, unsigned char *data, size_t count, int max_colour);
+int readSamples16PPM(PPMReader *reader, uint16_t *data, size_t count, int max_colour);
+void swapSamplesPPM(uint16_t *out, const unsigned char *in, size_t count);
+void freePPM(PPMImage *image);
+int isBinaryPPM(const PPMImage *image);
+int flushWriterPPM(PPMWriter *writer);
+void writeBytesPPM(PPMWriter *writer, const void *bytes, size_t length);
+void writeSamplesPPM(PPMWriter *writer, const unsigned char *data, size_t count, int channels);
+size_t parseHeaderPPM(const unsigned char *buffer, size_t length, PPMImage *image, const char *filename);
+size_t fillReaderPPM(PPMReader *reader);
+PPMImage *openStreamPPM(const char *filename, PPMReader *reader);
+int readRowPPM(PPMReader *reader, const PPMImage *header, unsigned char *row);
+int nextFramePPM(PPMReader *reader, PPMImage *header, const char *name);
+void closeStreamPPM(PPMReader *reader);
+PPMWriter *beginSavePPM(const char *filename, const PPMImage *header, int binary);
+void writePixelsPPM(PPMWriter *writer, const unsigned char *data, size_t count);
+int endSavePPM(PPMWriter *writer);
+void edgeRowPPM(const unsigned char *above, const unsigned char *row, const unsigned char *below, unsigned char *out, int width, int channels, int max_colour);
+void edgeRow16PPM(const unsigned char *above, const unsigned char *row, const unsigned char *below, unsigned char *out, int width, int channels, int max_colour);
+void selectKernelsPPM(void);
+static EdgeRowKernel edgeRowKernel; // Set by 'selectKernelsPPM'
+static EdgeRow16Kernel edgeRow16Kernel;
+static FilterRowKernel filterRowKernel;
+static void filterRowScalarPPM(FILTER_ROW_PARAMETERS);
+#ifdef HAVE_X86_KERNELS
+static void filterRowSSE2PPM(FILTER_ROW_PARAMETERS);
+static void filterRowAVX2PPM(FILTER_ROW_PARAMETERS);
+#endif
+static int verbosePPM = 1; // Progress messages for the menu; the batch runner reports per job instead
+static int prefetchDepth = PREFETCH_DEPTH; // Files read ahead in batches and averages (see 'readAheadPPM')
+int edgeStreamPPM(const char *inputFile, const char *outputFile);
+void setThreadCountPPM(int count);
+unsigned char *takeBufferPPM(size_t length, int *poolClass);
+void giveBufferPPM(unsigned char *buffer, int poolClass);
+PPMImage *newHeaderPPM(void);
+PPMImage *allocPPM(const char *format, int width, int height, int max_colour, int channels);
+PPMImage *allocPlanarPPM(const char *format, int width, int height, int max_colour, int channels);
+PPMImage *readPlanarPPM(const char *filename);
+PPMImage *readRegionPPM(const char *filename, int x, int y, int width, int height);
+int toPlanarPPM(PPMImage *image);
+int toInterleavedPPM(PPMImage *image);
+void writePlanarPPM(PPMWriter *writer, const PPMImage *image);
+static PPMImage *loadPPM(const char *filename, int planar);
+static int decodePlanarPPM(PPMReader *reader, const PPMImage *image, unsigned char *data, size_t stride);
+void beginArenaPPM(PPMArena *arena);
+void releaseArenaPPM(PPMArena *arena);
+void drainPoolPPM(void);
+int beginAveragePPM(PPMAccumulator *sum, const PPMImage *first);
+int accumulatePPM(PPMAccumulator *sum, const PPMImage *frame, int weight);
+PPMImage *endAveragePPM(PPMAccumulator *sum, PPMImage *into);
+int averageFilesPPM(const char **files, int count, const int *weights, const char *output, int binary);
+int statsPPM(const PPMImage *image, PPMStats *stats, int previewWidth, int previewHeight);
+void freeStatsPPM(PPMStats *stats);
+int pipeSourcePPM(PPMPipeline *pipe, PPMImage *image);
+int pipeAddPPM(PPMPipeline *pipe, int input1, int input2);
+int pipeEdgePPM(PPMPipeline *pipe, int input);
+int pipeThresholdPPM(PPMPipeline *pipe, int input, int level);
+int pipeBoxesPPM(PPMPipeline *pipe, int input, const PPMMatch *matches, int count, int boxWidth, int boxHeight);
+int savePipelinePPM(const PPMPipeline *pipe, int stage, const char *filename, int binary);
+PPMImage *generatePPM(const char *format, int width, int height, int max_colour, uint32_t seed);
+int benchPPM(const char *sizes, int runs, FILE *out);
+int enableTracePPM(const char *summaryFile, const char *chromeFile);
+void traceBeginPPM(TraceSpan *span, int stage);
+void traceEndPPM(TraceSpan *span);
+void traceCountPPM(int counter, uint64_t amount);
+static int traceEnabled; // Set by 'enableTracePPM'
+int enableCachePPM(const char *directory, long megabytes);
+int cacheKeyPPM(const PPMJob *job, char *key, int *binary);
+int cacheFetchPPM(const char *key, const char *output, int binary);
+void cacheStorePPM(const char *key, const char *output);
+int runCachedJobPPM(PPMJob *job);
+int runBatchPPM(int argc, char *argv[]);
+int runJobPPM(PPMJob *job);
+void runParallelPPM(BandTask task, void *arg, int bands);
+void startAsyncIOPPM(void);
+void readAheadPPM(const char *filename);
+void writeBehindPPM(int fd);
+void finishAsyncIOPPM(void);
+int servePPM(const char *socketPath, long megabytes);
+int sendRequestPPM(const char *socketPath, int count, char **words);
 
 //----------------MAIN---------------------//
 //-----------------------------------------//
-int main() {    
+int main(int argc, char *argv[]) {    
+    // Pick the fastest kernels this CPU supports
+    selectKernelsPPM();
+
+    // Worker thread count can be set with '-t N' or '-j N' (otherwise IMAGEPROC_THREADS, otherwise one per core)
+    // Timings are written at exit with '--trace FILE' (or IMAGEPROC_TRACE=FILE) and '--trace-chrome FILE'
+    int command = 0; // Position of the first word that is not an option
+    const char *traceFile = getenv("IMAGEPROC_TRACE"), *chromeFile = NULL;
+    for (int i = 1; i < argc; ++i) {
+        if ((strcmp(argv[i], "-t") == 0 || strcmp(argv[i], "--threads") == 0 || strcmp(argv[i], "-j") == 0) && i + 1 < argc) {
+            setThreadCountPPM(atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            traceFile = argv[++i];
+        } else if (strcmp(argv[i], "--trace-chrome") == 0 && i + 1 < argc) {
+            chromeFile = argv[++i];
+        } else if (command == 0 && argv[i][0] != '-') {
+            command = i;
+        }
+    }
+    if ((traceFile != NULL && traceFile[0] != '\0') || chromeFile != NULL) {
+        enableTracePPM(traceFile, chromeFile);
+    }
+
+    // A command on the command line runs without the menu, e.g. 'imageproc edge in/*.ppm -o out/ -j 16'
+    if (command != 0) {
+        return runBatchPPM(argc - command + 1, argv + command - 1);
+    }
+
     // Variables declared. Input files 1 and 2 correspond to images 1 and 2.
     char inputFile1[MAX_FILENAME_LENGTH];
     char inputFile2[MAX_FILENAME_LENGTH];
     char outputFile[MAX_FILENAME_LENGTH];
-    PPMImage *image1;
-    PPMImage *image2;
+    PPMImage *image1 = NULL;
+    PPMImage *image2 = NULL;
     char userInput; // User input
     char cwd[MAX_FILENAME_LENGTH]; // Working directory
 
@@ -64,6 +441,8 @@ int main() {
         printf("Type 'a' to add two PPM files together\n");
         printf("Type 'e' to perform an edge detection\n");
         printf("Type 'p' to detect a pattern in your PPM file\n");
+        printf("Type 'l' to edge detect a large PPM file without loading it\n");
+        printf("Type 'm' to find close (not exact) matches of a pattern in your PPM file\n");
         printf("Type 'q' to quit the program\n");
         printf("Enter your choice: ");
         scanf(" %c", &userInput);
@@ -77,10 +456,8 @@ int main() {
             // READ PPM (r)
             case 'r':
                 // Free memory if already used, to avoid overflow
-                if (image1 != NULL) {
-                    free(image1);
-                    free(image1->data);
-                }
+                freePPM(image1);
+                image1 = NULL;
 
                 printf("Enter the input filepath: ");
                 scanf("%99s", inputFile1);
@@ -103,8 +480,8 @@ int main() {
                 printf("Enter the output filename: ");
                 scanf("%99s", outputFile);
 
-                // Save PPM image to file
-                savePPM(outputFile, image1);
+                // Save PPM image to file, keeping the ASCII or binary encoding it was read with
+                savePPM(outputFile, image1, isBinaryPPM(image1));
                 break;
 
             // DISPLAY PPM DATA (d)
@@ -115,21 +492,22 @@ int main() {
                     break;
                 }
 
-                // Displays a PPM image
+                // Displays a summary of a PPM image, and every pixel value if asked for
                 displayPPM(image1);
+                printf("\nPrint every pixel value as well? (y/n): ");
+                scanf(" %c", &userInput);
+                while (getchar() != '\n');
+                if (userInput == 'y' || userInput == 'Y') {
+                    dumpPPM(image1);
+                }
                 break;
 
             // ADD PPMS (a)
             case 'a':
                 // Free memory if needed
-                if (image1 != NULL) {
-                    free(image1);
-                    free(image1->data);
-                }
-                if (image2 != NULL) {
-                    free(image2);
-                    free(image2->data);
-                }
+                freePPM(image1);
+                freePPM(image2);
+                image1 = image2 = NULL;
 
                 // Adds two PPM images together
                 // Get the filenames from the user and read
@@ -150,27 +528,27 @@ int main() {
                 while (getchar() != '\n');
 
                 // Error checks
+                // Check that images were read properly
+                if (image1 == NULL || image2 == NULL) {
+                    printf("Error: Image read failed. Please make sure your filepaths are correct.\n");
+                    break;
                 // Check if the images are of the same size
-                if (image1->width != image2->width || image1->height != image2->height) {
+                } else if (image1->width != image2->width || image1->height != image2->height) {
                     printf("Error: Images are not of the same size.\n");
                     break;
-                // Check that both images are the same type
-                } else if (strcmp(image1->format, image2->format) != 0) {
+                // Check that both images are the same type (ASCII and binary versions can be mixed)
+                } else if (image1->channels != image2->channels) {
                     printf("Error: Images have different magic values.\n");
                     break;
-                // Check that images were read properly
-                } else if (image1 == NULL || image2 == NULL) {
-                    printf("Error: Image read failed. Please make sure your filepaths are correct.\n");
-                    break;
                 }
 
-                PPMImage *combinedImage = addPPM(image1, image2);
-
-                // Write the combined image to a new file
-                savePPM("combined.ppm", combinedImage);
-                free(combinedImage);
-
-                printf("Images combined successfully. Result saved to combined.ppm\n");
+                // Write the combined image to a new file, averaging the rows as they are written
+                PPMPipeline pipe;
+                pipe.count = 0;
+                int combined = pipeAddPPM(&pipe, pipeSourcePPM(&pipe, image1), pipeSourcePPM(&pipe, image2));
+                if (savePipelinePPM(&pipe, combined, "combined.ppm", isBinaryPPM(image1)) == 0) {
+                    printf("Images combined successfully. Result saved to combined.ppm\n");
+                }
                 break;
 
             // EDGE DETECT (e)
@@ -182,21 +560,16 @@ int main() {
                 }
 
                 PPMImage *edgeImage = edgePPM(image1);
-                savePPM("edgedetect.ppm", edgeImage);
-                free(edgeImage);
+                savePPM("edgedetect.ppm", edgeImage, isBinaryPPM(image1));
+                freePPM(edgeImage);
                 break;
 
             // PATTERN DETECT (p)
             case 'p':
                 // Free memory if needed
-                if (image1 != NULL) {
-                    free(image1);
-                    free(image1->data);
-                }
-                if (image2 != NULL) {
-                    free(image2);
-                    free(image2->data);
-                }
+                freePPM(image1);
+                freePPM(image2);
+                image1 = image2 = NULL;
 
                 // Get the filenames from the user and read
                 // File 1
@@ -210,14 +583,14 @@ int main() {
                 image2 = readPPM(inputFile2);
 
                 // Error checks
-                // Check that both images are the same type
-                if (strcmp(image1->format, image2->format) != 0) {
-                    printf("Error: Images have different magic values.\n");
-                    break;
                 // Check that images were read properly
-                } else if (image1 == NULL || image2 == NULL) {
+                if (image1 == NULL || image2 == NULL) {
                     printf("Error: Image read failed. Please make sure your filepaths are correct.\n");
                     break;
+                // Check that both images are the same type (ASCII and binary versions can be mixed)
+                } else if (image1->channels != image2->channels) {
+                    printf("Error: Images have different magic values.\n");
+                    break;
                 }
 
                 PPMImage *patternImage = patternPPM(image1, image2);
@@ -228,13 +601,79 @@ int main() {
                 }
 
                 // Save file
-                savePPM("patterndetect.ppm", patternImage);
-                free(patternImage);
+                savePPM("patterndetect.ppm", patternImage, isBinaryPPM(image1));
+                freePPM(patternImage);
+                break;
+
+            // APPROXIMATE PATTERN DETECT (m)
+            case 'm': {
+                // Free memory if needed
+                freePPM(image1);
+                freePPM(image2);
+                image1 = image2 = NULL;
+
+                // Get the filenames and search settings from the user and read
+                char scoring;
+                double threshold;
+                int topK;
+                printf("Enter the first PPM filepath: ");
+                scanf("%s", inputFile1);
+                image1 = readPPM(inputFile1);
+                printf("Enter the second PPM filepath: ");
+                scanf("%s", inputFile2);
+                image2 = readPPM(inputFile2);
+                printf("Score by mean absolute difference or cross-correlation? (s/n): ");
+                scanf(" %c", &scoring);
+                printf(scoring == 'n' ? "Enter the minimum correlation (e.g. 0.9): " : "Enter the largest mean difference per sample (e.g. 8): ");
+                scanf("%lf", &threshold);
+                printf("Enter the most matches to report: ");
+                scanf("%d", &topK);
+
+                // Clear buffer
+                while (getchar() != '\n');
+
+                // Error checks
+                if (image1 == NULL || image2 == NULL) {
+                    printf("Error: Image read failed. Please make sure your filepaths are correct.\n");
+                    break;
+                } else if (image1->channels != image2->channels) {
+                    printf("Error: Images have different magic values.\n");
+                    break;
+                }
+
+                PPMImage *matchImage = approxPatternPPM(image1, image2, scoring == 'n' ? MATCH_NCC : MATCH_SAD, threshold, topK);
+                if (matchImage != NULL) {
+                    savePPM("matchdetect.ppm", matchImage, isBinaryPPM(image1));
+                    freePPM(matchImage);
+                    printf("Result saved to matchdetect.ppm\n");
+                }
+                break;
+            }
+
+            // STREAMED EDGE DETECT (l)
+            case 'l':
+                printf("Enter the input filepath: ");
+                scanf("%99s", inputFile1);
+                printf("Enter the output filename: ");
+                scanf("%99s", outputFile);
+
+                // Clear buffer
+                while (getchar() != '\n');
+
+                // Rows are streamed from one file to the other, keeping the input's encoding
+                if (strcmp(inputFile1, outputFile) == 0) {
+                    printf("Error: The output file must be different from the input file.\n");
+                } else if (edgeStreamPPM(inputFile1, outputFile) == 0) {
+                    printf("Edge detection complete. Result saved to %s\n", outputFile);
+                }
                 break;
 
             // QUIT (q)
             case 'q':
                 printf("Exiting program.\n");
+                freePPM(image1);
+                freePPM(image2);
+                drainPoolPPM();
                 return 0;
 
             // INVALID INPUT
@@ -250,107 +689,201 @@ int main() {
 //-----------------------------------------//
 // 1: Function to read PPM image from a file (r).
 PPMImage *readPPM(const char *filename) {
-    // Attempts to open file
-    FILE *file = fopen(filename, "rb");
-    if (!file) {
-        perror("Error opening file");
-        return NULL;
-    }
+    return loadPPM(filename, 0);
+}
 
-    // Allocates memory for file
-    PPMImage *image = (PPMImage *)malloc(sizeof(PPMImage));
-    // Error if fails to allocate memory
-    if (!image) {
-        fprintf(stderr, "Memory allocation failed for PPMImage\n");
-        fclose(file);
+// X: Read a PPM file, straight into separate R, G and B planes if 'planar' is set (see 'readPlanarPPM')
+static PPMImage *loadPPM(const char *filename, int planar) {
+    // Maps the file and reads the header
+    TRACE_BEGIN(span, TRACE_READ);
+    PPMImage *image = mapPPM(filename);
+    if (image == NULL) {
+        TRACE_END(span);
         return NULL;
     }
+    // Let the kernel start reading ahead; pages are faulted in as the pixels are used
+    madvise(image->map, image->mapLength, MADV_WILLNEED);
 
-    // Checks file format is correct before continuing
-    fscanf(file, "%2s", image->format);
-    if (strcmp(image->format, "P2") != 0 && strcmp(image->format, "P3") != 0) {
-        fprintf(stderr, "Invalid PPM file format. This program only uses P2 or P3 formatted PPMs.\n");
-        free(image);
-        fclose(file);
-        return NULL; // Throws error and returns if format is wrong
+    // 8-bit binary images are used straight from the mapping (grayscale images are a single plane anyway)
+    int depth = SAMPLE_BYTES(image->max_colour);
+    planar = planar && image->channels == 3;
+    if ((strcmp(image->format, "P5") == 0 || strcmp(image->format, "P6") == 0) && depth == 1 && !planar) {
+        if (verbosePPM) {
+            printf("PPM file read successfully.\n");
+        }
+        TRACE_END(span);
+        return image;
     }
 
-    // Complete reading header
-    fscanf(file, "%d %d", &image->width, &image->height);
-    fscanf(file, "%d", &image->max_colour);
-    // Consume the newline character after max_colour
-    fgetc(file);
-    
-    // Allocate memory for data
-    if (strcmp(image->format, "P2") == 0) {
-        // P2 format (grayscale)
-        image->data = (unsigned char *)malloc(image->width * image->height);
-    } else if (strcmp(image->format, "P3") == 0) {
-        // P3 format (RGB)
-        image->data = (unsigned char *)malloc(3 * image->width * image->height);
-    }
+    // ASCII images are decoded from the mapped text into their own buffer, and 16-bit binary
+    // images are copied out of it into the machine's byte order
+    size_t count = (size_t)image->width * (size_t)image->height * (size_t)image->channels;
+    size_t stride = ((size_t)image->width * depth + PLANE_ALIGN - 1) / PLANE_ALIGN * PLANE_ALIGN;
+    int poolClass;
+    unsigned char *data = takeBufferPPM(planar ? stride * (size_t)image->height * 3 : count * depth, &poolClass);
 
     // Throw error if fail
-    if (!image->data) {
+    if (!data) {
         fprintf(stderr, "Memory allocation failed for image data\n");
-        free(image);
-        fclose(file);
+        freePPM(image);
+        TRACE_END(span);
         return NULL;
     }
 
-    for (int i = 0; i < image->width * image->height; ++i) {
-        if (strcmp(image->format, "P2") == 0) {
-            // P2 format (grayscale)
-            // Reads 1 byte at a time
-            fscanf(file, "%hhu", &image->data[i]);
-        } else if (strcmp(image->format, "P3") == 0) {
-            // P3 format (RGB)
-            // Reads 3 bytes at a time
-            fscanf(file, "%hhu %hhu %hhu", &image->data[i * 3], &image->data[i * 3 + 1], &image->data[i * 3 + 2]);
-        }
+    TRACE_BEGIN(decode, TRACE_DECODE);
+    PPMReader reader;
+    reader.pos = image->data;
+    reader.end = (unsigned char *)image->map + image->mapLength;
+    reader.fd = -1;
+    reader.buffer = NULL;
+    reader.capacity = 0;
+    int status = 0;
+    if (planar) {
+        status = decodePlanarPPM(&reader, image, data, stride);
+    } else if (isBinaryPPM(image)) {
+        swapSamplesPPM((uint16_t *)data, image->data, count);
+    } else if (depth == 2) {
+        status = readSamples16PPM(&reader, (uint16_t *)data, count, image->max_colour);
+    } else {
+        status = readSamplesPPM(&reader, data, count, image->max_colour);
     }
+    TRACE_END(decode);
 
-    // Close file and return
-    fclose(file);
-    printf("PPM file read successfully.\n");
+    // The text is no longer needed once decoded
+    munmap(image->map, image->mapLength);
+    image->map = NULL;
+    image->mapLength = 0;
+    image->data = data;
+    image->poolClass = poolClass;
+    image->planar = planar;
+    image->stride = planar ? stride : 0;
+
+    if (status != 0) {
+        fprintf(stderr, "Error: Failed to read the pixel data in %s\n", filename);
+        freePPM(image);
+        TRACE_END(span);
+        return NULL;
+    }
+
+    if (verbosePPM) {
+        printf("PPM file read successfully.\n");
+    }
+    TRACE_END(span);
     return image;
 }
 
 // 2: Function to save PPM image to file (s).
-void savePPM(const char *filename, PPMImage *image) {
-    FILE *file = fopen(filename, "wb");
+// Writes ASCII (P2/P3) by default, or binary (P5/P6) when 'binary' is set. Returns 0 on success
+int savePPM(const char *filename, PPMImage *image, int binary) {
+    TRACE_BEGIN(span, TRACE_SAVE);
+    PPMWriter *writer = beginSavePPM(filename, image, binary);
+    if (writer == NULL) {
+        TRACE_END(span);
+        return -1;
+    }
 
-    // Throw error if file open fails
-    if (file == NULL) {
-        perror("Error opening file");
-        exit(EXIT_FAILURE);
+    // Write pixel data: binary data goes out in one write straight from the image
+    // (planar images are put back together a row at a time)
+    if (image->planar) {
+        writePlanarPPM(writer, image);
+    } else {
+        writePixelsPPM(writer, image->data, (size_t)image->width * (size_t)image->height * (size_t)image->channels);
     }
 
-    // Write header
-    fprintf(file, "%s\n", image->format);
-    fprintf(file, "%d %d\n", image->width, image->height);
-    fprintf(file, "%d\n", image->max_colour);
+    int status = endSavePPM(writer);
+    if (status != 0) {
+        fprintf(stderr, "Error: Failed to write %s\n", filename);
+    }
+    TRACE_END(span);
+    return status;
+}
+
+// 3: Function to display PPM image data (d).
+// Prints the header, then per-channel statistics, histograms and a small preview of the picture
+// (every pixel value, as before, is printed by 'dumpPPM')
+void displayPPM(PPMImage *image) {
+    if (image->planar && toInterleavedPPM(image) != 0) {
+        return;
+    }
 
-    // Write pixel data to file for either grayscale or RGB.
-    if (strcmp(image->format, "P2") == 0) {
-        // P2 format (grayscale)
-        // Writes 1 byte at at a time
-        for (int i = 0; i < image->width * image->height; ++i) {
-            fprintf(file, "%hhu ", image->data[i]);
+    // Header info
+    printf("\nFormat: %s\n", image->format);
+    printf("Width: %d\n", image->width);    
+    printf("Height: %d\n", image->height);
+    printf("Max Colour: %d\n", image->max_colour);
+
+    // Preview fits the terminal (or 80 columns), at about two rows per column as characters are tall
+    struct winsize window;
+    int columns = 80;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &window) == 0 && window.ws_col > 0) {
+        columns = window.ws_col;
+    } else if (getenv("COLUMNS") != NULL && atoi(getenv("COLUMNS")) > 0) {
+        columns = atoi(getenv("COLUMNS"));
+    }
+    int previewWidth = image->width < columns - 2 ? image->width : columns - 2;
+    int previewHeight = (int)((double)previewWidth * image->height / image->width / 2 + 0.5);
+    if (previewHeight > PREVIEW_ROWS) {
+        previewHeight = PREVIEW_ROWS;
+        previewWidth = (int)((double)PREVIEW_ROWS * 2 * image->width / image->height + 0.5);
+    }
+    previewWidth = previewWidth < 1 ? 1 : previewWidth;
+    previewHeight = previewHeight < 1 ? 1 : previewHeight > image->height ? image->height : previewHeight;
+
+    PPMStats stats;
+    if (statsPPM(image, &stats, previewWidth, previewHeight) != 0) {
+        return;
+    }
+
+    // Per channel numbers
+    static const char *names[3] = {"Red", "Green", "Blue"};
+    printf("\n%-8s %7s %7s %10s %10s %14s\n", "Channel", "Min", "Max", "Mean", "Std dev", "Out of range");
+    for (int c = 0; c < stats.channels; ++c) {
+        printf("%-8s %7d %7d %10.2f %10.2f %14llu\n", stats.channels == 1 ? "Gray" : names[c], stats.min[c], stats.max[c],
+               stats.mean[c], stats.deviation[c], (unsigned long long)stats.outOfRange[c]);
+    }
+
+    // Histograms, squeezed into HISTOGRAM_BUCKETS buckets and drawn as one line of shading per channel
+    static const char shades[] = " .:-=+*#%@";
+    int levels = (int)sizeof(shades) - 2;
+    int range = image->max_colour + 1;
+    uint64_t buckets[3][HISTOGRAM_BUCKETS], largest = 1;
+    for (int c = 0; c < stats.channels; ++c) {
+        for (int b = 0; b < HISTOGRAM_BUCKETS; ++b) {
+            buckets[c][b] = 0;
+            for (int v = (int)((int64_t)b * range / HISTOGRAM_BUCKETS); v < (int)((int64_t)(b + 1) * range / HISTOGRAM_BUCKETS); ++v) {
+                buckets[c][b] += stats.histogram[(size_t)c * stats.bins + v];
+            }
+            largest = buckets[c][b] > largest ? buckets[c][b] : largest;
         }
-    } else if (strcmp(image->format, "P3") == 0) {
-        // P3 format (RGB)
-        // Writes 3 bytes at a time with a newline between each of the RGB pixel values
-        for (int i = 0; i < image->width * image->height; ++i) {
-            fprintf(file, "%hhu %hhu %hhu\n", image->data[i * 3], image->data[i * 3 + 1], image->data[i * 3 + 2]);
+    }
+    printf("\nHistogram (%d buckets from 0 to %d):\n", HISTOGRAM_BUCKETS, image->max_colour);
+    for (int c = 0; c < stats.channels; ++c) {
+        printf("%-8s |", stats.channels == 1 ? "Gray" : names[c]);
+        for (int b = 0; b < HISTOGRAM_BUCKETS; ++b) {
+            // Square root scale, so small but non-empty buckets still show
+            putchar(buckets[c][b] == 0 ? ' ' : shades[1 + (int)(sqrt((double)buckets[c][b] / largest) * (levels - 1) + 0.5)]);
         }
+        printf("|\n");
     }
 
-    fclose(file);
+    // Preview, darkest cells blank and brightest '@'
+    printf("\nPreview (%dx%d):\n", stats.previewWidth, stats.previewHeight);
+    for (int y = 0; y < stats.previewHeight; ++y) {
+        const unsigned char *cell = stats.preview + (size_t)y * stats.previewWidth;
+        for (int x = 0; x < stats.previewWidth; ++x) {
+            putchar(shades[(cell[x] * levels + 127) / 255]);
+        }
+        putchar('\n');
+    }
+    freeStatsPPM(&stats);
 }
 
-// 3: Function to display PPM image data (d).
-void displayPPM(PPMImage *image) {
+// X: Print every pixel value of an image, one RGB pixel (or a row of gray samples) per line
+void dumpPPM(PPMImage *image) {
+    if (image->planar && toInterleavedPPM(image) != 0) {
+        return;
+    }
+
     // Header info
     printf("\nFormat: %s\n", image->format);
     printf("Width: %d\n", image->width);    
@@ -366,204 +899,139 @@ void displayPPM(PPMImage *image) {
     // This is because the program uses 1-dimensional pointer managed data structures for efficiency
     // (although this does sacrifice readability)
     printf("Pixel Data:\n");
-    if (strcmp(image->format, "P2") == 0) {
-        // P2 format (grayscale)
-        // Display 1 byte at at a time
-        for (int i = 0; i < image->width * image->height; ++i) {
-            printf("%hhu ", image->data[i]);
-        }
-    } else if (strcmp(image->format, "P3") == 0) {
-        // P3 format (RGB)
-        // Display 3 bytes at a time
-        for (int i = 0; i < image->width * image->height; ++i) {
-            printf("%hhu %hhu %hhu\n", image->data[i * 3], image->data[i * 3 + 1], image->data[i * 3 + 2]);
-        }
+    fflush(stdout); // The pixel text bypasses stdio, so anything printed so far must go first
+
+    PPMWriter *writer = (PPMWriter *)malloc(sizeof(PPMWriter));
+    if (!writer) {
+        fprintf(stderr, "Memory allocation failed for the output buffer\n");
+        return;
     }
+    writer->fd = STDOUT_FILENO;
+    writer->used = 0;
+    writer->failed = 0;
+    writer->binary = 0;
+    writer->channels = image->channels;
+    writer->depth = SAMPLE_BYTES(image->max_colour);
+
+    // Same layout as an ASCII save: grayscale on one line, one RGB pixel per line
+    writePixelsPPM(writer, image->data, (size_t)image->width * (size_t)image->height * (size_t)image->channels);
+    flushWriterPPM(writer);
+    free(writer);
 }
 
 // 4: Function to add two images (a).
 PPMImage *addPPM(PPMImage *image1, PPMImage *image2) {
-    PPMImage *combinedImage = (PPMImage *)malloc(sizeof(PPMImage)); // Creates a data structure for the combined image
-
-    // Copies image1 header info to combined image
-    strcpy(combinedImage->format, image1->format);
-    combinedImage->width = image1->width;
-    combinedImage->height = image1->height;
-    combinedImage->max_colour = image1->max_colour;
-
-    // Allocate memory for combined image data
-    combinedImage->data = (unsigned char *)malloc(sizeof(image1->data));
-
-    // Combine the images pixel by pixel
-    for (int i = 0; i < combinedImage->width * combinedImage->height; i++) {
-        // Take the average of corresponding pixels from both images, for either grayscale or RGB
-        if (strcmp(combinedImage->format, "P2") == 0) {
-            // Grayscale add
+    // Both images must be laid out the same way, as samples are paired up by position
+    if (image1->planar != image2->planar) {
+        fprintf(stderr, "Error: Cannot add a planar image to an interleaved one.\n");
+        return NULL;
+    }
+
+    // Creates a data structure for the combined image, copying image1 header info
+    PPMImage *combinedImage = image1->planar
+        ? allocPlanarPPM(image1->format, image1->width, image1->height, image1->max_colour, image1->channels)
+        : allocPPM(image1->format, image1->width, image1->height, image1->max_colour, image1->channels);
+    if (combinedImage == NULL) {
+        return NULL;
+    }
+    TRACE_BEGIN(span, TRACE_ADD);
+
+    // Combine the images sample by sample (one sample per pixel for grayscale, three for RGB),
+    // taking the average of corresponding samples from both images. Planar images are done a whole
+    // plane at a time, padding included
+    size_t count = (size_t)combinedImage->width * (size_t)combinedImage->height * (size_t)combinedImage->channels;
+    if (combinedImage->planar) {
+        count = combinedImage->stride * (size_t)combinedImage->height * 3 / SAMPLE_BYTES(combinedImage->max_colour);
+    }
+    if (SAMPLE_BYTES(combinedImage->max_colour) == 2) {
+        // 16-bit samples: (a & b) + ((a ^ b) >> 1) is the rounded-down average without overflowing 16 bits
+        const uint16_t *a = (const uint16_t *)image1->data, *b = (const uint16_t *)image2->data;
+        uint16_t *out = (uint16_t *)combinedImage->data;
+        for (size_t i = 0; i < count; i++) {
+            out[i] = (uint16_t)((a[i] & b[i]) + ((a[i] ^ b[i]) >> 1));
+        }
+    } else {
+        for (size_t i = 0; i < count; i++) {
             combinedImage->data[i] = (image1->data[i] + image2->data[i]) / 2;
-        } else if (strcmp(combinedImage->format, "P3") == 0) {
-            // RGB add
-            combinedImage->data[i * 3] = (image1->data[i * 3] + image2->data[i * 3]) / 2; // Red pixel add
-            combinedImage->data[i * 3 + 1] = (image1->data[i * 3 + 1] + image2->data[i * 3 + 1]) / 2; // Green pixel add
-            combinedImage->data[i * 3 + 2] = (image1->data[i * 3 + 2] + image2->data[i * 3 + 2]) / 2; // Blue pixel add
         }
     }
+    TRACE_COUNT(TRACE_PIXELS, (size_t)combinedImage->width * (size_t)combinedImage->height);
+    TRACE_END(span);
 
     return combinedImage;
 }
 
 // 5: Function to edge detect (e).
+// Sobel through the convolution engine, with (|x| + |y|) / 2 as the edge strength and the pixels
+// without a full set of neighbours left black (see 'filterPPM' for the other kernels and borders)
 PPMImage *edgePPM(PPMImage *image) {
-    // Create a new PPMImage to store the results
-    PPMImage *edgeImage = (PPMImage*)malloc(sizeof(image));
-
-    // Copy header information to new image
-    strcpy(edgeImage->format, image->format);
-    edgeImage->width = image->width;
-    edgeImage->height = image->height;
-    edgeImage->max_colour = image->max_colour;
-
-    // Allocate memory for new image data
-    edgeImage->data = (unsigned char *)malloc(sizeof(image->data));
-
-    // Define Sobel kernels
-    int sobelX[3][3] = {{-1, 0, 1}, {-2, 0, 2}, {-1, 0, 1}};
-    int sobelY[3][3] = {{-1, -2, -1}, {0, 0, 0}, {1, 2, 1}};
-
-    // Note: for loops here use different starting values for mathematical reasons
-    if (strcmp(edgeImage->format, "P2") == 0) {
-         // Grayscale edge detection algorithm
-        for (int y = 1; y < image->height - 1; ++y) {
-            for (int x = 1; x < image->width - 1; ++x) {
-                // Apply the Sobel operator for grayscale
-                int intensityX = 0, intensityY = 0;
-
-                // For each row and column, apply the Sobel convolution matrix ('sliding window')
-                for (int row = -1; row <= 1; ++row) {
-                    for (int col = -1; col <= 1; ++col) {
-                        int idx = (y + row) * image->width + x + col;
-                        intensityX += sobelX[row + 1][col + 1] * image->data[idx]; // Grayscale horizontal convolution
-                        intensityY += sobelY[row + 1][col + 1] * image->data[idx]; // Grayscale vertical convolution
-                    }
-                }
-
-                // Combine the results
-                int resultIdx = y * image->width + x;
-                edgeImage->data[resultIdx] = (unsigned char)(abs(intensityX) + abs(intensityY)) / 2;
-            }
-        }   
-            
-    } else if (strcmp(edgeImage->format, "P3") == 0) {
-        // RGB edge detection algorithm
-        for (int y = 1; y < image->height - 1; ++y) {
-            for (int x = 1; x < image->width - 1; ++x) {
-                // Apply the Sobel operator for RGB
-                int redX = 0, greenX = 0, blueX = 0;
-                int redY = 0, greenY = 0, blueY = 0;
-
-                // For each row and column, apply the Sobel convolution matrix
-                for (int row = -1; row <= 1; ++row) {
-                    for (int col = -1; col <= 1; ++col) {
-                        int idx = 3 * ((y + row) * image->width + x + col); // Assigning pixel id for the data array (i.e. data[idx])
-                        redX += sobelX[row + 1][col + 1] * image->data[idx]; // Red pixel horizontal convolution
-                        greenX += sobelX[row + 1][col + 1] * image->data[idx + 1]; // Green pixel horizontal convolution
-                        blueX += sobelX[row + 1][col + 1] * image->data[idx + 2]; // Blue pixel horizontal convolution
-
-                        redY += sobelY[row + 1][col + 1] * image->data[idx]; // Red pixel vertical convolution
-                        greenY += sobelY[row + 1][col + 1] * image->data[idx + 1]; // Green pixel vertical convolution
-                        blueY += sobelY[row + 1][col + 1] * image->data[idx + 2]; // Blue pixel vertical convolution
-                    }
-                }
-
-                // Combine the results (magnitude calculation of Sobel function)
-                int resultIdx = 3 * (y * image->width + x); // Assigning pixel id for the data array (i.e. data[idx])
-                edgeImage->data[resultIdx] = (unsigned char)(abs(redX) + abs(redY)) / 2;
-                edgeImage->data[resultIdx + 1] = (unsigned char)(abs(greenX) + abs(greenY)) / 2;
-                edgeImage->data[resultIdx + 2] = (unsigned char)(abs(blueX) + abs(blueY)) / 2;
-            }
-        }
-    }
-    
-    return edgeImage;
+    return filterPPM(image, FILTER_SOBEL, BORDER_NONE, MAGNITUDE_L1);
 }
 
 // 6: Function to pattern detect (p).
+// Finds every place image2 appears in image1 and returns a copy of image1 with all of them boxed
 PPMImage *patternPPM(PPMImage *image1, PPMImage *image2) {
-    int x1, y1, x2, y2; // (x,y) coordinates for 
-
-    // For loops for image 1, for cycling through pixels relative to the width and height information of the images
-    for (x1 = 0; x1 <= image1->width - image2->width; ++x1) {
-        for (y1 = 0; y1 <= image1->height - image2->height; ++y1) {
-
-            int match = 1; // This variable will check for pixel matches between images
-                           // 1 for true (a match)
-                           // 0 for false (no match)
-
-            // Nested for loops for image 2
-            for (x2 = 0; x2 < image2->width; ++x2) {
-                for (y2 = 0; y2 < image2->height; ++y2) {
-                    int px1, px2;
-
-                    // Find pixel location (for either P2 or P3)
-                    // P2
-                    if (strcmp(image1->format, "P2") == 0) {
-                        px1 = (y1 + y2) * image1->width + (x1 + x2);
-                        px2 = y2 * image2->width + x2;
-
-                        // Check pixel equality for grayscale
-                        if (image1->data[px1] != image2->data[px2]) {
-                            match = 0;
-                            break;
-                        }
+    PPMMatch *matches;
+    int count = findPatternPPM(image1, image2, &matches);
 
-                    // P3
-                    } else if (strcmp(image1->format, "P3") == 0) {
-                        px1 = 3 * ((y1 + y2) * image1->width + (x1 + x2));
-                        px2 = 3 * (y2 * image2->width + x2);
-                        
-                        // Check pixel equality for RGB
-                        if (image1->data[px1] != image2->data[px2] ||
-                        image1->data[px1 + 1] != image2->data[px2 + 1] ||
-                        image1->data[px1 + 2] != image2->data[px2 + 2]) {
-                            match = 0;
-                            break;
-                        }
-                    }                    
-                }
+    if (count <= 0) {
+        if (count == 0) {
+            printf("Second image not found in the first image!\n");
+        }
+        return NULL;
+    }
 
-                // If match is still 0 after the image2 scan, then just restart on the next image1 position
-                if (!match) {
-                    break;
-                }
-            }
+    // Report the matches (a plain image can match at thousands of places, so only list the first few)
+    for (int i = 0; i < count && i < 20; ++i) {
+        printf("Second image found at position: (%d, %d)\n", matches[i].x, matches[i].y);
+    }
+    if (count > 20) {
+        printf("... and %d more positions (%d in total)\n", count - 20, count);
+    }
 
-            // If the (x2, y2) for loop completes without breaking, then a match has been found
-            if (match) {
-                printf("Second image found at position: (%d, %d)\n", x1, y1);
+    PPMImage *patternImage = boxMatchesPPM(image1, image2, matches, count);
+    free(matches);
+    return patternImage;
+}
 
-                // Creates a copy of image1:
-                // Create a new PPMImage to store the results
-                PPMImage *patternImage = (PPMImage*)malloc(sizeof(image1));
-                // Copy header information to new image
-                strcpy(patternImage->format, image1->format);
-                patternImage->width = image1->width;
-                patternImage->height = image1->height;
-                patternImage->max_colour = image1->max_colour;
-                // Allocate memory for new image data
-                patternImage->data = (unsigned char *)malloc(sizeof(image1->data));
-                // Copy data from image1 to patternImage
-                for (int i = 0; i < image1->width * image1->height * 3; i++) {
-                    patternImage->data[i] = image1->data[i];
-                }
+// X: Copy image1 and draw a box the size of image2 around every match, using 'drawBox()'
+PPMImage *boxMatchesPPM(PPMImage *image1, PPMImage *image2, const PPMMatch *matches, int count) {
+    if (image1->planar && toInterleavedPPM(image1) != 0) {
+        return NULL;
+    }
 
-                // Draws a box over the copied image using 'drawBox()'
-                patternImage = drawBox(patternImage, patternImage->width, patternImage->height, x1, y1, image2->width, image2->height);
-                return patternImage;
-            }
-        }
+    // Creates a copy of image1:
+    // Create a new PPMImage to store the results
+    PPMImage *patternImage = allocPPM(image1->format, image1->width, image1->height, image1->max_colour, image1->channels);
+    if (patternImage == NULL) {
+        return NULL;
     }
+    size_t length = (size_t)image1->width * (size_t)image1->height * (size_t)image1->channels * SAMPLE_BYTES(image1->max_colour);
+    // Copy data from image1 to patternImage
+    memcpy(patternImage->data, image1->data, length);
 
-    printf("Second image not found in the first image!\n");
-    return NULL;
+    // Draws a box over the copied image for every match
+    for (int i = 0; i < count; ++i) {
+        drawBox(patternImage, patternImage->width, patternImage->height, matches[i].x, matches[i].y, image2->width, image2->height);
+    }
+    return patternImage;
+}
+
+// X: 'drawBox' for 16-bit samples: white for grayscale, red for RGB
+static void drawBox16PPM(PPMImage *image, int width, int x, int y, int boxWidth, int boxHeight) {
+    uint16_t *data = (uint16_t *)image->data;
+    uint16_t colour[3] = {(uint16_t)image->max_colour, 0, 0};
+    int channels = image->channels;
+
+    // Top and bottom borders, then left and right
+    for (int i = x; i < x + boxWidth; ++i) {
+        memcpy(data + ((size_t)y * width + i) * channels, colour, sizeof(uint16_t) * channels);
+        memcpy(data + ((size_t)(y + boxHeight - 1) * width + i) * channels, colour, sizeof(uint16_t) * channels);
+    }
+    for (int j = y; j < y + boxHeight; ++j) {
+        memcpy(data + ((size_t)j * width + x) * channels, colour, sizeof(uint16_t) * channels);
+        memcpy(data + ((size_t)j * width + x + boxWidth - 1) * channels, colour, sizeof(uint16_t) * channels);
+    }
 }
 
 // X: Draw box around pattern-detected images, using arguments from 'patternPPM'
@@ -571,44 +1039,5977 @@ PPMImage *drawBox(PPMImage *image, int width, int height, int x, int y, int boxW
     // Draw a 1-pixel thick orange border around the specified region in the new image
     int i, j;
 
+    // 16-bit images get the same border at full intensity
+    if (SAMPLE_BYTES(image->max_colour) == 2) {
+        drawBox16PPM(image, width, x, y, boxWidth, boxHeight);
+        return image;
+    }
+
     // Grayscale border
-    if (strcmp(image->format, "P2") == 0) {
+    if (image->channels == 1) {
 
         // Top and bottom borders drawn using for loop
         for (i = x; i < x + boxWidth; ++i) {
-            image->data[y * width + i] = image->max_colour; // Set pixel value to maximum intensity (white)
-            image->data[(y + boxHeight - 1) * width + i] = image->max_colour;  
+            image->data[(size_t)y * width + i] = image->max_colour; // Set pixel value to maximum intensity (white)
+            image->data[(size_t)(y + boxHeight - 1) * width + i] = image->max_colour;  
         }
 
         // Left and right borders drawn using for loop
         for (j = y; j < y + boxHeight; ++j) {
-            image->data[j * width + x] = image->max_colour;
-            image->data[j * width + x + boxWidth - 1] = image->max_colour;  
+            image->data[(size_t)j * width + x] = image->max_colour;
+            image->data[(size_t)j * width + x + boxWidth - 1] = image->max_colour;  
         }
         
     // RGB border
-    } else if (strcmp(image->format, "P3") == 0) {
+    } else if (image->channels == 3) {
         // Top and bottom borders drawn using for loop
         for (i = x; i < x + boxWidth; ++i) {
-            image->data[(y * width + i) * 3] = 255; // Red
-            image->data[(y * width + i) * 3 + 1] = 0; // Green
-            image->data[(y * width + i) * 3 + 2] = 0; // Blue
+            image->data[((size_t)y * width + i) * 3] = 255; // Red
+            image->data[((size_t)y * width + i) * 3 + 1] = 0; // Green
+            image->data[((size_t)y * width + i) * 3 + 2] = 0; // Blue
 
-            image->data[((y + boxHeight - 1) * width + i) * 3] = 255; // Red
-            image->data[((y + boxHeight - 1) * width + i) * 3 + 1] = 0; // Green
-            image->data[((y + boxHeight - 1) * width + i) * 3 + 2] = 0; // Blue
+            image->data[((size_t)(y + boxHeight - 1) * width + i) * 3] = 255; // Red
+            image->data[((size_t)(y + boxHeight - 1) * width + i) * 3 + 1] = 0; // Green
+            image->data[((size_t)(y + boxHeight - 1) * width + i) * 3 + 2] = 0; // Blue
         }
 
         // Left and right borders drawn using for loop
         for (j = y; j < y + boxHeight; ++j) {
-            image->data[(j * width + x) * 3] = 255; // Red
-            image->data[(j * width + x) * 3 + 1] = 0; // Green
-            image->data[(j * width + x) * 3 + 2] = 0; // Blue
+            image->data[((size_t)j * width + x) * 3] = 255; // Red
+            image->data[((size_t)j * width + x) * 3 + 1] = 0; // Green
+            image->data[((size_t)j * width + x) * 3 + 2] = 0; // Blue
+
+            image->data[((size_t)j * width + x + boxWidth - 1) * 3] = 255; // Red
+            image->data[((size_t)j * width + x + boxWidth - 1) * 3 + 1] = 0; // Green
+            image->data[((size_t)j * width + x + boxWidth - 1) * 3 + 2] = 0; // Blue
+        }
+    }
+    return image;
+}
+// X: Parse a PPM header held in memory into 'image', used by 'mapPPM' and 'openStreamPPM'
+// Returns the offset of the first byte of pixel data, or 0 if the header is invalid
+size_t parseHeaderPPM(const unsigned char *buffer, size_t length, PPMImage *image, const char *filename) {
+    // Checks file format is correct before continuing
+    if (length < 2 || buffer[0] != 'P' || buffer[1] < '2' || buffer[1] > '6' || buffer[1] == '4') {
+        fprintf(stderr, "Invalid PPM file format. This program only uses P2, P3, P5 or P6 formatted PPMs.\n");
+        return 0; // Throws error and returns if format is wrong
+    }
+    image->format[0] = 'P';
+    image->format[1] = (char)buffer[1];
+    image->format[2] = '\0';
 
-            image->data[(j * width + x + boxWidth - 1) * 3] = 255; // Red
-            image->data[(j * width + x + boxWidth - 1) * 3 + 1] = 0; // Green
-            image->data[(j * width + x + boxWidth - 1) * 3 + 2] = 0; // Blue
+    // Parse the header: magic, width, height and max colour, separated by whitespace or '#' comments
+    size_t pos = 2;
+    int values[3] = {0, 0, 0};
+    for (int field = 0; field < 3; ++field) {
+        // Skip whitespace and comments
+        while (pos < length && (buffer[pos] == '#' || buffer[pos] == ' ' || (buffer[pos] >= '\t' && buffer[pos] <= '\r'))) {
+            if (buffer[pos] == '#') {
+                while (pos < length && buffer[pos] != '\n') {
+                    ++pos;
+                }
+            } else {
+                ++pos;
+            }
+        }
+
+        // Read the number
+        long value = 0;
+        size_t start = pos;
+        while (pos < length && buffer[pos] >= '0' && buffer[pos] <= '9' && value <= INT32_MAX) {
+            value = value * 10 + (buffer[pos++] - '0');
         }
+        if (pos == start || value > INT32_MAX) {
+            break; // Missing or oversized field, reported by the header check below
+        }
+        values[field] = (int)value;
+    }
+    // Exactly one whitespace character separates the header from the pixel data
+    ++pos;
+
+    image->width = values[0];
+    image->height = values[1];
+    image->max_colour = values[2];
+    image->channels = (buffer[1] == '2' || buffer[1] == '5') ? 1 : 3;
+
+    // Error checks
+    // Check the header was complete
+    if (image->width <= 0 || image->height <= 0 || image->max_colour <= 0 || pos > length) {
+        fprintf(stderr, "Invalid PPM header in %s\n", filename);
+        return 0;
+    }
+    // Samples are 8-bit up to a max colour of 255 and 16-bit above it, as in the PPM specification
+    if (image->max_colour > 65535) {
+        fprintf(stderr, "Error: PPMs with a max colour above 65535 are not supported.\n");
+        return 0;
+    }
+    // Check the pixel count fits in memory sizes
+    size_t dataLength = (size_t)image->width * (size_t)image->height * (size_t)image->channels * SAMPLE_BYTES(image->max_colour);
+    if (dataLength / SAMPLE_BYTES(image->max_colour) / (size_t)image->channels / (size_t)image->width != (size_t)image->height) {
+        fprintf(stderr, "Error: %s is too large.\n", filename);
+        return 0;
+    }
+    return pos;
+}
+
+// X: Memory-map a PPM file and read its header, used by 'readPPM'
+// 'data' is left pointing at the first byte after the header. For binary (P5/P6) images these are
+// the pixels themselves; the mapping is private, so any operation that writes to 'data' gets its
+// own copy-on-write pages and the file on disk is never modified
+PPMImage *mapPPM(const char *filename) {
+    // Attempts to open file
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        perror("Error opening file");
+        return NULL;
     }
+
+    // Allocates memory for file
+    PPMImage *image = newHeaderPPM();
+    // Error if fails to allocate memory
+    if (!image) {
+        close(fd);
+        return NULL;
+    }
+
+    // Map the whole file; the descriptor is not needed once the mapping exists
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0) {
+        fprintf(stderr, "Error: Could not determine the size of %s\n", filename);
+        close(fd);
+        freePPM(image);
+        return NULL;
+    }
+    size_t length = (size_t)info.st_size;
+    unsigned char *map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("Error mapping file");
+        freePPM(image);
+        return NULL;
+    }
+
+    // Read the header
+    size_t pos = parseHeaderPPM(map, length, image, filename);
+    if (pos == 0) {
+        munmap(map, length);
+        freePPM(image);
+        return NULL;
+    }
+
+    // Check the file holds every pixel (ASCII files are checked as they are decoded)
+    size_t dataLength = (size_t)image->width * (size_t)image->height * (size_t)image->channels * SAMPLE_BYTES(image->max_colour);
+    if (isBinaryPPM(image) && dataLength > length - pos) {
+        fprintf(stderr, "Error: %s is shorter than its header says.\n", filename);
+        munmap(map, length);
+        freePPM(image);
+        return NULL;
+    }
+
+    TRACE_COUNT(TRACE_BYTES_READ, length);
+
+    image->data = map + pos;
+    image->map = map;
+    image->mapLength = length;
     return image;
-}
\ No newline at end of file
+}
+
+// X: Read one ASCII sample the slow way, skipping any whitespace and '#' comments before it
+// Returns 0 on success, -1 if the text ran out and -2 on an unexpected character
+static int readSamplePPM(PPMReader *reader, unsigned int *value) {
+    const unsigned char *pos = reader->pos;
+
+    // Skip whitespace and comments
+    while (1) {
+        if (pos == reader->end) {
+            reader->pos = pos;
+            if (fillReaderPPM(reader) == 0) {
+                return -1;
+            }
+            pos = reader->pos;
+        }
+        if (*pos == '#') {
+            // The comment may run on into the next chunk of a streamed file
+            while (*pos != '\n') {
+                if (++pos == reader->end) {
+                    reader->pos = pos;
+                    if (fillReaderPPM(reader) == 0) {
+                        return -1;
+                    }
+                    pos = reader->pos;
+                }
+            }
+        } else if (*pos == ' ' || (unsigned char)(*pos - '\t') < 5) {
+            ++pos;
+        } else {
+            break;
+        }
+    }
+
+    if ((unsigned char)(*pos - '0') >= 10) {
+        reader->pos = pos;
+        return -2;
+    }
+
+    // Read the digits (capped so an absurdly long number cannot overflow)
+    unsigned int number = 0;
+    while ((unsigned char)(*pos - '0') < 10) {
+        if (number < 100000) {
+            number = number * 10 + (*pos - '0');
+        }
+        if (++pos == reader->end) {
+            reader->pos = pos;
+            if (fillReaderPPM(reader) == 0) {
+                break;
+            }
+            pos = reader->pos;
+        }
+    }
+
+    reader->pos = pos;
+    *value = number;
+    return 0;
+}
+
+// X: Decode 'count' ASCII samples into 'data', checking each against max_colour
+// Whole 16-byte blocks of plain digits and whitespace are split into numbers using SSE2 masks,
+// so the common case never looks at a byte twice. Blocks holding comments or anything unusual
+// fall back to 'readSamplePPM' one number at a time. Returns 0 on success.
+int readSamplesPPM(PPMReader *reader, unsigned char *data, size_t count, int max_colour) {
+    size_t i = 0;
+    unsigned int tooBig = 0; // Collects any value over max_colour without branching
+
+#ifdef __SSE2__
+    const __m128i zero = _mm_set1_epi8('0');
+    const __m128i nine = _mm_set1_epi8(9);
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i four = _mm_set1_epi8(4);
+    const __m128i space = _mm_set1_epi8(' ');
+
+    // 'pos' always sits at the start of a number or on whitespace, never part way through a number
+    while (i < count) {
+        if (reader->end - reader->pos < 16 && (fillReaderPPM(reader) == 0 || reader->end - reader->pos < 16)) {
+            break;
+        }
+        const unsigned char *pos = reader->pos;
+        __m128i block = _mm_loadu_si128((const __m128i *)pos);
+
+        // Digits are '0'..'9'; whitespace is ' ' or '\t'..'\r'
+        __m128i digitOffset = _mm_sub_epi8(block, zero);
+        __m128i spaceOffset = _mm_sub_epi8(block, tab);
+        unsigned int digits = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(digitOffset, nine), digitOffset));
+        unsigned int spaces = (unsigned int)_mm_movemask_epi8(_mm_or_si128(
+            _mm_cmpeq_epi8(_mm_min_epu8(spaceOffset, four), spaceOffset), _mm_cmpeq_epi8(block, space)));
+
+        // Comments or bad characters: decode one number the slow way
+        if ((digits | spaces) != 0xFFFF) {
+            unsigned int value;
+            if (readSamplePPM(reader, &value) != 0) {
+                return -1;
+            }
+            tooBig |= value > (unsigned int)max_colour;
+            data[i++] = (unsigned char)value;
+            continue;
+        }
+
+        // Numbers start where a digit follows a non-digit and end where a non-digit follows a digit.
+        // The last byte is left out of the ends, as the number may carry on into the next block.
+        // Shifting the digit mask up by 3 lets each number look back at the three bytes before its
+        // last digit; bytes before the block count as non-digits
+        unsigned int starts = digits & ~(digits << 1);
+        unsigned int ends = digits & ~(digits >> 1) & 0x7FFF;
+        unsigned int behind = digits << 3;
+        int next = 0; // Where the next block starts
+        int slow = 0; // Set when a number is too long for the fast path
+
+        // A block holds at most 8 numbers, so the count only needs checking near the end
+        if (count - i < 8) {
+            while (ends != 0 && count - i < (size_t)__builtin_popcount(ends)) {
+                ends &= ~(1u << (31 - __builtin_clz(ends))); // Drop numbers past the end of the image
+            }
+        }
+
+        while (ends != 0) {
+            int last = __builtin_ctz(ends);
+            const unsigned char *unit = pos + last;
+            unsigned int tens = (behind >> (last + 2)) & 1;
+            unsigned int hundreds = tens & (behind >> (last + 1));
+
+            // Leading zeros or an oversized value: hand over to the slow path from its first digit
+            if (hundreds & (behind >> last)) {
+                next = 31 - __builtin_clz(starts & ((2u << last) - 1));
+                slow = 1;
+                break;
+            }
+
+            // Work back from the last digit without branching on the length, as lengths are
+            // random in real images. The two bytes before any number are always readable:
+            // in a mapped file the header comes first, and chunk buffers keep a margin in front
+            unsigned int value = (unsigned int)(unit[0] - '0')
+                + tens * 10 * (unsigned int)(unit[-1] - '0')
+                + hundreds * 100 * (unsigned int)(unit[-2] - '0');
+
+            tooBig |= value > (unsigned int)max_colour;
+            data[i++] = (unsigned char)value;
+            ends &= ends - 1;
+            next = last + 1;
+        }
+
+        if (!slow && i < count) {
+            // A number left unfinished at the end of the block is picked up from its first digit
+            starts &= ~((1u << next) - 1);
+            if (starts == 0) {
+                next = 16;
+            } else {
+                next = __builtin_ctz(starts);
+                slow = (next == 0); // Sixteen digits in a row
+            }
+        }
+        if (slow) {
+            unsigned int value;
+            reader->pos = pos + next;
+            if (readSamplePPM(reader, &value) != 0) {
+                return -1;
+            }
+            tooBig |= value > (unsigned int)max_colour;
+            data[i++] = (unsigned char)value;
+            continue;
+        }
+        reader->pos = pos + next;
+    }
+#endif
+
+    // Tail of the file (or every sample, without SSE2)
+    for (; i < count; ++i) {
+        unsigned int value;
+        if (readSamplePPM(reader, &value) != 0) {
+            return -1;
+        }
+        tooBig |= value > (unsigned int)max_colour;
+        data[i] = (unsigned char)value;
+    }
+
+    if (tooBig) {
+        fprintf(stderr, "Error: Pixel value greater than the max colour of %d\n", max_colour);
+        return -1;
+    }
+    return 0;
+}
+
+// X: Decode 'count' 16-bit ASCII samples into 'data', checking each against max_colour
+// Files this deep are rare, so they simply go one number at a time. Returns 0 on success
+int readSamples16PPM(PPMReader *reader, uint16_t *data, size_t count, int max_colour) {
+    for (size_t i = 0; i < count; ++i) {
+        unsigned int value;
+        if (readSamplePPM(reader, &value) != 0) {
+            return -1;
+        }
+        if (value > (unsigned int)max_colour) {
+            fprintf(stderr, "Error: Pixel value greater than the max colour of %d\n", max_colour);
+            return -1;
+        }
+        data[i] = (uint16_t)value;
+    }
+    return 0;
+}
+
+// X: Copy 16-bit samples from file byte order (most significant byte first) into 'out'
+// 'out' may be the same memory as 'in'. Written as plain shifts so the compiler vectorizes it
+void swapSamplesPPM(uint16_t *out, const unsigned char *in, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        out[i] = (uint16_t)(in[2 * i] << 8 | in[2 * i + 1]);
+    }
+}
+
+// X: Text for every 8-bit sample value followed by a space, padded to 4 bytes each,
+// so a sample is formatted with one fixed-size copy instead of a printf call
+static const char digitTable[256 * 4 + 1] =
+    "0   1   2   3   4   5   6   7   8   9   10  11  12  13  14  15  "
+    "16  17  18  19  20  21  22  23  24  25  26  27  28  29  30  31  "
+    "32  33  34  35  36  37  38  39  40  41  42  43  44  45  46  47  "
+    "48  49  50  51  52  53  54  55  56  57  58  59  60  61  62  63  "
+    "64  65  66  67  68  69  70  71  72  73  74  75  76  77  78  79  "
+    "80  81  82  83  84  85  86  87  88  89  90  91  92  93  94  95  "
+    "96  97  98  99  100 101 102 103 104 105 106 107 108 109 110 111 "
+    "112 113 114 115 116 117 118 119 120 121 122 123 124 125 126 127 "
+    "128 129 130 131 132 133 134 135 136 137 138 139 140 141 142 143 "
+    "144 145 146 147 148 149 150 151 152 153 154 155 156 157 158 159 "
+    "160 161 162 163 164 165 166 167 168 169 170 171 172 173 174 175 "
+    "176 177 178 179 180 181 182 183 184 185 186 187 188 189 190 191 "
+    "192 193 194 195 196 197 198 199 200 201 202 203 204 205 206 207 "
+    "208 209 210 211 212 213 214 215 216 217 218 219 220 221 222 223 "
+    "224 225 226 227 228 229 230 231 232 233 234 235 236 237 238 239 "
+    "240 241 242 243 244 245 246 247 248 249 250 251 252 253 254 255 ";
+
+// X: Send everything in the writer's buffer to its file, returning 0 if every write succeeded
+int flushWriterPPM(PPMWriter *writer) {
+    size_t done = 0;
+    while (done < writer->used && !writer->failed) {
+        ssize_t written = write(writer->fd, writer->buffer + done, writer->used - done);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            perror("Error writing file");
+            writer->failed = 1;
+            break;
+        }
+        done += (size_t)written;
+    }
+    TRACE_COUNT(TRACE_BYTES_WRITTEN, done);
+    writer->used = 0;
+    return writer->failed ? -1 : 0;
+}
+
+// X: Append raw bytes to the writer; large blocks skip the buffer and are written directly
+void writeBytesPPM(PPMWriter *writer, const void *bytes, size_t length) {
+    if (writer->used + length <= WRITE_BUFFER_SIZE) {
+        memcpy(writer->buffer + writer->used, bytes, length);
+        writer->used += length;
+        return;
+    }
+
+    flushWriterPPM(writer);
+    const char *pos = (const char *)bytes;
+    while (length > 0 && !writer->failed) {
+        ssize_t written = write(writer->fd, pos, length);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            perror("Error writing file");
+            writer->failed = 1;
+            break;
+        }
+        pos += written;
+        length -= (size_t)written;
+        TRACE_COUNT(TRACE_BYTES_WRITTEN, written);
+    }
+}
+
+// X: Append 'count' samples as ASCII text: grayscale samples are separated by spaces,
+// RGB samples are written one pixel per line
+void writeSamplesPPM(PPMWriter *writer, const unsigned char *data, size_t count, int channels) {
+    size_t i = 0;
+    while (i < count) {
+        // Each sample takes at most 4 bytes, so work in batches that are sure to fit
+        size_t room = (WRITE_BUFFER_SIZE - writer->used) / 4;
+        if (room < 3) {
+            if (flushWriterPPM(writer) != 0) {
+                return;
+            }
+            continue;
+        }
+        size_t batch = count - i < room ? count - i : room - room % 3;
+        char *out = writer->buffer + writer->used;
+
+        if (channels == 1) {
+            // P2 format (grayscale)
+            for (size_t j = 0; j < batch; ++j) {
+                unsigned char value = data[i + j];
+                memcpy(out, digitTable + value * 4, 4);
+                out += 2 + (value >= 10) + (value >= 100);
+            }
+        } else {
+            // P3 format (RGB), ending each pixel with a newline instead of a space
+            for (size_t j = 0; j < batch; j += 3) {
+                for (int c = 0; c < 3; ++c) {
+                    unsigned char value = data[i + j + c];
+                    memcpy(out, digitTable + value * 4, 4);
+                    out += 2 + (value >= 10) + (value >= 100);
+                }
+                out[-1] = '\n';
+            }
+        }
+
+        writer->used = (size_t)(out - writer->buffer);
+        i += batch;
+    }
+}
+
+// X: Append 'count' 16-bit samples as ASCII text, laid out like 'writeSamplesPPM'
+static void writeSamples16PPM(PPMWriter *writer, const uint16_t *data, size_t count, int channels) {
+    for (size_t i = 0; i < count; ++i) {
+        // Each sample takes at most 6 bytes
+        if (WRITE_BUFFER_SIZE - writer->used < 6 && flushWriterPPM(writer) != 0) {
+            return;
+        }
+        char digits[6];
+        int length = 0;
+        unsigned int value = data[i];
+        do {
+            digits[length++] = (char)('0' + value % 10);
+            value /= 10;
+        } while (value != 0);
+
+        char *out = writer->buffer + writer->used;
+        for (int j = 0; j < length; ++j) {
+            out[j] = digits[length - 1 - j];
+        }
+        out[length] = (channels == 3 && i % 3 == 2) ? '\n' : ' ';
+        writer->used += (size_t)length + 1;
+    }
+}
+
+// X: Pull the next chunk of a streamed file into the reader, keeping any bytes not yet used
+// Returns the number of new bytes, which is 0 at the end of the file or when the file is already in memory
+size_t fillReaderPPM(PPMReader *reader) {
+    if (reader->fd < 0) {
+        return 0;
+    }
+
+    // Move the leftovers to the front, after the margin the tokenizer may look back into
+    unsigned char *start = reader->buffer + READ_MARGIN;
+    size_t left = (size_t)(reader->end - reader->pos);
+    memmove(start, reader->pos, left);
+
+    ssize_t got;
+    do {
+        got = read(reader->fd, start + left, reader->capacity - READ_MARGIN - left);
+    } while (got < 0 && errno == EINTR);
+    if (got < 0) {
+        perror("Error reading file");
+        got = 0;
+    }
+    TRACE_COUNT(TRACE_BYTES_READ, got);
+
+    reader->pos = start;
+    reader->end = start + left + got;
+    return (size_t)got;
+}
+
+// X: Open a PPM file for streaming and read its header, without loading any pixel data
+// Returns a header-only image ('data' is NULL), with 'reader' left at the first pixel
+// A filename of "-" reads standard input, where more frames may follow (see 'nextFramePPM')
+PPMImage *openStreamPPM(const char *filename, PPMReader *reader) {
+    reader->fd = strcmp(filename, "-") == 0 ? dup(STDIN_FILENO) : open(filename, O_RDONLY);
+    if (reader->fd < 0) {
+        perror("Error opening file");
+        return NULL;
+    }
+
+    PPMImage *header = newHeaderPPM();
+    reader->capacity = READ_BUFFER_SIZE;
+    reader->buffer = (unsigned char *)malloc(reader->capacity);
+    if (!header || !reader->buffer) {
+        fprintf(stderr, "Memory allocation failed for the input stream\n");
+        freePPM(header);
+        closeStreamPPM(reader);
+        return NULL;
+    }
+    memset(reader->buffer, ' ', READ_MARGIN);
+    reader->pos = reader->end = reader->buffer + READ_MARGIN;
+
+    if (nextFramePPM(reader, header, filename) != 1) {
+        fprintf(stderr, "Error: No PPM header found in %s\n", filename);
+        freePPM(header);
+        closeStreamPPM(reader);
+        return NULL;
+    }
+    return header;
+}
+
+// X: Check whether 'buffer' holds a whole PPM header: magic, three numbers and the whitespace after them
+// Anything malformed counts as whole, so 'parseHeaderPPM' gets to report it
+static int headerCompletePPM(const unsigned char *buffer, size_t length) {
+    size_t pos = 2;
+    for (int field = 0; field < 3; ++field) {
+        while (pos < length && (buffer[pos] == '#' || buffer[pos] == ' ' || (buffer[pos] >= '\t' && buffer[pos] <= '\r'))) {
+            if (buffer[pos] == '#') {
+                while (pos < length && buffer[pos] != '\n') {
+                    ++pos;
+                }
+            } else {
+                ++pos;
+            }
+        }
+        size_t start = pos;
+        while (pos < length && buffer[pos] >= '0' && buffer[pos] <= '9') {
+            ++pos;
+        }
+        if (pos == length) {
+            return 0; // Ran out, possibly part way through a number
+        }
+        if (pos == start) {
+            return 1;
+        }
+    }
+    return 1;
+}
+
+// X: Read the header of the next image in a stream, which may hold several one after another (as from
+// 'ffmpeg -f image2pipe -c:v ppm'). Returns 1 with 'header' filled in and 'reader' at its first pixel,
+// 0 at the end of the stream, or -1 if what follows is not a PPM header
+int nextFramePPM(PPMReader *reader, PPMImage *header, const char *name) {
+    // Frames may be separated by whitespace (ASCII frames usually end with a newline)
+    while (1) {
+        while (reader->pos < reader->end && (*reader->pos == ' ' || (*reader->pos >= '\t' && *reader->pos <= '\r'))) {
+            reader->pos++;
+        }
+        if (reader->pos < reader->end) {
+            break;
+        }
+        if (fillReaderPPM(reader) == 0) {
+            return 0;
+        }
+    }
+
+    // A pipe hands over whatever has been written so far, so keep reading until the whole header is here
+    while (!headerCompletePPM(reader->pos, (size_t)(reader->end - reader->pos)) && fillReaderPPM(reader) > 0) {
+    }
+    size_t offset = parseHeaderPPM(reader->pos, (size_t)(reader->end - reader->pos), header, name);
+    if (offset == 0) {
+        return -1;
+    }
+    reader->pos += offset;
+    return 1;
+}
+
+// X: Read the next row of pixels from a streamed file into 'row'. Returns 0 on success
+int readRowPPM(PPMReader *reader, const PPMImage *header, unsigned char *row) {
+    size_t count = (size_t)header->width * (size_t)header->channels;
+
+    // ASCII rows go through the tokenizer
+    int depth = SAMPLE_BYTES(header->max_colour);
+    if (!isBinaryPPM(header)) {
+        return depth == 2 ? readSamples16PPM(reader, (uint16_t *)row, count, header->max_colour)
+                          : readSamplesPPM(reader, row, count, header->max_colour);
+    }
+    unsigned char *start = row;
+    size_t samples = count;
+    count *= (size_t)depth;
+
+    // Binary rows are copied out of the chunk buffer
+    while (count > 0) {
+        if (reader->pos == reader->end && fillReaderPPM(reader) == 0) {
+            return -1;
+        }
+        size_t take = (size_t)(reader->end - reader->pos);
+        if (take > count) {
+            take = count;
+        }
+        memcpy(row, reader->pos, take);
+        reader->pos += take;
+        row += take;
+        count -= take;
+    }
+
+    // 16-bit samples are put into the machine's byte order where they are
+    if (depth == 2) {
+        swapSamplesPPM((uint16_t *)start, start, samples);
+    }
+    return 0;
+}
+
+// X: Close a streamed file opened by 'openStreamPPM'
+void closeStreamPPM(PPMReader *reader) {
+    if (reader->fd >= 0) {
+        close(reader->fd);
+    }
+    free(reader->buffer);
+    reader->fd = -1;
+    reader->buffer = NULL;
+}
+
+// X: Create a PPM file and write its header, ready for pixels to be added with 'writePixelsPPM'
+// Only the header fields of 'header' are used, so images can be written a row at a time
+PPMWriter *beginSavePPM(const char *filename, const PPMImage *header, int binary) {
+    PPMWriter *writer = (PPMWriter *)malloc(sizeof(PPMWriter));
+    if (!writer) {
+        fprintf(stderr, "Memory allocation failed for the output buffer\n");
+        return NULL;
+    }
+
+    // "-" is standard output, which stays open for the next image
+    writer->fd = strcmp(filename, "-") == 0 ? dup(STDOUT_FILENO) : open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    writer->used = 0;
+    writer->failed = 0;
+    writer->binary = binary;
+    writer->channels = header->channels;
+    writer->depth = SAMPLE_BYTES(header->max_colour);
+
+    // Throw error if file open fails
+    if (writer->fd < 0) {
+        perror("Error opening file");
+        free(writer);
+        return NULL;
+    }
+
+    // Write header
+    const char *format;
+    if (binary) {
+        format = (header->channels == 1) ? "P5" : "P6";
+    } else {
+        format = (header->channels == 1) ? "P2" : "P3";
+    }
+    char text[64];
+    int textLength = snprintf(text, sizeof(text), "%s\n%d %d\n%d\n", format, header->width, header->height, header->max_colour);
+    writeBytesPPM(writer, text, (size_t)textLength);
+    return writer;
+}
+
+// X: Append 'count' pixel samples to a file started with 'beginSavePPM'
+// 16-bit samples are converted to the file's byte order on the way into the buffer
+void writePixelsPPM(PPMWriter *writer, const unsigned char *data, size_t count) {
+    if (writer->depth == 2 && writer->binary) {
+        const uint16_t *samples = (const uint16_t *)data;
+        while (count > 0) {
+            size_t room = (WRITE_BUFFER_SIZE - writer->used) / 2;
+            if (room == 0) {
+                if (flushWriterPPM(writer) != 0) {
+                    return;
+                }
+                continue;
+            }
+            size_t batch = count < room ? count : room;
+            unsigned char *out = (unsigned char *)writer->buffer + writer->used;
+            for (size_t i = 0; i < batch; ++i) {
+                out[2 * i] = (unsigned char)(samples[i] >> 8);
+                out[2 * i + 1] = (unsigned char)samples[i];
+            }
+            writer->used += batch * 2;
+            samples += batch;
+            count -= batch;
+        }
+    } else if (writer->depth == 2) {
+        writeSamples16PPM(writer, (const uint16_t *)data, count, writer->channels);
+    } else if (writer->binary) {
+        writeBytesPPM(writer, data, count);
+    } else {
+        writeSamplesPPM(writer, data, count, writer->channels);
+    }
+}
+
+// X: Flush and close a file started with 'beginSavePPM'. Returns 0 if everything was written
+int endSavePPM(PPMWriter *writer) {
+    int status = flushWriterPPM(writer);
+    if (status == 0) {
+        writeBehindPPM(writer->fd);
+    }
+    if (close(writer->fd) != 0) {
+        status = -1;
+    }
+    free(writer);
+    return status;
+}
+
+// X: Check whether an image was read from a binary (P5/P6) file
+int isBinaryPPM(const PPMImage *image) {
+    return image->format[1] == '5' || image->format[1] == '6';
+}
+
+// X: Sobel edge detection for one row, from the rows above and below it
+// The first and last pixels have no left/right neighbours, so they are left black
+void edgeRowPPM(const unsigned char *above, const unsigned char *row, const unsigned char *below, unsigned char *out, int width, int channels, int max_colour) {
+    memset(out, 0, (size_t)channels);
+    memset(out + (size_t)(width - 1) * channels, 0, (size_t)channels);
+
+    // Samples are convolved with their neighbours one pixel ('channels' samples) to either side
+    if (width > 2) {
+        edgeRowKernel(above, row, below, out, channels, (width - 1) * channels, channels, max_colour);
+    }
+}
+
+// X: 'edgeRowPPM' for 16-bit samples
+void edgeRow16PPM(const unsigned char *above, const unsigned char *row, const unsigned char *below, unsigned char *out, int width, int channels, int max_colour) {
+    memset(out, 0, (size_t)channels * 2);
+    memset(out + (size_t)(width - 1) * channels * 2, 0, (size_t)channels * 2);
+
+    if (width > 2) {
+        edgeRow16Kernel((const uint16_t *)above, (const uint16_t *)row, (const uint16_t *)below, (uint16_t *)out,
+                        channels, (width - 1) * channels, channels, max_colour);
+    }
+}
+
+// X: Edge detect a file too large to load, streaming it a row at a time (l)
+// Only three input rows and one output row are held in memory, whatever the image height.
+// Produces the same pixels as 'edgePPM', in the same encoding as the input. Returns 0 on success
+int edgeStreamPPM(const char *inputFile, const char *outputFile) {
+    PPMReader reader;
+    PPMImage *header = openStreamPPM(inputFile, &reader);
+    if (header == NULL) {
+        return -1;
+    }
+
+    PPMWriter *writer = beginSavePPM(outputFile, header, isBinaryPPM(header));
+    if (writer == NULL) {
+        freePPM(header);
+        closeStreamPPM(&reader);
+        return -1;
+    }
+    TRACE_BEGIN(span, TRACE_STREAM);
+
+    // Ring of the three most recent input rows, plus one output row
+    size_t samples = (size_t)header->width * (size_t)header->channels;
+    size_t rowLength = samples * SAMPLE_BYTES(header->max_colour);
+    EdgeRowFunction edgeRow = SAMPLE_BYTES(header->max_colour) == 2 ? edgeRow16PPM : edgeRowPPM;
+    unsigned char *ring = (unsigned char *)malloc(rowLength * 4);
+    int status = ring ? 0 : -1;
+    if (ring == NULL) {
+        fprintf(stderr, "Memory allocation failed for the row buffers\n");
+    }
+
+    // The top row has no neighbours above it, so it is left black
+    if (status == 0) {
+        unsigned char *out = ring + rowLength * 3;
+        memset(out, 0, rowLength);
+        writePixelsPPM(writer, out, samples);
+        status = readRowPPM(&reader, header, ring);
+    }
+    if (status == 0 && header->height > 1) {
+        status = readRowPPM(&reader, header, ring + rowLength);
+    }
+
+    // Row y is convolved once row y + 1 has arrived
+    for (int y = 1; status == 0 && y < header->height - 1; ++y) {
+        unsigned char *above = ring + rowLength * (size_t)((y - 1) % 3);
+        unsigned char *row = ring + rowLength * (size_t)(y % 3);
+        unsigned char *below = ring + rowLength * (size_t)((y + 1) % 3);
+        unsigned char *out = ring + rowLength * 3;
+
+        status = readRowPPM(&reader, header, below);
+        if (status == 0) {
+            edgeRow(above, row, below, out, header->width, header->channels, header->max_colour);
+            writePixelsPPM(writer, out, samples);
+        }
+    }
+
+    // The bottom row is left black too
+    if (status == 0 && header->height > 1) {
+        unsigned char *out = ring + rowLength * 3;
+        memset(out, 0, rowLength);
+        writePixelsPPM(writer, out, samples);
+    }
+    if (status != 0 && ring != NULL) {
+        fprintf(stderr, "Error: Failed to read the pixel data in %s\n", inputFile);
+    }
+
+    if (endSavePPM(writer) != 0) {
+        fprintf(stderr, "Error: Failed to write %s\n", outputFile);
+        status = -1;
+    }
+    if (status == 0) {
+        TRACE_COUNT(TRACE_PIXELS, (size_t)header->width * (size_t)header->height);
+    }
+    TRACE_END(span);
+    free(ring);
+    freePPM(header);
+    closeStreamPPM(&reader);
+    return status;
+}
+
+//----------------BUFFER POOL--------------//
+//-----------------------------------------//
+// Pixel buffers are recycled through size classes a quarter of a power of two apart, so a batch
+// of similar images stops going back to malloc (and the kernel, for large buffers) after the first one
+typedef struct {
+    pthread_mutex_t lock;
+    void *buffers[POOL_CLASSES]; // Free buffers of each class, linked through their first bytes
+    PPMImage *headers; // Free image headers, linked through 'next'
+    size_t cached; // Bytes currently held in the free lists
+    size_t limit; // Most bytes the free lists may hold
+    int ready;
+} BufferPool;
+
+static BufferPool bufferPool = {PTHREAD_MUTEX_INITIALIZER, {NULL}, NULL, 0, 0, 0};
+static __thread PPMArena *currentArena = NULL; // Arena that new images on this thread belong to
+
+// X: Size in bytes of a buffer pool class
+static size_t poolSizePPM(int poolClass) {
+    size_t base = (size_t)4096 << (poolClass / 4);
+    return base + base / 4 * (size_t)(poolClass % 4);
+}
+
+// X: Smallest pool class that fits 'length' bytes, or -1 if it is too large to pool
+static int poolClassPPM(size_t length) {
+    for (int poolClass = 0; poolClass < POOL_CLASSES; poolClass++) {
+        if (poolSizePPM(poolClass) >= length) {
+            return poolClass;
+        }
+    }
+    return -1;
+}
+
+// X: Read the cache limit on first use (call with the pool locked)
+static void readyPoolPPM(void) {
+    if (!bufferPool.ready) {
+        const char *megabytes = getenv("IMAGEPROC_POOL_MB");
+        bufferPool.limit = (size_t)(megabytes != NULL ? atol(megabytes) : POOL_LIMIT_MB) << 20;
+        bufferPool.ready = 1;
+    }
+}
+
+// X: Take a buffer of at least 'length' bytes from the pool, allocating one if its class is empty
+// Sets '*poolClass' to the buffer's class (-1 if it was malloc'd directly). The contents are undefined
+unsigned char *takeBufferPPM(size_t length, int *poolClass) {
+    int found = poolClassPPM(length);
+    *poolClass = found;
+    if (found < 0) {
+        void *buffer;
+        return posix_memalign(&buffer, PLANE_ALIGN, length) == 0 ? (unsigned char *)buffer : NULL;
+    }
+
+    pthread_mutex_lock(&bufferPool.lock);
+    void *buffer = bufferPool.buffers[found];
+    if (buffer != NULL) {
+        bufferPool.buffers[found] = *(void **)buffer;
+        bufferPool.cached -= poolSizePPM(found);
+    }
+    pthread_mutex_unlock(&bufferPool.lock);
+
+    if (buffer == NULL) {
+        // Aligned, so planar rows (and vector loads from any buffer) start on a cache line
+        TRACE_BEGIN(span, TRACE_ALLOC);
+        buffer = aligned_alloc(PLANE_ALIGN, poolSizePPM(found));
+        TRACE_END(span);
+        TRACE_COUNT(TRACE_POOL_MISSES, 1);
+    } else {
+        TRACE_COUNT(TRACE_POOL_HITS, 1);
+    }
+    return (unsigned char *)buffer;
+}
+
+// X: Hand a buffer back to the pool, or free it if the pool already holds as much as it may
+void giveBufferPPM(unsigned char *buffer, int poolClass) {
+    if (buffer == NULL) {
+        return;
+    }
+    if (poolClass < 0) {
+        free(buffer);
+        return;
+    }
+
+    size_t size = poolSizePPM(poolClass);
+    pthread_mutex_lock(&bufferPool.lock);
+    readyPoolPPM();
+    if (bufferPool.cached + size <= bufferPool.limit) {
+        *(void **)buffer = bufferPool.buffers[poolClass];
+        bufferPool.buffers[poolClass] = buffer;
+        bufferPool.cached += size;
+        buffer = NULL;
+    }
+    pthread_mutex_unlock(&bufferPool.lock);
+    free(buffer);
+}
+
+// X: Get an empty image header (no pixel data), owned by the current arena if there is one
+PPMImage *newHeaderPPM(void) {
+    pthread_mutex_lock(&bufferPool.lock);
+    PPMImage *image = bufferPool.headers;
+    if (image != NULL) {
+        bufferPool.headers = image->next;
+    }
+    pthread_mutex_unlock(&bufferPool.lock);
+
+    if (image == NULL) {
+        image = (PPMImage *)malloc(sizeof(PPMImage));
+        if (image == NULL) {
+            fprintf(stderr, "Memory allocation failed for PPMImage\n");
+            return NULL;
+        }
+    }
+    memset(image, 0, sizeof(PPMImage));
+    image->poolClass = -1;
+
+    // Record the image in the arena, so it is released with the job even if nobody frees it
+    if (currentArena != NULL) {
+        image->arena = currentArena;
+        image->next = currentArena->images;
+        if (image->next != NULL) {
+            image->next->prev = image;
+        }
+        currentArena->images = image;
+    }
+    return image;
+}
+
+// X: Create an image with the given header and an uninitialised pixel buffer from the pool
+PPMImage *allocPPM(const char *format, int width, int height, int max_colour, int channels) {
+    PPMImage *image = newHeaderPPM();
+    if (image == NULL) {
+        return NULL;
+    }
+    strcpy(image->format, format);
+    image->width = width;
+    image->height = height;
+    image->max_colour = max_colour;
+    image->channels = channels;
+
+    image->data = takeBufferPPM((size_t)width * (size_t)height * (size_t)channels * SAMPLE_BYTES(max_colour), &image->poolClass);
+    if (image->data == NULL) {
+        fprintf(stderr, "Memory allocation failed for image data\n");
+        freePPM(image);
+        return NULL;
+    }
+    return image;
+}
+
+// X: Make 'arena' current on this thread: images created from now on belong to it
+void beginArenaPPM(PPMArena *arena) {
+    arena->images = NULL;
+    currentArena = arena;
+}
+
+// X: Free every image still in 'arena' and stop using it
+void releaseArenaPPM(PPMArena *arena) {
+    if (currentArena == arena) {
+        currentArena = NULL;
+    }
+    while (arena->images != NULL) {
+        freePPM(arena->images);
+    }
+}
+
+// X: Free a PPM image, whether its data came from the buffer pool, malloc or a file mapping
+// The header and pixel buffer go back to the pool for reuse
+void freePPM(PPMImage *image) {
+    if (image == NULL) {
+        return;
+    }
+
+    // Take the image out of its arena's list
+    if (image->arena != NULL) {
+        if (image->prev != NULL) {
+            image->prev->next = image->next;
+        } else {
+            image->arena->images = image->next;
+        }
+        if (image->next != NULL) {
+            image->next->prev = image->prev;
+        }
+    }
+
+    if (image->map != NULL) {
+        munmap(image->map, image->mapLength);
+    } else {
+        giveBufferPPM(image->data, image->poolClass);
+    }
+
+    pthread_mutex_lock(&bufferPool.lock);
+    image->next = bufferPool.headers;
+    bufferPool.headers = image;
+    pthread_mutex_unlock(&bufferPool.lock);
+}
+
+// X: Give everything the pool has cached back to the system
+void drainPoolPPM(void) {
+    pthread_mutex_lock(&bufferPool.lock);
+    for (int poolClass = 0; poolClass < POOL_CLASSES; poolClass++) {
+        while (bufferPool.buffers[poolClass] != NULL) {
+            void *buffer = bufferPool.buffers[poolClass];
+            bufferPool.buffers[poolClass] = *(void **)buffer;
+            free(buffer);
+        }
+    }
+    while (bufferPool.headers != NULL) {
+        PPMImage *image = bufferPool.headers;
+        bufferPool.headers = image->next;
+        free(image);
+    }
+    bufferPool.cached = 0;
+    pthread_mutex_unlock(&bufferPool.lock);
+}
+
+//----------------THREAD POOL--------------//
+//-----------------------------------------//
+static ThreadPool threadPool;
+static pthread_once_t threadPoolOnce = PTHREAD_ONCE_INIT;
+static int requestedThreads = 0; // 0 until set by '-t'
+static __thread int insidePool = 0; // Set on worker threads, so nested jobs run inline
+
+// X: Set the number of threads used by parallel operations. Must be called before the first one runs
+void setThreadCountPPM(int count) {
+    requestedThreads = count > 0 ? count : 1;
+}
+
+// X: Run the bands of the current job until none are left. Called with the pool lock held
+static void runBandsPPM(ThreadPool *pool) {
+    while (pool->nextBand < pool->bands) {
+        int band = pool->nextBand++;
+        pthread_mutex_unlock(&pool->lock);
+        TRACE_BEGIN(span, TRACE_BAND);
+        pool->task(pool->arg, band);
+        TRACE_END(span);
+        pthread_mutex_lock(&pool->lock);
+        if (++pool->bandsDone == pool->bands) {
+            pthread_cond_broadcast(&pool->finish);
+        }
+    }
+}
+
+// X: Worker thread: sleep until a job is posted, help run it, repeat
+static void *workerPPM(void *unused) {
+    (void)unused;
+    ThreadPool *pool = &threadPool;
+    unsigned long seen = 0;
+    insidePool = 1;
+
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        while (pool->job == seen) {
+            pthread_cond_wait(&pool->start, &pool->lock);
+        }
+        seen = pool->job;
+        runBandsPPM(pool);
+    }
+    return NULL;
+}
+
+// X: Start the worker threads, using '-t', then IMAGEPROC_THREADS, then the number of cores
+static void startPoolPPM(void) {
+    ThreadPool *pool = &threadPool;
+    int threads = requestedThreads;
+    if (threads == 0 && getenv("IMAGEPROC_THREADS") != NULL) {
+        threads = atoi(getenv("IMAGEPROC_THREADS"));
+    }
+    if (threads <= 0) {
+        threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (threads <= 0) {
+        threads = 1;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_mutex_init(&pool->busy, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->finish, NULL);
+    pool->job = 0;
+    pool->bands = pool->nextBand = pool->bandsDone = 0;
+
+    // The calling thread works too, so one fewer worker is needed
+    pool->threadCount = 0;
+    pool->threads = (pthread_t *)malloc(sizeof(pthread_t) * (size_t)threads);
+    for (int i = 0; pool->threads != NULL && i < threads - 1; ++i) {
+        if (pthread_create(&pool->threads[i], NULL, workerPPM, NULL) != 0) {
+            break; // Carry on with however many threads did start
+        }
+        pthread_detach(pool->threads[i]);
+        pool->threadCount++;
+    }
+}
+
+// X: Run task(arg, band) for every band in [0, bands) across the thread pool, returning when all are done
+// Jobs posted from inside a worker, or while another thread's job is running, run inline instead
+void runParallelPPM(BandTask task, void *arg, int bands) {
+    ThreadPool *pool = &threadPool;
+    pthread_once(&threadPoolOnce, startPoolPPM);
+
+    if (bands <= 1 || pool->threadCount == 0 || insidePool || pthread_mutex_trylock(&pool->busy) != 0) {
+        for (int band = 0; band < bands; ++band) {
+            task(arg, band);
+        }
+        return;
+    }
+
+    // Post the job and wake the workers
+    pthread_mutex_lock(&pool->lock);
+    pool->task = task;
+    pool->arg = arg;
+    pool->bands = bands;
+    pool->nextBand = 0;
+    pool->bandsDone = 0;
+    pool->job++;
+    pthread_cond_broadcast(&pool->start);
+
+    // Help out, then wait for the bands still running elsewhere
+    insidePool = 1;
+    runBandsPPM(pool);
+    insidePool = 0;
+    while (pool->bandsDone < pool->bands) {
+        pthread_cond_wait(&pool->finish, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    pthread_mutex_unlock(&pool->busy);
+}
+
+//----------------ASYNC I/O----------------//
+//-----------------------------------------//
+// Files are memory-mapped, so reading one is really the kernel filling the page cache as the pixels
+// are touched. When a batch of files is processed, the inputs of the next few jobs are handed to the
+// kernel to read while the current ones are computed (read-ahead), and each output file is handed
+// back to be written to disk in the background as soon as it is closed (write-behind), so the disk
+// and the CPU are busy at the same time. Requests go through one shared io_uring when the kernel
+// allows it, otherwise to a few I/O threads. Both only ever hint: a request that cannot be queued is dropped
+#define IO_OFF 0
+#define IO_URING 1
+#define IO_THREAD_POOL 2
+#define IO_READ_AHEAD 0
+#define IO_WRITE_BEHIND 1
+
+#ifdef HAVE_IO_URING
+// Submission and completion rings shared with the kernel
+typedef struct {
+    int fd;
+    unsigned entries, inFlight;
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+} IoRing;
+#endif
+
+static struct {
+    int mode; // IO_OFF, IO_URING or IO_THREAD_POOL
+    pthread_mutex_t lock;
+    pthread_cond_t ready; // Signalled when a request is queued for the I/O threads
+    pthread_cond_t idle; // Signalled when the I/O threads run out of work
+    int fds[IO_QUEUE], kinds[IO_QUEUE]; // Queued requests for the I/O threads
+    int head, count, busy;
+#ifdef HAVE_IO_URING
+    IoRing ring;
+#endif
+} asyncIO = {.mode = IO_OFF, .lock = PTHREAD_MUTEX_INITIALIZER, .ready = PTHREAD_COND_INITIALIZER, .idle = PTHREAD_COND_INITIALIZER};
+static pthread_once_t asyncIOOnce = PTHREAD_ONCE_INIT;
+
+#ifdef HAVE_IO_URING
+// X: Create the ring and map it. Returns 0, or -1 if io_uring is missing or not allowed
+static int setupRingPPM(IoRing *ring, unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) {
+        return -1;
+    }
+
+    size_t sqLength = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cqLength = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        sqLength = cqLength = sqLength > cqLength ? sqLength : cqLength;
+    }
+    unsigned char *sq = mmap(NULL, sqLength, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    unsigned char *cq = sq;
+    if (sq != MAP_FAILED && !(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq = mmap(NULL, cqLength, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    }
+    void *sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED) {
+        close(ring->fd); // The mappings go with the process; this only happens on a broken kernel
+        return -1;
+    }
+
+    ring->entries = params.sq_entries;
+    ring->inFlight = 0;
+    ring->sqHead = (unsigned *)(sq + params.sq_off.head);
+    ring->sqTail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sqMask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned *)(sq + params.sq_off.array);
+    ring->cqHead = (unsigned *)(cq + params.cq_off.head);
+    ring->cqTail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cqMask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    ring->sqes = (struct io_uring_sqe *)sqes;
+    return 0;
+}
+
+// X: Close the files of finished requests, first waiting for one if 'wait' is set (call with the lock held)
+static void reapRingPPM(IoRing *ring, int wait) {
+    if (wait && ring->inFlight > 0) {
+        syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+    }
+    unsigned head = *ring->cqHead;
+    while (head != __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)) {
+        close((int)ring->cqes[head & *ring->cqMask].user_data);
+        head++;
+        ring->inFlight--;
+    }
+    __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+}
+
+// X: Queue one request on the ring (call with the lock held). The file is closed when it completes
+// Write-behind is always handed to the kernel's own workers; read-ahead would run inline in
+// io_uring_enter, so it is marked IOSQE_ASYNC to go the same way and submitting never waits for the disk
+static void submitRingPPM(IoRing *ring, int fd, int kind) {
+    while (ring->inFlight >= ring->entries) {
+        reapRingPPM(ring, 1);
+    }
+    unsigned tail = *ring->sqTail;
+    unsigned index = tail & *ring->sqMask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->fd = fd;
+    sqe->user_data = (uint64_t)fd;
+    sqe->off = 0;
+    sqe->len = 0; // The whole file
+    if (kind == IO_READ_AHEAD) {
+        sqe->opcode = IORING_OP_FADVISE;
+        sqe->fadvise_advice = POSIX_FADV_WILLNEED;
+        sqe->flags = IOSQE_ASYNC;
+    } else {
+        sqe->opcode = IORING_OP_SYNC_FILE_RANGE;
+        sqe->sync_range_flags = SYNC_FILE_RANGE_WRITE;
+    }
+    ring->sqArray[index] = index;
+    __atomic_store_n(ring->sqTail, tail + 1, __ATOMIC_RELEASE);
+    if (syscall(__NR_io_uring_enter, ring->fd, 1, 0, 0, NULL, 0) == 1) {
+        ring->inFlight++;
+    } else {
+        // Not taken (e.g. EINTR or EBUSY): withdraw it before closing the file, or the next submit
+        // would pass the kernel a stale descriptor. Only we move the tail, as there is no SQPOLL thread
+        __atomic_store_n(ring->sqTail, tail, __ATOMIC_RELEASE);
+        close(fd); // It was only a hint
+    }
+    reapRingPPM(ring, 0);
+}
+#endif
+
+// X: I/O thread: carry out queued read-ahead and write-behind requests, blocking on the disk so nobody else has to
+static void *ioWorkerPPM(void *unused) {
+    (void)unused;
+    pthread_mutex_lock(&asyncIO.lock);
+    while (1) {
+        while (asyncIO.count == 0) {
+            pthread_cond_wait(&asyncIO.ready, &asyncIO.lock);
+        }
+        int fd = asyncIO.fds[asyncIO.head], kind = asyncIO.kinds[asyncIO.head];
+        asyncIO.head = (asyncIO.head + 1) % IO_QUEUE;
+        asyncIO.count--;
+        asyncIO.busy++;
+        pthread_mutex_unlock(&asyncIO.lock);
+
+        struct stat info;
+        if (kind == IO_READ_AHEAD && fstat(fd, &info) == 0) {
+            readahead(fd, 0, (size_t)info.st_size);
+        } else if (kind == IO_WRITE_BEHIND) {
+            sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+        }
+        close(fd);
+
+        pthread_mutex_lock(&asyncIO.lock);
+        if (--asyncIO.busy == 0 && asyncIO.count == 0) {
+            pthread_cond_broadcast(&asyncIO.idle);
+        }
+    }
+    return NULL;
+}
+
+// X: Pick io_uring or the I/O threads (IMAGEPROC_IO=uring, threads or off chooses)
+static void setupAsyncIOPPM(void) {
+    const char *choice = getenv("IMAGEPROC_IO");
+    if (choice != NULL && strcmp(choice, "off") == 0) {
+        return;
+    }
+#ifdef HAVE_IO_URING
+    if ((choice == NULL || strcmp(choice, "threads") != 0) && setupRingPPM(&asyncIO.ring, IO_QUEUE) == 0) {
+        asyncIO.mode = IO_URING;
+        return;
+    }
+#endif
+    int started = 0;
+    for (int i = 0; i < IO_THREADS; ++i) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, ioWorkerPPM, NULL) == 0) {
+            pthread_detach(thread);
+            started++;
+        }
+    }
+    asyncIO.mode = started ? IO_THREAD_POOL : IO_OFF;
+}
+
+// X: Switch read-ahead and write-behind on. Until this is called both do nothing
+void startAsyncIOPPM(void) {
+    pthread_once(&asyncIOOnce, setupAsyncIOPPM);
+}
+
+// X: Hand an open file to io_uring or the I/O threads, which close it when done
+static void queueAsyncIOPPM(int fd, int kind) {
+    pthread_mutex_lock(&asyncIO.lock);
+#ifdef HAVE_IO_URING
+    if (asyncIO.mode == IO_URING) {
+        submitRingPPM(&asyncIO.ring, fd, kind);
+        pthread_mutex_unlock(&asyncIO.lock);
+        return;
+    }
+#endif
+    if (asyncIO.count == IO_QUEUE) {
+        close(fd); // Too far behind already; it was only a hint
+    } else {
+        int tail = (asyncIO.head + asyncIO.count) % IO_QUEUE;
+        asyncIO.fds[tail] = fd;
+        asyncIO.kinds[tail] = kind;
+        asyncIO.count++;
+        pthread_cond_signal(&asyncIO.ready);
+    }
+    pthread_mutex_unlock(&asyncIO.lock);
+}
+
+// X: Start reading a whole file into the page cache in the background, ready for 'readPPM'
+void readAheadPPM(const char *filename) {
+    if (asyncIO.mode == IO_OFF || filename == NULL) {
+        return;
+    }
+    int fd = open(filename, O_RDONLY);
+    if (fd >= 0) {
+        queueAsyncIOPPM(fd, IO_READ_AHEAD);
+    }
+}
+
+// X: Start writing a just-finished file out to disk in the background ('fd' stays the caller's to close)
+void writeBehindPPM(int fd) {
+    struct stat info;
+    if (asyncIO.mode == IO_OFF || fstat(fd, &info) != 0 || !S_ISREG(info.st_mode)) {
+        return; // Pipes and terminals have nothing to write back
+    }
+    int copy = dup(fd);
+    if (copy >= 0) {
+        queueAsyncIOPPM(copy, IO_WRITE_BEHIND);
+    }
+}
+
+// X: Wait until every queued read-ahead and write-behind request has been carried out
+void finishAsyncIOPPM(void) {
+    pthread_mutex_lock(&asyncIO.lock);
+#ifdef HAVE_IO_URING
+    while (asyncIO.mode == IO_URING && asyncIO.ring.inFlight > 0) {
+        reapRingPPM(&asyncIO.ring, 1);
+    }
+#endif
+    while (asyncIO.mode == IO_THREAD_POOL && (asyncIO.count > 0 || asyncIO.busy > 0)) {
+        pthread_cond_wait(&asyncIO.idle, &asyncIO.lock);
+    }
+    pthread_mutex_unlock(&asyncIO.lock);
+}
+
+//----------------SOBEL KERNELS------------//
+//-----------------------------------------//
+// Sobel is separable, so instead of a 3x3 multiply-add per sample each gradient is a smoothing
+// pass one way and a difference the other:
+//   x gradient = right column (above + 2 * row + below) - left column (above + 2 * row + below)
+//   y gradient = (below - above) on the left + 2 * (below - above) in the middle + (below - above) on the right
+// The edge strength is (|x| + |y|) / 2, clamped to max_colour so strong edges saturate instead of wrapping.
+// Each kernel handles samples [first, last) of a row, with 'step' samples between neighbouring pixels,
+// so grayscale (step 1) and interleaved RGB (step 3) share the same code.
+
+// X: Plain C kernel, used on CPUs without SSE2 and for the samples left over by the vector kernels
+static void edgeRowScalarPPM(const unsigned char *above, const unsigned char *row, const unsigned char *below,
+                             unsigned char *out, int first, int last, int step, int max_colour) {
+    for (int i = first; i < last; ++i) {
+        int gradientX = (above[i + step] + 2 * row[i + step] + below[i + step])
+                      - (above[i - step] + 2 * row[i - step] + below[i - step]);
+        int gradientY = (below[i - step] - above[i - step]) + 2 * (below[i] - above[i]) + (below[i + step] - above[i + step]);
+        int magnitude = (abs(gradientX) + abs(gradientY)) / 2;
+        out[i] = (unsigned char)(magnitude > max_colour ? max_colour : magnitude);
+    }
+}
+
+// X: The same for 16-bit samples (gradients reach 4 * 65535, so the sums need 32 bits)
+static void edgeRow16ScalarPPM(const uint16_t *above, const uint16_t *row, const uint16_t *below,
+                               uint16_t *out, int first, int last, int step, int max_colour) {
+    for (int i = first; i < last; ++i) {
+        int gradientX = (above[i + step] + 2 * row[i + step] + below[i + step])
+                      - (above[i - step] + 2 * row[i - step] + below[i - step]);
+        int gradientY = (below[i - step] - above[i - step]) + 2 * (below[i] - above[i]) + (below[i + step] - above[i + step]);
+        int magnitude = (abs(gradientX) + abs(gradientY)) / 2;
+        out[i] = (uint16_t)(magnitude > max_colour ? max_colour : magnitude);
+    }
+}
+
+#ifdef HAVE_X86_KERNELS
+// X: Sobel magnitude for 8 samples held as 16-bit lanes (the largest value, 2040, fits easily)
+__attribute__((target("sse2")))
+static inline __m128i sobelLanesSSE2(__m128i aboveLeft, __m128i aboveMid, __m128i aboveRight, __m128i rowLeft, __m128i rowRight,
+                                     __m128i belowLeft, __m128i belowMid, __m128i belowRight, __m128i limit) {
+    __m128i left = _mm_add_epi16(_mm_add_epi16(aboveLeft, belowLeft), _mm_add_epi16(rowLeft, rowLeft));
+    __m128i right = _mm_add_epi16(_mm_add_epi16(aboveRight, belowRight), _mm_add_epi16(rowRight, rowRight));
+    __m128i gradientX = _mm_sub_epi16(right, left);
+    __m128i middle = _mm_sub_epi16(belowMid, aboveMid);
+    __m128i gradientY = _mm_add_epi16(_mm_add_epi16(_mm_sub_epi16(belowLeft, aboveLeft), _mm_sub_epi16(belowRight, aboveRight)),
+                                      _mm_add_epi16(middle, middle));
+
+    // SSE2 has no 16-bit abs, so take max(x, -x)
+    __m128i zero = _mm_setzero_si128();
+    gradientX = _mm_max_epi16(gradientX, _mm_sub_epi16(zero, gradientX));
+    gradientY = _mm_max_epi16(gradientY, _mm_sub_epi16(zero, gradientY));
+    return _mm_min_epi16(_mm_srli_epi16(_mm_add_epi16(gradientX, gradientY), 1), limit);
+}
+
+// X: SSE2 kernel, 16 samples per iteration
+__attribute__((target("sse2")))
+static void edgeRowSSE2PPM(const unsigned char *above, const unsigned char *row, const unsigned char *below,
+                           unsigned char *out, int first, int last, int step, int max_colour) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i limit = _mm_set1_epi16((short)max_colour);
+    int i = first;
+
+    for (; i + 16 <= last; i += 16) {
+        __m128i aboveLeft = _mm_loadu_si128((const __m128i *)(above + i - step));
+        __m128i aboveMid = _mm_loadu_si128((const __m128i *)(above + i));
+        __m128i aboveRight = _mm_loadu_si128((const __m128i *)(above + i + step));
+        __m128i rowLeft = _mm_loadu_si128((const __m128i *)(row + i - step));
+        __m128i rowRight = _mm_loadu_si128((const __m128i *)(row + i + step));
+        __m128i belowLeft = _mm_loadu_si128((const __m128i *)(below + i - step));
+        __m128i belowMid = _mm_loadu_si128((const __m128i *)(below + i));
+        __m128i belowRight = _mm_loadu_si128((const __m128i *)(below + i + step));
+
+        // Widen to 16 bits in two halves
+        __m128i low = sobelLanesSSE2(_mm_unpacklo_epi8(aboveLeft, zero), _mm_unpacklo_epi8(aboveMid, zero), _mm_unpacklo_epi8(aboveRight, zero),
+                                     _mm_unpacklo_epi8(rowLeft, zero), _mm_unpacklo_epi8(rowRight, zero),
+                                     _mm_unpacklo_epi8(belowLeft, zero), _mm_unpacklo_epi8(belowMid, zero), _mm_unpacklo_epi8(belowRight, zero), limit);
+        __m128i high = sobelLanesSSE2(_mm_unpackhi_epi8(aboveLeft, zero), _mm_unpackhi_epi8(aboveMid, zero), _mm_unpackhi_epi8(aboveRight, zero),
+                                      _mm_unpackhi_epi8(rowLeft, zero), _mm_unpackhi_epi8(rowRight, zero),
+                                      _mm_unpackhi_epi8(belowLeft, zero), _mm_unpackhi_epi8(belowMid, zero), _mm_unpackhi_epi8(belowRight, zero), limit);
+        _mm_storeu_si128((__m128i *)(out + i), _mm_packus_epi16(low, high));
+    }
+
+    edgeRowScalarPPM(above, row, below, out, i, last, step, max_colour);
+}
+
+// X: Sobel magnitude for 16 samples held as 16-bit lanes
+__attribute__((target("avx2")))
+static inline __m256i sobelLanesAVX2(const unsigned char *above, const unsigned char *row, const unsigned char *below, int i, int step, __m256i limit) {
+    __m256i aboveLeft = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(above + i - step)));
+    __m256i aboveMid = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(above + i)));
+    __m256i aboveRight = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(above + i + step)));
+    __m256i rowLeft = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(row + i - step)));
+    __m256i rowRight = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(row + i + step)));
+    __m256i belowLeft = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(below + i - step)));
+    __m256i belowMid = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(below + i)));
+    __m256i belowRight = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(below + i + step)));
+
+    __m256i left = _mm256_add_epi16(_mm256_add_epi16(aboveLeft, belowLeft), _mm256_add_epi16(rowLeft, rowLeft));
+    __m256i right = _mm256_add_epi16(_mm256_add_epi16(aboveRight, belowRight), _mm256_add_epi16(rowRight, rowRight));
+    __m256i gradientX = _mm256_abs_epi16(_mm256_sub_epi16(right, left));
+    __m256i middle = _mm256_sub_epi16(belowMid, aboveMid);
+    __m256i gradientY = _mm256_abs_epi16(_mm256_add_epi16(_mm256_add_epi16(_mm256_sub_epi16(belowLeft, aboveLeft), _mm256_sub_epi16(belowRight, aboveRight)),
+                                                          _mm256_add_epi16(middle, middle)));
+    return _mm256_min_epi16(_mm256_srli_epi16(_mm256_add_epi16(gradientX, gradientY), 1), limit);
+}
+
+// X: AVX2 kernel, 32 samples per iteration
+__attribute__((target("avx2")))
+static void edgeRowAVX2PPM(const unsigned char *above, const unsigned char *row, const unsigned char *below,
+                           unsigned char *out, int first, int last, int step, int max_colour) {
+    const __m256i limit = _mm256_set1_epi16((short)max_colour);
+    int i = first;
+
+    for (; i + 32 <= last; i += 32) {
+        __m256i low = sobelLanesAVX2(above, row, below, i, step, limit);
+        __m256i high = sobelLanesAVX2(above, row, below, i + 16, step, limit);
+
+        // packus works within 128-bit lanes, so put the 64-bit quarters back in order afterwards
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(low, high), 0xD8);
+        _mm256_storeu_si256((__m256i *)(out + i), packed);
+    }
+
+    edgeRowSSE2PPM(above, row, below, out, i, last, step, max_colour);
+}
+
+// X: Sobel magnitude for 4 16-bit samples held as 32-bit lanes
+__attribute__((target("sse2")))
+static inline __m128i sobelLanes16SSE2(__m128i aboveLeft, __m128i aboveMid, __m128i aboveRight, __m128i rowLeft, __m128i rowRight,
+                                       __m128i belowLeft, __m128i belowMid, __m128i belowRight, __m128i limit) {
+    __m128i left = _mm_add_epi32(_mm_add_epi32(aboveLeft, belowLeft), _mm_add_epi32(rowLeft, rowLeft));
+    __m128i right = _mm_add_epi32(_mm_add_epi32(aboveRight, belowRight), _mm_add_epi32(rowRight, rowRight));
+    __m128i gradientX = _mm_sub_epi32(right, left);
+    __m128i middle = _mm_sub_epi32(belowMid, aboveMid);
+    __m128i gradientY = _mm_add_epi32(_mm_add_epi32(_mm_sub_epi32(belowLeft, aboveLeft), _mm_sub_epi32(belowRight, aboveRight)),
+                                      _mm_add_epi32(middle, middle));
+
+    // SSE2 has no 32-bit abs or min, so flip negative lanes with their sign mask and pick with a compare
+    __m128i signX = _mm_srai_epi32(gradientX, 31), signY = _mm_srai_epi32(gradientY, 31);
+    gradientX = _mm_sub_epi32(_mm_xor_si128(gradientX, signX), signX);
+    gradientY = _mm_sub_epi32(_mm_xor_si128(gradientY, signY), signY);
+    __m128i magnitude = _mm_srli_epi32(_mm_add_epi32(gradientX, gradientY), 1);
+    __m128i over = _mm_cmpgt_epi32(magnitude, limit);
+    return _mm_or_si128(_mm_and_si128(over, limit), _mm_andnot_si128(over, magnitude));
+}
+
+// X: SSE2 kernel for 16-bit samples, 8 samples per iteration
+__attribute__((target("sse2")))
+static void edgeRow16SSE2PPM(const uint16_t *above, const uint16_t *row, const uint16_t *below,
+                             uint16_t *out, int first, int last, int step, int max_colour) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i limit = _mm_set1_epi32(max_colour);
+    const __m128i bias = _mm_set1_epi32(32768);
+    int i = first;
+
+    for (; i + 8 <= last; i += 8) {
+        __m128i aboveLeft = _mm_loadu_si128((const __m128i *)(above + i - step));
+        __m128i aboveMid = _mm_loadu_si128((const __m128i *)(above + i));
+        __m128i aboveRight = _mm_loadu_si128((const __m128i *)(above + i + step));
+        __m128i rowLeft = _mm_loadu_si128((const __m128i *)(row + i - step));
+        __m128i rowRight = _mm_loadu_si128((const __m128i *)(row + i + step));
+        __m128i belowLeft = _mm_loadu_si128((const __m128i *)(below + i - step));
+        __m128i belowMid = _mm_loadu_si128((const __m128i *)(below + i));
+        __m128i belowRight = _mm_loadu_si128((const __m128i *)(below + i + step));
+
+        // Widen to 32 bits in two halves
+        __m128i low = sobelLanes16SSE2(_mm_unpacklo_epi16(aboveLeft, zero), _mm_unpacklo_epi16(aboveMid, zero), _mm_unpacklo_epi16(aboveRight, zero),
+                                       _mm_unpacklo_epi16(rowLeft, zero), _mm_unpacklo_epi16(rowRight, zero),
+                                       _mm_unpacklo_epi16(belowLeft, zero), _mm_unpacklo_epi16(belowMid, zero), _mm_unpacklo_epi16(belowRight, zero), limit);
+        __m128i high = sobelLanes16SSE2(_mm_unpackhi_epi16(aboveLeft, zero), _mm_unpackhi_epi16(aboveMid, zero), _mm_unpackhi_epi16(aboveRight, zero),
+                                        _mm_unpackhi_epi16(rowLeft, zero), _mm_unpackhi_epi16(rowRight, zero),
+                                        _mm_unpackhi_epi16(belowLeft, zero), _mm_unpackhi_epi16(belowMid, zero), _mm_unpackhi_epi16(belowRight, zero), limit);
+
+        // SSE2 only packs to signed 16 bits, so shift the range down by 32768 and back
+        __m128i packed = _mm_packs_epi32(_mm_sub_epi32(low, bias), _mm_sub_epi32(high, bias));
+        _mm_storeu_si128((__m128i *)(out + i), _mm_xor_si128(packed, _mm_set1_epi16((short)0x8000)));
+    }
+
+    edgeRow16ScalarPPM(above, row, below, out, i, last, step, max_colour);
+}
+
+// X: Sobel magnitude for 8 16-bit samples held as 32-bit lanes
+__attribute__((target("avx2")))
+static inline __m256i sobelLanes16AVX2(const uint16_t *above, const uint16_t *row, const uint16_t *below, int i, int step, __m256i limit) {
+    __m256i aboveLeft = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(above + i - step)));
+    __m256i aboveMid = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(above + i)));
+    __m256i aboveRight = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(above + i + step)));
+    __m256i rowLeft = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(row + i - step)));
+    __m256i rowRight = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(row + i + step)));
+    __m256i belowLeft = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(below + i - step)));
+    __m256i belowMid = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(below + i)));
+    __m256i belowRight = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(below + i + step)));
+
+    __m256i left = _mm256_add_epi32(_mm256_add_epi32(aboveLeft, belowLeft), _mm256_add_epi32(rowLeft, rowLeft));
+    __m256i right = _mm256_add_epi32(_mm256_add_epi32(aboveRight, belowRight), _mm256_add_epi32(rowRight, rowRight));
+    __m256i gradientX = _mm256_abs_epi32(_mm256_sub_epi32(right, left));
+    __m256i middle = _mm256_sub_epi32(belowMid, aboveMid);
+    __m256i gradientY = _mm256_abs_epi32(_mm256_add_epi32(_mm256_add_epi32(_mm256_sub_epi32(belowLeft, aboveLeft), _mm256_sub_epi32(belowRight, aboveRight)),
+                                                          _mm256_add_epi32(middle, middle)));
+    return _mm256_min_epi32(_mm256_srli_epi32(_mm256_add_epi32(gradientX, gradientY), 1), limit);
+}
+
+// X: AVX2 kernel for 16-bit samples, 16 samples per iteration
+__attribute__((target("avx2")))
+static void edgeRow16AVX2PPM(const uint16_t *above, const uint16_t *row, const uint16_t *below,
+                             uint16_t *out, int first, int last, int step, int max_colour) {
+    const __m256i limit = _mm256_set1_epi32(max_colour);
+    int i = first;
+
+    for (; i + 16 <= last; i += 16) {
+        __m256i low = sobelLanes16AVX2(above, row, below, i, step, limit);
+        __m256i high = sobelLanes16AVX2(above, row, below, i + 8, step, limit);
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(low, high), 0xD8);
+        _mm256_storeu_si256((__m256i *)(out + i), packed);
+    }
+
+    edgeRow16SSE2PPM(above, row, below, out, i, last, step, max_colour);
+}
+#endif
+
+static EdgeRowKernel edgeRowKernel = edgeRowScalarPPM;
+static EdgeRow16Kernel edgeRow16Kernel = edgeRow16ScalarPPM;
+static FilterRowKernel filterRowKernel = filterRowScalarPPM;
+
+// X: Choose kernels for this CPU. Called once at startup, so one binary runs on every machine.
+// IMAGEPROC_SIMD=scalar|sse2|avx2 can force a lower level, e.g. to compare results
+void selectKernelsPPM(void) {
+    const char *forced = getenv("IMAGEPROC_SIMD");
+    edgeRowKernel = edgeRowScalarPPM;
+    edgeRow16Kernel = edgeRow16ScalarPPM;
+    filterRowKernel = filterRowScalarPPM;
+
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (forced != NULL && strcmp(forced, "scalar") == 0) {
+        return;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        edgeRowKernel = edgeRowSSE2PPM;
+        edgeRow16Kernel = edgeRow16SSE2PPM;
+        filterRowKernel = filterRowSSE2PPM;
+    }
+    if (forced != NULL && strcmp(forced, "sse2") == 0) {
+        return;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        edgeRowKernel = edgeRowAVX2PPM;
+        edgeRow16Kernel = edgeRow16AVX2PPM;
+        filterRowKernel = filterRowAVX2PPM;
+    }
+#else
+    (void)forced;
+#endif
+}
+
+//----------------CONVOLUTION--------------//
+//-----------------------------------------//
+// Every kernel is one or two separable terms, each a vertical pass (down the rows, into a row of 32-bit
+// sums) then a horizontal pass (along that row). A gradient kernel's two terms are its x and y gradients;
+// the Laplacian's are the second derivatives down and across, added together; a blur has one term.
+// 'filterRowBodyPPM' is always inlined with its taps taken from the constant table below, and compiled
+// once per kernel and sample size (see 'filterRowSwitchPPM'), so zero taps and the loops over taps vanish.
+// Pixels beyond the edge are filled in as the border mode says, columns in the row of sums and rows by
+// pointing at the right input row. Sobel with the L1 magnitude runs the hand-vectorised row kernels above
+// on every pixel that has all its neighbours, and the engine does only the pixels along the edge.
+#define FILTER_RADIUS 2 // Largest kernel radius
+
+#define COMBINE_GRADIENT 0 // Terms are the x and y gradients: the result is their magnitude
+#define COMBINE_SUM 1 // The absolute value of the sum of the terms
+#define COMBINE_SINGLE 2 // One term, divided (rounding) by 'divisor'
+
+typedef struct {
+    const char *name;
+    int radius;
+    int combine;
+    int verticalA[2 * FILTER_RADIUS + 1], horizontalA[2 * FILTER_RADIUS + 1]; // First term, 2 * radius + 1 taps
+    int verticalB[2 * FILTER_RADIUS + 1], horizontalB[2 * FILTER_RADIUS + 1]; // Second term
+    int shift; // Gradients are divided by 2^shift, so every kernel's strongest edge comes out alike
+    int divisor; // Sum of the blur taps
+} FilterTaps;
+
+static const FilterTaps filterTaps[FILTERS] = {
+    [FILTER_SOBEL] = {"sobel", 1, COMBINE_GRADIENT, {1, 2, 1}, {-1, 0, 1}, {-1, 0, 1}, {1, 2, 1}, 1, 1},
+    [FILTER_SCHARR] = {"scharr", 1, COMBINE_GRADIENT, {3, 10, 3}, {-1, 0, 1}, {-1, 0, 1}, {3, 10, 3}, 3, 1},
+    [FILTER_LAPLACIAN] = {"laplacian", 1, COMBINE_SUM, {1, -2, 1}, {0, 1, 0}, {0, 1, 0}, {1, -2, 1}, 0, 1},
+    [FILTER_GAUSSIAN] = {"gaussian", 2, COMBINE_SINGLE, {1, 4, 6, 4, 1}, {1, 4, 6, 4, 1}, {0}, {0}, 0, 256},
+    [FILTER_BOX] = {"box", 1, COMBINE_SINGLE, {1, 1, 1}, {1, 1, 1}, {0}, {0}, 0, 9},
+};
+
+// X: Where pixel 'x' of a line 'length' long is read from under a border mode, or -1 for black
+static inline int borderIndexPPM(int x, int length, int border) {
+    if (x >= 0 && x < length) {
+        return x;
+    }
+    if (border == BORDER_CLAMP) {
+        return x < 0 ? 0 : length - 1;
+    }
+    if (border == BORDER_REFLECT && length > 1) {
+        // Mirror until inside (only more than once for lines shorter than the kernel)
+        while (x < 0 || x >= length) {
+            x = x < 0 ? -x : 2 * (length - 1) - x;
+        }
+        return x;
+    }
+    return border == BORDER_REFLECT ? 0 : -1;
+}
+
+// X: Vertical pass of 'filterRowBodyPPM': samples [from, to) of the 2 * radius + 1 rows, weighted by the
+// vertical taps of each term, into the rows of sums
+static inline __attribute__((always_inline)) void filterVerticalPPM(const FilterTaps *taps, int depth, const unsigned char *const *rows,
+                                                                   int from, int to, int32_t *__restrict sumsA, int32_t *__restrict sumsB) {
+    const int span = 2 * taps->radius + 1, twoTerms = taps->combine != COMBINE_SINGLE;
+    const unsigned char *in[2 * FILTER_RADIUS + 1];
+    for (int k = 0; k < span; ++k) {
+        in[k] = rows[k];
+    }
+    for (int i = from; i < to; ++i) {
+        int32_t a = 0, b = 0;
+#pragma GCC unroll 5
+        for (int k = 0; k < span; ++k) {
+            int32_t sample = depth == 2 ? ((const uint16_t *)in[k])[i] : in[k][i];
+            a += taps->verticalA[k] * sample;
+            b += twoTerms ? taps->verticalB[k] * sample : 0;
+        }
+        sumsA[i] = a;
+        if (twoTerms) {
+            sumsB[i] = b;
+        }
+    }
+}
+
+// X: Horizontal pass of 'filterRowBodyPPM' over samples [from, to), then the magnitude ('l2' picks
+// sqrt(x^2 + y^2)), sum or average, clamped to 'max_colour'
+static inline __attribute__((always_inline)) void filterHorizontalPPM(const FilterTaps *taps, int depth, int l2, const int32_t *sumsA,
+                                                                     const int32_t *sumsB, unsigned char *__restrict out, int from, int to,
+                                                                     int step, int max_colour) {
+    const int radius = taps->radius, span = 2 * radius + 1, twoTerms = taps->combine != COMBINE_SINGLE;
+    const double scale = 1.0 / (1 << taps->shift);
+    for (int i = from; i < to; ++i) {
+        int32_t a = 0, b = 0;
+#pragma GCC unroll 5
+        for (int k = 0; k < span; ++k) {
+            a += taps->horizontalA[k] * sumsA[i + (k - radius) * step];
+            b += twoTerms ? taps->horizontalB[k] * sumsB[i + (k - radius) * step] : 0;
+        }
+        int value;
+        if (taps->combine == COMBINE_GRADIENT && l2) {
+            value = (int)(sqrt((double)a * a + (double)b * b) * scale + 0.5);
+        } else if (taps->combine == COMBINE_GRADIENT) {
+            value = (abs(a) + abs(b)) >> taps->shift;
+        } else if (taps->combine == COMBINE_SUM) {
+            value = abs(a + b);
+        } else {
+            value = (a + taps->divisor / 2) / taps->divisor;
+        }
+        value = value > max_colour ? max_colour : value;
+        if (depth == 2) {
+            ((uint16_t *)out)[i] = (uint16_t)value;
+        } else {
+            out[i] = (unsigned char)value;
+        }
+    }
+}
+
+// X: Filter pixels [first, last) of one row. 'rows' are the 2 * radius + 1 input rows around it (black
+// rows included), 'step' is the samples per pixel, and 'sums' has room for two rows of
+// (width + 2 * FILTER_RADIUS) * step 32-bit sums
+static inline __attribute__((always_inline)) void filterRowBodyPPM(const FilterTaps *taps, int depth, const unsigned char *const *rows,
+                                                                  unsigned char *out, int width, int step, int first, int last,
+                                                                  int border, int magnitude, int max_colour, int32_t *sums) {
+    const int radius = taps->radius;
+    size_t line = (size_t)(width + 2 * FILTER_RADIUS) * step;
+    int32_t *sumsA = sums + (size_t)FILTER_RADIUS * step, *sumsB = sumsA + line; // Pixel 0 of each row of sums
+
+    // Vertical pass over the pixels the horizontal pass will read
+    int from = first - radius < 0 ? 0 : first - radius;
+    int to = last + radius > width ? width : last + radius;
+    if (border == BORDER_REFLECT && first - radius < 0) {
+        to = to > radius + 1 ? to : (width < radius + 1 ? width : radius + 1); // Mirrored from just inside the edge
+    }
+    if (border == BORDER_REFLECT && last + radius > width) {
+        from = from < width - 1 - radius ? from : (width - 1 - radius > 0 ? width - 1 - radius : 0);
+    }
+    filterVerticalPPM(taps, depth, rows, from * step, to * step, sumsA, sumsB);
+
+    // Columns beyond the edge
+    for (int x = first - radius; x < last + radius; ++x) {
+        if (x >= 0 && x < width) {
+            continue;
+        }
+        int source = borderIndexPPM(x, width, border == BORDER_NONE ? BORDER_ZERO : border);
+        for (int c = 0; c < step; ++c) {
+            sumsA[x * step + c] = source < 0 ? 0 : sumsA[source * step + c];
+            if (taps->combine != COMBINE_SINGLE) {
+                sumsB[x * step + c] = source < 0 ? 0 : sumsB[source * step + c];
+            }
+        }
+    }
+
+    // Horizontal pass, with the square root only compiled in where it is asked for
+    if (taps->combine == COMBINE_GRADIENT && magnitude == MAGNITUDE_L2) {
+        filterHorizontalPPM(taps, depth, 1, sumsA, sumsB, out, first * step, last * step, step, max_colour);
+    } else {
+        filterHorizontalPPM(taps, depth, 0, sumsA, sumsB, out, first * step, last * step, step, max_colour);
+    }
+
+    // Without a border mode, pixels the kernel hangs over the edge of are black
+    if (border == BORDER_NONE) {
+        for (int x = first; x < last; ++x) {
+            if (x < radius || x >= width - radius) {
+                memset(out + (size_t)x * step * depth, 0, (size_t)step * depth);
+            }
+        }
+    }
+}
+
+// X: 'filterRowBodyPPM' specialised for each kernel and sample size
+static inline __attribute__((always_inline)) void filterRowSwitchPPM(int filter, int depth, const unsigned char *const *rows, unsigned char *out, int width, int step,
+                         int first, int last, int border, int magnitude, int max_colour, int32_t *sums) {
+    switch (filter * 2 + (depth == 2)) {
+        case FILTER_SOBEL * 2: filterRowBodyPPM(&filterTaps[FILTER_SOBEL], 1, rows, out, width, step, first, last, border, magnitude, max_colour, sums); break;
+        case FILTER_SOBEL * 2 + 1: filterRowBodyPPM(&filterTaps[FILTER_SOBEL], 2, rows, out, width, step, first, last, border, magnitude, max_colour, sums); break;
+        case FILTER_SCHARR * 2: filterRowBodyPPM(&filterTaps[FILTER_SCHARR], 1, rows, out, width, step, first, last, border, magnitude, max_colour, sums); break;
+        case FILTER_SCHARR * 2 + 1: filterRowBodyPPM(&filterTaps[FILTER_SCHARR], 2, rows, out, width, step, first, last, border, magnitude, max_colour, sums); break;
+        case FILTER_LAPLACIAN * 2: filterRowBodyPPM(&filterTaps[FILTER_LAPLACIAN], 1, rows, out, width, step, first, last, border, magnitude, max_colour, sums); break;
+        case FILTER_LAPLACIAN * 2 + 1: filterRowBodyPPM(&filterTaps[FILTER_LAPLACIAN], 2, rows, out, width, step, first, last, border, magnitude, max_colour, sums); break;
+        case FILTER_GAUSSIAN * 2: filterRowBodyPPM(&filterTaps[FILTER_GAUSSIAN], 1, rows, out, width, step, first, last, border, magnitude, max_colour, sums); break;
+        case FILTER_GAUSSIAN * 2 + 1: filterRowBodyPPM(&filterTaps[FILTER_GAUSSIAN], 2, rows, out, width, step, first, last, border, magnitude, max_colour, sums); break;
+        case FILTER_BOX * 2: filterRowBodyPPM(&filterTaps[FILTER_BOX], 1, rows, out, width, step, first, last, border, magnitude, max_colour, sums); break;
+        default: filterRowBodyPPM(&filterTaps[FILTER_BOX], 2, rows, out, width, step, first, last, border, magnitude, max_colour, sums); break;
+    }
+}
+
+// The same engine once per instruction set, like the Sobel kernels (see 'selectKernelsPPM'). The loops are
+// left to the compiler to vectorise, so these ask for it whatever the optimisation level
+static void filterRowScalarPPM(FILTER_ROW_PARAMETERS) {
+    filterRowSwitchPPM(FILTER_ROW_ARGUMENTS);
+}
+
+#ifdef HAVE_X86_KERNELS
+__attribute__((target("sse2"), optimize("tree-vectorize", "vect-cost-model=dynamic", "no-math-errno")))
+static void filterRowSSE2PPM(FILTER_ROW_PARAMETERS) {
+    filterRowSwitchPPM(FILTER_ROW_ARGUMENTS);
+}
+
+__attribute__((target("avx2"), optimize("tree-vectorize", "vect-cost-model=dynamic", "no-math-errno")))
+static void filterRowAVX2PPM(FILTER_ROW_PARAMETERS) {
+    filterRowSwitchPPM(FILTER_ROW_ARGUMENTS);
+}
+#endif
+
+// Rows are shared out in bands across the thread pool. Each row only depends on the input,
+// so the result is identical however many threads run
+// Planar images are filtered one plane at a time, so every row is a run of single samples
+typedef struct {
+    PPMImage *image, *out;
+    int filter, border, magnitude;
+    int bandRows; // Rows per band
+    int planeBands; // Bands per plane (the whole image is one plane unless it is planar)
+    int samples; // Samples per pixel within a row: 1 for planar images, otherwise 'channels'
+    size_t rowLength; // Bytes from one row to the next
+    const unsigned char *blackRow; // A row of zeros, for rows beyond the edge with BORDER_ZERO
+} FilterJob;
+
+static void filterBandPPM(void *arg, int band) {
+    FilterJob *job = (FilterJob *)arg;
+    PPMImage *image = job->image;
+    const FilterTaps *taps = &filterTaps[job->filter];
+    int depth = SAMPLE_BYTES(image->max_colour), radius = taps->radius;
+    int width = image->width, height = image->height, step = job->samples;
+    size_t rowLength = job->rowLength;
+    size_t plane = (size_t)(band / job->planeBands) * rowLength * (size_t)height;
+    band %= job->planeBands;
+    int first = band * job->bandRows;
+    int last = first + job->bandRows < height ? first + job->bandRows : height;
+
+    int32_t *sums = (int32_t *)malloc(sizeof(int32_t) * (size_t)(width + 2 * FILTER_RADIUS) * step * 2);
+    if (sums == NULL) {
+        fprintf(stderr, "Memory allocation failed for the filter\n");
+        return;
+    }
+    // Sobel (L1) rows with every neighbour go to the vector kernels; the engine only does their end pixels
+    int fast = job->filter == FILTER_SOBEL && job->magnitude == MAGNITUDE_L1 && width > 2;
+    EdgeRowFunction edgeRow = depth == 2 ? edgeRow16PPM : edgeRowPPM;
+
+    for (int y = first; y < last; ++y) {
+        unsigned char *out = job->out->data + plane + rowLength * (size_t)y;
+        if (job->border == BORDER_NONE && (y < radius || y >= height - radius)) {
+            memset(out, 0, (size_t)width * step * depth);
+            continue;
+        }
+        const unsigned char *rows[2 * FILTER_RADIUS + 1];
+        for (int k = -radius; k <= radius; ++k) {
+            int source = borderIndexPPM(y + k, height, job->border);
+            rows[k + radius] = source < 0 ? job->blackRow : image->data + plane + rowLength * (size_t)source;
+        }
+        if (fast && y > 0 && y < height - 1) {
+            edgeRow(rows[0], rows[1], rows[2], out, width, step, image->max_colour);
+            if (job->border != BORDER_NONE) {
+                filterRowKernel(job->filter, depth, rows, out, width, step, 0, 1, job->border, job->magnitude, image->max_colour, sums);
+                filterRowKernel(job->filter, depth, rows, out, width, step, width - 1, width, job->border, job->magnitude, image->max_colour, sums);
+            }
+        } else {
+            filterRowKernel(job->filter, depth, rows, out, width, step, 0, width, job->border, job->magnitude, image->max_colour, sums);
+        }
+    }
+    free(sums);
+}
+
+// X: Convolve an image with one of the FILTER_ kernels, treating the pixels beyond its edge as 'border'
+// says (a BORDER_ mode) and, for the gradient kernels, combining x and y as 'magnitude' says (MAGNITUDE_L1
+// or MAGNITUDE_L2). Each channel is filtered separately. Returns a new image of the same type and layout, or NULL
+PPMImage *filterPPM(PPMImage *image, int filter, int border, int magnitude) {
+    if (filter < 0 || filter >= FILTERS || border < BORDER_NONE || border > BORDER_ZERO) {
+        fprintf(stderr, "Error: Unknown filter or border mode\n");
+        return NULL;
+    }
+    // Create a new PPMImage to store the results, with the same header information (and layout)
+    PPMImage *out = image->planar
+        ? allocPlanarPPM(image->format, image->width, image->height, image->max_colour, image->channels)
+        : allocPPM(image->format, image->width, image->height, image->max_colour, image->channels);
+    if (out == NULL) {
+        return NULL;
+    }
+    TRACE_BEGIN(span, TRACE_EDGE);
+    int planes = image->planar ? 3 : 1;
+    size_t rowLength = image->planar ? image->stride : (size_t)image->width * (size_t)image->channels * SAMPLE_BYTES(image->max_colour);
+    unsigned char *blackRow = (unsigned char *)calloc(rowLength, 1);
+    if (blackRow == NULL) {
+        fprintf(stderr, "Memory allocation failed for the filter\n");
+        freePPM(out);
+        TRACE_END(span);
+        return NULL;
+    }
+
+    // Split the rows of each plane into cache-sized bands
+    FilterJob job;
+    job.image = image;
+    job.out = out;
+    job.filter = filter;
+    job.border = border;
+    job.magnitude = magnitude;
+    job.rowLength = rowLength;
+    job.samples = image->planar ? 1 : image->channels;
+    job.blackRow = blackRow;
+    job.bandRows = (int)(BAND_BYTES / rowLength) + 1;
+    job.planeBands = (image->height + job.bandRows - 1) / job.bandRows;
+    runParallelPPM(filterBandPPM, &job, job.planeBands * planes);
+    free(blackRow);
+    TRACE_COUNT(TRACE_PIXELS, (size_t)image->width * (size_t)image->height);
+    TRACE_END(span);
+
+    return out;
+}
+
+// X: Read a filter given as "KERNEL[,BORDER][,l1|l2]", e.g. "scharr,reflect,l2". Kernels are sobel, scharr,
+// laplacian, gaussian and box; borders none, clamp, reflect and zero. Returns 0, or -1 if it is not understood
+int parseFilterPPM(const char *spec, int *filter, int *border, int *magnitude) {
+    static const char *borders[] = {"none", "clamp", "reflect", "zero"};
+    char copy[64];
+    snprintf(copy, sizeof(copy), "%s", spec);
+    *filter = -1;
+    *border = BORDER_NONE;
+    *magnitude = MAGNITUDE_L1;
+
+    char *rest;
+    for (char *word = strtok_r(copy, ",", &rest); word != NULL; word = strtok_r(NULL, ",", &rest)) {
+        int known = 0;
+        for (int i = 0; i < FILTERS && !known; ++i) {
+            if (strcmp(word, filterTaps[i].name) == 0) {
+                *filter = i;
+                known = 1;
+            }
+        }
+        for (int i = 0; i < 4 && !known; ++i) {
+            if (strcmp(word, borders[i]) == 0) {
+                *border = i;
+                known = 1;
+            }
+        }
+        if (!known && (strcmp(word, "l1") == 0 || strcmp(word, "l2") == 0)) {
+            *magnitude = word[1] == '2' ? MAGNITUDE_L2 : MAGNITUDE_L1;
+            known = 1;
+        }
+        if (!known) {
+            fprintf(stderr, "Error: Unknown filter setting '%s' (kernels: sobel, scharr, laplacian, gaussian, box; "
+                            "borders: none, clamp, reflect, zero; magnitudes: l1, l2)\n", word);
+            return -1;
+        }
+    }
+    if (*filter < 0) {
+        *filter = FILTER_SOBEL;
+    }
+    return 0;
+}
+
+//----------------PATTERN SEARCH-----------//
+//-----------------------------------------//
+// 2D Rabin-Karp: every row of image1 is hashed over windows as wide as image2 with a rolling hash,
+// then those row hashes are rolled down each column over windows as tall as image2. A window whose
+// hash equals image2's is compared pixel by pixel, so collisions can never cause a false match.
+// Each image1 pixel costs a few multiplications however large image2 is, i.e. O(width * height).
+// Hashes are taken modulo the prime 2^61 - 1, which makes collisions vanishingly rare.
+#define HASH_PRIME ((uint64_t)0x1FFFFFFFFFFFFFFFULL)
+#define HASH_BASE_ROW ((uint64_t)0x1F3A5B7C9D2E4F61ULL % HASH_PRIME)
+#define HASH_BASE_COLUMN ((uint64_t)0x0C6A4A7935BD1E99ULL % HASH_PRIME)
+
+// X: (a * b) mod 2^61 - 1
+static inline uint64_t mulModPPM(uint64_t a, uint64_t b) {
+    __uint128_t product = (__uint128_t)a * b;
+    uint64_t result = ((uint64_t)product & HASH_PRIME) + (uint64_t)(product >> 61);
+    return result >= HASH_PRIME ? result - HASH_PRIME : result;
+}
+
+// X: (a + b) mod 2^61 - 1, for a and b already reduced
+static inline uint64_t addModPPM(uint64_t a, uint64_t b) {
+    uint64_t result = a + b;
+    return result >= HASH_PRIME ? result - HASH_PRIME : result;
+}
+
+// X: base^power mod 2^61 - 1
+static uint64_t powModPPM(uint64_t base, int power) {
+    uint64_t result = 1;
+    while (power > 0) {
+        if (power & 1) {
+            result = mulModPPM(result, base);
+        }
+        base = mulModPPM(base, base);
+        power >>= 1;
+    }
+    return result;
+}
+
+// X: The bytes of one pixel as a single number (at most 6 bytes, so it stays below the prime)
+static inline __attribute__((always_inline)) uint64_t pixelValuePPM(const unsigned char *pixel, int bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; ++i) {
+        value = value << 8 | pixel[i];
+    }
+    return value;
+}
+
+// X: Hash every 'window'-pixel-wide stretch of one row into hashes[0 .. width - window]
+// Pixels are hashed as one value (all channels together), plus one so black still counts
+static inline __attribute__((always_inline)) void hashRowBytesPPM(const unsigned char *row, int width, int bytes, int window, uint64_t dropPower, uint64_t *hashes) {
+    uint64_t hash = 0;
+    for (int x = 0; x < width; ++x) {
+        const unsigned char *pixel = row + (size_t)x * bytes;
+        uint64_t value = pixelValuePPM(pixel, bytes);
+
+        // Drop the pixel leaving the window, shift and add the new one
+        if (x >= window) {
+            uint64_t oldValue = pixelValuePPM(pixel - (size_t)window * bytes, bytes);
+            hash = addModPPM(hash, HASH_PRIME - mulModPPM(oldValue + 1, dropPower));
+        }
+        hash = addModPPM(mulModPPM(hash, HASH_BASE_ROW), value + 1);
+
+        if (x >= window - 1) {
+            hashes[x - window + 1] = hash;
+        }
+    }
+}
+
+// X: 'hashRowBytesPPM' compiled separately for each pixel size: 8 or 16-bit, grayscale or RGB
+static void hashRowPPM(const unsigned char *row, int width, int bytes, int window, uint64_t dropPower, uint64_t *hashes) {
+    switch (bytes) {
+        case 1: hashRowBytesPPM(row, width, 1, window, dropPower, hashes); break;
+        case 2: hashRowBytesPPM(row, width, 2, window, dropPower, hashes); break;
+        case 3: hashRowBytesPPM(row, width, 3, window, dropPower, hashes); break;
+        default: hashRowBytesPPM(row, width, 6, window, dropPower, hashes); break;
+    }
+}
+
+// X: Check image2 really is at (x, y) in image1, a row at a time
+static int matchesAtPPM(const PPMImage *image1, const PPMImage *image2, int x, int y) {
+    size_t rowLength = (size_t)image2->width * (size_t)image2->channels;
+    for (int row = 0; row < image2->height; ++row) {
+        const unsigned char *haystack = image1->data + ((size_t)(y + row) * image1->width + x) * image1->channels;
+        if (memcmp(haystack, image2->data + rowLength * (size_t)row, rowLength) != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// X: Find every position of image2 in image1, in row order
+// Sets '*matches' to a malloc'd array (freed by the caller) and returns how many there are, or -1 on error
+int findPatternPPM(PPMImage *image1, PPMImage *image2, PPMMatch **matches) {
+    *matches = NULL;
+    if (SAMPLE_BYTES(image1->max_colour) != SAMPLE_BYTES(image2->max_colour)) {
+        return 0;
+    }
+    // Pixels are hashed whole, so planar images are put back together first
+    if ((image1->planar && toInterleavedPPM(image1) != 0) || (image2->planar && toInterleavedPPM(image2) != 0)) {
+        return -1;
+    }
+
+    // Exact matching only compares bytes, so 16-bit images are searched as if each sample were two
+    if (SAMPLE_BYTES(image1->max_colour) == 2) {
+        PPMImage wide1 = *image1, wide2 = *image2;
+        wide1.channels *= 2;
+        wide2.channels *= 2;
+        wide1.max_colour = wide2.max_colour = 255;
+        return findPatternPPM(&wide1, &wide2, matches);
+    }
+    int window = image2->width, tall = image2->height;
+    int positions = image1->width - window + 1; // Window positions along a row
+    if (positions <= 0 || image1->height < tall || image1->channels != image2->channels) {
+        return 0;
+    }
+    TRACE_BEGIN(span, TRACE_PATTERN);
+    TRACE_COUNT(TRACE_CANDIDATES, (size_t)positions * (size_t)(image1->height - tall + 1));
+
+    uint64_t rowDrop = powModPPM(HASH_BASE_ROW, window - 1); // Weight of the oldest pixel in a row window
+    uint64_t columnDrop = powModPPM(HASH_BASE_COLUMN, tall); // Weight of a row leaving a column window
+
+    // Hash of image2: its row hashes combined down the column
+    uint64_t target = 0, single;
+    for (int row = 0; row < tall; ++row) {
+        hashRowPPM(image2->data + (size_t)row * window * image2->channels, window, image2->channels, window, rowDrop, &single);
+        target = addModPPM(mulModPPM(target, HASH_BASE_COLUMN), single);
+    }
+
+    // Row hashes of the row entering and the row leaving the column windows, and the column hashes
+    uint64_t *entering = (uint64_t *)malloc(sizeof(uint64_t) * (size_t)positions * 3);
+    int capacity = 16, count = 0;
+    PPMMatch *found = (PPMMatch *)malloc(sizeof(PPMMatch) * (size_t)capacity);
+    if (entering == NULL || found == NULL) {
+        fprintf(stderr, "Memory allocation failed for the pattern search\n");
+        free(entering);
+        free(found);
+        TRACE_END(span);
+        return -1;
+    }
+    uint64_t *leaving = entering + positions;
+    uint64_t *columns = leaving + positions;
+    memset(columns, 0, sizeof(uint64_t) * (size_t)positions);
+
+    size_t rowLength = (size_t)image1->width * (size_t)image1->channels;
+    for (int y = 0; y < image1->height; ++y) {
+        hashRowPPM(image1->data + rowLength * (size_t)y, image1->width, image1->channels, window, rowDrop, entering);
+
+        // Once the window is full, the row falling out of it is hashed again rather than stored,
+        // so memory stays at three rows of hashes whatever the size of image2
+        if (y >= tall) {
+            hashRowPPM(image1->data + rowLength * (size_t)(y - tall), image1->width, image1->channels, window, rowDrop, leaving);
+            for (int x = 0; x < positions; ++x) {
+                uint64_t shifted = addModPPM(mulModPPM(columns[x], HASH_BASE_COLUMN), entering[x]);
+                columns[x] = addModPPM(shifted, HASH_PRIME - mulModPPM(leaving[x], columnDrop));
+            }
+        } else {
+            for (int x = 0; x < positions; ++x) {
+                columns[x] = addModPPM(mulModPPM(columns[x], HASH_BASE_COLUMN), entering[x]);
+            }
+        }
+
+        // Windows ending on this row
+        if (y < tall - 1) {
+            continue;
+        }
+        int top = y - tall + 1;
+        for (int x = 0; x < positions; ++x) {
+            if (columns[x] != target) {
+                continue;
+            }
+            TRACE_COUNT(TRACE_VERIFIED, 1);
+            if (!matchesAtPPM(image1, image2, x, top)) {
+                continue;
+            }
+            if (count == capacity) {
+                capacity *= 2;
+                PPMMatch *grown = (PPMMatch *)realloc(found, sizeof(PPMMatch) * (size_t)capacity);
+                if (grown == NULL) {
+                    fprintf(stderr, "Memory allocation failed for the pattern search\n");
+                    free(entering);
+                    free(found);
+                    TRACE_END(span);
+                    return -1;
+                }
+                found = grown;
+            }
+            found[count].x = x;
+            found[count].y = top;
+            found[count].score = 0;
+            found[count].pattern = 0;
+            count++;
+        }
+    }
+
+    free(entering);
+    *matches = found;
+    TRACE_END(span);
+    return count;
+}
+
+//----------------MULTI-PATTERN SEARCH-----//
+//-----------------------------------------//
+// Baker-Bird: finds any number of needles in one pass over image1. Every distinct needle row goes into
+// one Aho-Corasick automaton over pixels, so scanning a row of image1 reports, at each pixel, which
+// needle rows end there. Each needle is then a column of row ids, and those columns go into a second
+// automaton, stepped separately for every column of image1 (and every needle width, as rows of different
+// widths end at the same pixel). A needle is found where its column automaton reaches its last row.
+// Matching is exact (symbols are whole pixel values), so nothing needs checking afterwards, and the cost
+// per pixel barely depends on how many needles there are. Image1 is split into bands of rows scanned on
+// the thread pool, each overlapping the next by the tallest needle.
+
+// Aho-Corasick automaton over 64-bit symbols; the transitions live in one open-addressing hash table
+typedef struct {
+    int *fail; // Longest proper suffix of each state that is also a state
+    int *output; // Nearest state on the fail chain that ends a word, or -1
+    int *word; // Word ending exactly at each state, or -1
+    int *parent, *depth;
+    uint64_t *symbol; // Symbol on the edge from the parent
+    int states;
+    int *edgeFrom, *edgeTo; // Hash table of (state, symbol) -> state; edgeFrom is -1 for empty slots
+    uint64_t *edgeSymbol;
+    size_t edgeMask;
+} Automaton;
+
+// X: Slot of the edge (state, symbol) in the hash table, or of the empty slot where it would go
+static inline size_t edgeSlotPPM(const Automaton *automaton, int state, uint64_t symbol) {
+    size_t slot = (size_t)((symbol ^ ((uint64_t)state << 40 | (uint64_t)state)) * 0x9E3779B97F4A7C15ULL >> 17) & automaton->edgeMask;
+    while (automaton->edgeFrom[slot] >= 0 && (automaton->edgeFrom[slot] != state || automaton->edgeSymbol[slot] != symbol)) {
+        slot = (slot + 1) & automaton->edgeMask;
+    }
+    return slot;
+}
+
+// X: Make an empty automaton with room for words totalling 'symbols' symbols. Returns 0 on success
+static int initAutomatonPPM(Automaton *automaton, size_t symbols) {
+    size_t slots = 16;
+    while (slots < symbols * 2) {
+        slots <<= 1;
+    }
+    size_t states = symbols + 1;
+    memset(automaton, 0, sizeof(*automaton));
+    automaton->fail = (int *)malloc(sizeof(int) * states * 5);
+    automaton->symbol = (uint64_t *)malloc(sizeof(uint64_t) * states);
+    automaton->edgeFrom = (int *)malloc(sizeof(int) * slots * 2);
+    automaton->edgeSymbol = (uint64_t *)malloc(sizeof(uint64_t) * slots);
+    if (automaton->fail == NULL || automaton->symbol == NULL || automaton->edgeFrom == NULL || automaton->edgeSymbol == NULL) {
+        fprintf(stderr, "Memory allocation failed for the pattern automaton\n");
+        return -1;
+    }
+    automaton->output = automaton->fail + states;
+    automaton->word = automaton->output + states;
+    automaton->parent = automaton->word + states;
+    automaton->depth = automaton->parent + states;
+    automaton->edgeTo = automaton->edgeFrom + slots;
+    automaton->edgeMask = slots - 1;
+    memset(automaton->edgeFrom, 0xFF, sizeof(int) * slots);
+
+    // State 0 is the root (the empty word)
+    automaton->states = 1;
+    automaton->fail[0] = 0;
+    automaton->output[0] = -1;
+    automaton->word[0] = -1;
+    automaton->parent[0] = -1;
+    automaton->depth[0] = 0;
+    return 0;
+}
+
+static void freeAutomatonPPM(Automaton *automaton) {
+    free(automaton->fail);
+    free(automaton->symbol);
+    free(automaton->edgeFrom);
+    free(automaton->edgeSymbol);
+}
+
+// X: Add a word, returning the state it ends at (shared with any identical word added before)
+static int addWordPPM(Automaton *automaton, const uint64_t *word, int length) {
+    int state = 0;
+    for (int i = 0; i < length; ++i) {
+        size_t slot = edgeSlotPPM(automaton, state, word[i]);
+        if (automaton->edgeFrom[slot] < 0) {
+            int next = automaton->states++;
+            automaton->edgeFrom[slot] = state;
+            automaton->edgeSymbol[slot] = word[i];
+            automaton->edgeTo[slot] = next;
+            automaton->parent[next] = state;
+            automaton->depth[next] = automaton->depth[state] + 1;
+            automaton->symbol[next] = word[i];
+            automaton->word[next] = -1;
+        }
+        state = automaton->edgeTo[slot];
+    }
+    return state;
+}
+
+// X: Follow 'symbol' from 'state', falling back along the fail links when there is no edge for it
+static inline int stepAutomatonPPM(const Automaton *automaton, int state, uint64_t symbol) {
+    while (1) {
+        size_t slot = edgeSlotPPM(automaton, state, symbol);
+        if (automaton->edgeFrom[slot] >= 0) {
+            return automaton->edgeTo[slot];
+        }
+        if (state == 0) {
+            return 0;
+        }
+        state = automaton->fail[state];
+    }
+}
+
+// X: Work out the fail and output links once every word is in, shallowest states first. Returns 0 on success
+static int linkAutomatonPPM(Automaton *automaton) {
+    int states = automaton->states, deepest = 0;
+    for (int state = 0; state < states; ++state) {
+        deepest = automaton->depth[state] > deepest ? automaton->depth[state] : deepest;
+    }
+    int *starts = (int *)calloc((size_t)deepest + 2, sizeof(int));
+    int *order = (int *)malloc(sizeof(int) * (size_t)states);
+    if (starts == NULL || order == NULL) {
+        fprintf(stderr, "Memory allocation failed for the pattern automaton\n");
+        free(starts);
+        free(order);
+        return -1;
+    }
+    // Counting sort by depth
+    for (int state = 0; state < states; ++state) {
+        starts[automaton->depth[state] + 1]++;
+    }
+    for (int depth = 1; depth <= deepest + 1; ++depth) {
+        starts[depth] += starts[depth - 1];
+    }
+    for (int state = 0; state < states; ++state) {
+        order[starts[automaton->depth[state]]++] = state;
+    }
+
+    for (int i = 1; i < states; ++i) {
+        int state = order[i], parent = automaton->parent[state];
+        int fail = 0;
+        if (parent != 0) {
+            fail = stepAutomatonPPM(automaton, automaton->fail[parent], automaton->symbol[state]);
+        }
+        automaton->fail[state] = fail;
+        automaton->output[state] = automaton->word[fail] >= 0 ? fail : automaton->output[fail];
+    }
+    free(starts);
+    free(order);
+    return 0;
+}
+
+// Everything the bands of a multi-pattern search share
+typedef struct {
+    const PPMImage *image;
+    Automaton rows, columns;
+    int *rowWidth; // Width group of each row id
+    int *firstNeedle, *nextNeedle; // Needles ending at each column state, as linked lists
+    int *widths, *heights; // Of each needle
+    int groups, tallest, bytes;
+    int bandRows, bands;
+    PPMMatch **found; // Matches of each band
+    int *foundCount;
+    int failed;
+} MultiPatternJob;
+
+static void multiPatternBandPPM(void *arg, int band) {
+    MultiPatternJob *job = (MultiPatternJob *)arg;
+    const PPMImage *image = job->image;
+    int width = image->width;
+    int first = band * job->bandRows;
+    int last = first + job->bandRows < image->height ? first + job->bandRows : image->height; // Rows matches may start on
+    int scanEnd = last + job->tallest - 1 < image->height ? last + job->tallest - 1 : image->height;
+
+    // Column automaton state (and the row it was last stepped on) for each width group and column
+    size_t cells = (size_t)job->groups * width;
+    int *columnState = (int *)calloc(cells * 2, sizeof(int));
+    int capacity = 16, count = 0;
+    PPMMatch *found = (PPMMatch *)malloc(sizeof(PPMMatch) * (size_t)capacity);
+    if (columnState == NULL || found == NULL) {
+        free(columnState);
+        free(found);
+        job->failed = 1;
+        return;
+    }
+    int *steppedOn = columnState + cells; // Starts at 0 with the states at the root, which also covers row 0
+
+    for (int y = first; y < scanEnd; ++y) {
+        const unsigned char *row = image->data + (size_t)y * width * job->bytes;
+        int state = 0;
+        for (int x = 0; x < width; ++x) {
+            state = stepAutomatonPPM(&job->rows, state, pixelValuePPM(row + (size_t)x * job->bytes, job->bytes));
+
+            // Every needle row ending here (at most one per width) moves its column down a row
+            for (int end = job->rows.word[state] >= 0 ? state : job->rows.output[state]; end >= 0; end = job->rows.output[end]) {
+                int id = job->rows.word[end];
+                size_t cell = (size_t)job->rowWidth[id] * width + x;
+                int column = steppedOn[cell] == y - 1 ? columnState[cell] : 0; // A gap in the column starts it afresh
+                column = stepAutomatonPPM(&job->columns, column, (uint64_t)id);
+                columnState[cell] = column;
+                steppedOn[cell] = y;
+
+                // Needles whose last row this is
+                for (int hit = job->columns.word[column] >= 0 ? column : job->columns.output[column]; hit >= 0; hit = job->columns.output[hit]) {
+                    for (int needle = job->firstNeedle[hit]; needle >= 0; needle = job->nextNeedle[needle]) {
+                        int top = y - job->heights[needle] + 1;
+                        if (top < first || top >= last) {
+                            continue; // Another band's
+                        }
+                        if (count == capacity) {
+                            capacity *= 2;
+                            PPMMatch *grown = (PPMMatch *)realloc(found, sizeof(PPMMatch) * (size_t)capacity);
+                            if (grown == NULL) {
+                                free(columnState);
+                                free(found);
+                                job->failed = 1;
+                                return;
+                            }
+                            found = grown;
+                        }
+                        found[count].x = x - job->widths[needle] + 1;
+                        found[count].y = top;
+                        found[count].score = 0;
+                        found[count].pattern = needle;
+                        count++;
+                    }
+                }
+            }
+        }
+    }
+    free(columnState);
+    job->found[band] = found;
+    job->foundCount[band] = count;
+}
+
+// X: Matches in row order, then column, then needle
+static int compareMatchesPPM(const void *a, const void *b) {
+    const PPMMatch *first = (const PPMMatch *)a, *second = (const PPMMatch *)b;
+    if (first->y != second->y) {
+        return first->y < second->y ? -1 : 1;
+    }
+    if (first->x != second->x) {
+        return first->x < second->x ? -1 : 1;
+    }
+    return (first->pattern > second->pattern) - (first->pattern < second->pattern);
+}
+
+// X: Find every position of each of 'count' needles in image1 in one pass, in row order
+// Each match's 'pattern' is the index of the needle found. Needles of another type than image1 are
+// never found. Sets '*matches' to a malloc'd array (freed by the caller) and returns how many there are, or -1 on error
+int findPatternsPPM(PPMImage *image1, PPMImage **needles, int count, PPMMatch **matches) {
+    *matches = NULL;
+    if (image1->planar && toInterleavedPPM(image1) != 0) {
+        return -1;
+    }
+    for (int i = 0; i < count; ++i) {
+        if (needles[i]->planar && toInterleavedPPM(needles[i]) != 0) {
+            return -1;
+        }
+    }
+
+    // Only needles of the same type that fit can be found
+    MultiPatternJob job;
+    memset(&job, 0, sizeof(job));
+    job.image = image1;
+    job.bytes = image1->channels * SAMPLE_BYTES(image1->max_colour);
+    size_t rowSymbols = 0, columnSymbols = 0;
+    int usable = 0, widest = 0;
+    for (int i = 0; i < count; ++i) {
+        PPMImage *needle = needles[i];
+        if (needle->channels == image1->channels && SAMPLE_BYTES(needle->max_colour) == SAMPLE_BYTES(image1->max_colour)
+            && needle->width <= image1->width && needle->height <= image1->height) {
+            rowSymbols += (size_t)needle->width * needle->height;
+            columnSymbols += (size_t)needle->height;
+            widest = needle->width > widest ? needle->width : widest;
+            usable++;
+        }
+    }
+    if (usable == 0) {
+        return 0;
+    }
+    TRACE_BEGIN(span, TRACE_PATTERN);
+
+    int status = initAutomatonPPM(&job.rows, rowSymbols);
+    status |= initAutomatonPPM(&job.columns, columnSymbols);
+    uint64_t *word = (uint64_t *)malloc(sizeof(uint64_t) * ((size_t)widest + image1->height)); // A row, then a column
+    uint64_t *column = word ? word + widest : NULL;
+    int *columnWord = (int *)malloc(sizeof(int) * (size_t)count);
+    job.rowWidth = (int *)malloc(sizeof(int) * (columnSymbols + 1));
+    job.widths = (int *)malloc(sizeof(int) * (size_t)count * 3);
+    job.firstNeedle = (int *)malloc(sizeof(int) * (columnSymbols + 1));
+    int *groupWidth = (int *)malloc(sizeof(int) * (size_t)count);
+    if (status != 0 || word == NULL || columnWord == NULL || job.rowWidth == NULL || job.widths == NULL || job.firstNeedle == NULL || groupWidth == NULL) {
+        if (status == 0) {
+            fprintf(stderr, "Memory allocation failed for the pattern search\n");
+        }
+        status = -1;
+    }
+    job.heights = job.widths ? job.widths + count : NULL;
+    job.nextNeedle = job.widths ? job.widths + 2 * count : NULL;
+
+    // Rows: one word per distinct needle row, numbered in the order first seen, and tagged with its width group
+    int rowIds = 0;
+    for (int i = 0; status == 0 && i < count; ++i) {
+        PPMImage *needle = needles[i];
+        job.widths[i] = needle->width;
+        job.heights[i] = needle->height;
+        job.nextNeedle[i] = -1;
+        columnWord[i] = -1;
+        if (needle->channels != image1->channels || SAMPLE_BYTES(needle->max_colour) != SAMPLE_BYTES(image1->max_colour)
+            || needle->width > image1->width || needle->height > image1->height) {
+            continue;
+        }
+        int group = 0;
+        while (group < job.groups && groupWidth[group] != needle->width) {
+            group++;
+        }
+        if (group == job.groups) {
+            groupWidth[job.groups++] = needle->width;
+        }
+        job.tallest = needle->height > job.tallest ? needle->height : job.tallest;
+
+        for (int y = 0; y < needle->height; ++y) {
+            const unsigned char *row = needle->data + (size_t)y * needle->width * job.bytes;
+            for (int x = 0; x < needle->width; ++x) {
+                word[x] = pixelValuePPM(row + (size_t)x * job.bytes, job.bytes);
+            }
+            int end = addWordPPM(&job.rows, word, needle->width);
+            if (job.rows.word[end] < 0) {
+                job.rowWidth[rowIds] = group;
+                job.rows.word[end] = rowIds++;
+            }
+            column[y] = (uint64_t)job.rows.word[end];
+        }
+        // Columns: the needle as its row ids from top to bottom
+        int end = addWordPPM(&job.columns, column, needle->height);
+        columnWord[i] = end;
+    }
+    // Needles ending at each column state (identical needles share one)
+    for (int state = 0; status == 0 && state < job.columns.states; ++state) {
+        job.firstNeedle[state] = -1;
+    }
+    for (int i = count - 1; status == 0 && i >= 0; --i) {
+        if (columnWord[i] >= 0) {
+            job.columns.word[columnWord[i]] = columnWord[i];
+            job.nextNeedle[i] = job.firstNeedle[columnWord[i]];
+            job.firstNeedle[columnWord[i]] = i;
+        }
+    }
+    if (status == 0) {
+        status = linkAutomatonPPM(&job.rows) | linkAutomatonPPM(&job.columns);
+    }
+
+    // Scan in bands of rows, each several times taller than the overlap it shares with the next
+    PPMMatch *all = NULL;
+    int total = 0;
+    if (status == 0) {
+        size_t rowBytes = (size_t)image1->width * job.bytes;
+        job.bandRows = (int)(BAND_BYTES / rowBytes) + 1;
+        job.bandRows = job.bandRows < 4 * job.tallest ? 4 * job.tallest : job.bandRows;
+        job.bands = (image1->height + job.bandRows - 1) / job.bandRows;
+        job.found = (PPMMatch **)calloc((size_t)job.bands, sizeof(PPMMatch *));
+        job.foundCount = (int *)calloc((size_t)job.bands, sizeof(int));
+        if (job.found == NULL || job.foundCount == NULL) {
+            fprintf(stderr, "Memory allocation failed for the pattern search\n");
+            status = -1;
+        } else {
+            TRACE_COUNT(TRACE_CANDIDATES, (size_t)image1->width * image1->height);
+            runParallelPPM(multiPatternBandPPM, &job, job.bands);
+            for (int band = 0; band < job.bands; ++band) {
+                total += job.foundCount[band];
+            }
+            all = job.failed ? NULL : (PPMMatch *)malloc(sizeof(PPMMatch) * (size_t)(total > 0 ? total : 1));
+            if (all == NULL) {
+                fprintf(stderr, "Memory allocation failed for the pattern search\n");
+                status = -1;
+            } else {
+                total = 0;
+                for (int band = 0; band < job.bands; ++band) {
+                    memcpy(all + total, job.found[band], sizeof(PPMMatch) * (size_t)job.foundCount[band]);
+                    total += job.foundCount[band];
+                }
+                qsort(all, (size_t)total, sizeof(PPMMatch), compareMatchesPPM);
+            }
+        }
+        for (int band = 0; job.found != NULL && band < job.bands; ++band) {
+            free(job.found[band]);
+        }
+        free(job.found);
+        free(job.foundCount);
+    }
+
+    freeAutomatonPPM(&job.rows);
+    freeAutomatonPPM(&job.columns);
+    free(word);
+    free(columnWord);
+    free(job.rowWidth);
+    free(job.widths);
+    free(job.firstNeedle);
+    free(groupWidth);
+    TRACE_END(span);
+    if (status != 0) {
+        free(all);
+        return -1;
+    }
+    *matches = all;
+    return total;
+}
+
+// X: Find several needles in image1 at once and return one copy of image1 with every match boxed
+// (using 'drawBox'), or NULL if there are none. 'names' label the needles in the report, and may be NULL
+PPMImage *patternsPPM(PPMImage *image1, PPMImage **needles, int count, const char **names) {
+    PPMMatch *matches;
+    int found = findPatternsPPM(image1, needles, count, &matches);
+    if (found <= 0) {
+        if (found == 0) {
+            printf("None of the %d patterns were found in the first image!\n", count);
+        }
+        return NULL;
+    }
+
+    // Report how often each needle was found, and where (the first few places)
+    for (int i = 0; i < count; ++i) {
+        int times = 0;
+        for (int j = 0; j < found; ++j) {
+            times += matches[j].pattern == i;
+        }
+        char label[32];
+        snprintf(label, sizeof(label), "Pattern %d", i + 1);
+        printf("%s: found %d time%s", names ? names[i] : label, times, times == 1 ? "" : "s");
+        for (int j = 0, shown = 0; j < found && shown < 5; ++j) {
+            if (matches[j].pattern == i) {
+                printf("%s(%d, %d)", shown++ == 0 ? " at " : " ", matches[j].x, matches[j].y);
+            }
+        }
+        printf("%s\n", times > 5 ? " ..." : "");
+    }
+
+    PPMImage *patternImage = boxPatternsPPM(image1, needles, matches, found);
+    free(matches);
+    return patternImage;
+}
+
+// X: Copy image1 once and draw a box the size of the needle found around every match, using 'drawBox()'
+PPMImage *boxPatternsPPM(PPMImage *image1, PPMImage **needles, const PPMMatch *matches, int count) {
+    PPMImage *patternImage = allocPPM(image1->format, image1->width, image1->height, image1->max_colour, image1->channels);
+    if (patternImage == NULL) {
+        return NULL;
+    }
+    memcpy(patternImage->data, image1->data, (size_t)image1->width * image1->height * image1->channels * SAMPLE_BYTES(image1->max_colour));
+    for (int i = 0; i < count; ++i) {
+        const PPMImage *needle = needles[matches[i].pattern];
+        drawBox(patternImage, patternImage->width, patternImage->height, matches[i].x, matches[i].y, needle->width, needle->height);
+    }
+    return patternImage;
+}
+
+//----------------APPROXIMATE SEARCH-------//
+//-----------------------------------------//
+// Tolerant template matching for images that have been through JPEG or picked up sensor noise.
+// Both images are shrunk into a pyramid of half-size levels. Every offset is scored only at the
+// smallest level, and the best candidates are then refined within a couple of pixels at each
+// larger level. Each level carries summed-area tables of the per-pixel sample sums and squares,
+// so the window sums needed for NCC normalisation (and the SAD lower bound |sum I - sum T| used
+// to skip hopeless offsets) cost O(1) per offset.
+#define MATCH_MIN_SIDE 8 // Levels stop before the template would shrink below this
+#define MATCH_MAX_LEVELS 6
+#define MATCH_REFINE 2 // Pixels searched either side of a candidate on the next level up
+
+// One level of the pyramid
+typedef struct {
+    int width, height, channels;
+    float *data; // Samples, interleaved like PPMImage
+    double *sum, *squares; // Summed-area tables, (width + 1) * (height + 1)
+} MatchLevel;
+
+// Best candidates found so far, kept sorted with the best first
+typedef struct {
+    PPMMatch *items;
+    int count, capacity;
+    int mode;
+} MatchList;
+
+// Shared state for scoring bands of rows in parallel
+typedef struct {
+    const MatchLevel *image, *pattern;
+    int mode;
+    int bandRows;
+    MatchList *lists; // One list per band
+} MatchJob;
+
+// X: Build a pyramid level from an image, or from the level below when 'image' is NULL
+static int buildLevelPPM(MatchLevel *level, const PPMImage *image, const MatchLevel *below) {
+    level->channels = image ? image->channels : below->channels;
+    level->width = image ? image->width : below->width / 2;
+    level->height = image ? image->height : below->height / 2;
+    int width = level->width, height = level->height, channels = level->channels;
+    size_t tableLength = (size_t)(width + 1) * (size_t)(height + 1);
+
+    level->data = (float *)malloc(sizeof(float) * (size_t)width * height * channels);
+    level->sum = (double *)malloc(sizeof(double) * tableLength * 2);
+    if (level->data == NULL || level->sum == NULL) {
+        free(level->data);
+        free(level->sum);
+        level->data = NULL;
+        level->sum = NULL;
+        return -1;
+    }
+    level->squares = level->sum + tableLength;
+
+    // Samples: copied (from 8 or 16-bit storage), or averaged over 2x2 blocks of the level below
+    size_t count = (size_t)width * height * channels;
+    if (image && SAMPLE_BYTES(image->max_colour) == 2) {
+        const uint16_t *samples = (const uint16_t *)image->data;
+        for (size_t i = 0; i < count; ++i) {
+            level->data[i] = samples[i];
+        }
+    } else if (image) {
+        for (size_t i = 0; i < count; ++i) {
+            level->data[i] = image->data[i];
+        }
+    } else {
+        for (int y = 0; y < height; ++y) {
+            for (int x = 0; x < width; ++x) {
+                for (int c = 0; c < channels; ++c) {
+                    const float *top = below->data + ((size_t)(2 * y) * below->width + 2 * x) * channels + c;
+                    const float *bottom = top + (size_t)below->width * channels;
+                    level->data[((size_t)y * width + x) * channels + c] = (top[0] + top[channels] + bottom[0] + bottom[channels]) * 0.25f;
+                }
+            }
+        }
+    }
+
+    // Summed-area tables, with a zero row and column in front
+    memset(level->sum, 0, sizeof(double) * (size_t)(width + 1));
+    memset(level->squares, 0, sizeof(double) * (size_t)(width + 1));
+    for (int y = 0; y < height; ++y) {
+        double rowSum = 0, rowSquares = 0;
+        double *sumRow = level->sum + (size_t)(y + 1) * (width + 1);
+        double *squareRow = level->squares + (size_t)(y + 1) * (width + 1);
+        sumRow[0] = squareRow[0] = 0;
+        for (int x = 0; x < width; ++x) {
+            for (int c = 0; c < channels; ++c) {
+                double value = level->data[((size_t)y * width + x) * channels + c];
+                rowSum += value;
+                rowSquares += value * value;
+            }
+            sumRow[x + 1] = sumRow[x + 1 - (width + 1)] + rowSum;
+            squareRow[x + 1] = squareRow[x + 1 - (width + 1)] + rowSquares;
+        }
+    }
+    return 0;
+}
+
+// X: Sum of a summed-area table over the window at (x, y)
+static inline double windowSumPPM(const double *table, int tableWidth, int x, int y, int width, int height) {
+    const double *top = table + (size_t)y * tableWidth + x;
+    const double *bottom = top + (size_t)height * tableWidth;
+    return bottom[width] - bottom[0] - top[width] + top[0];
+}
+
+// X: Cost of placing the pattern at (x, y): the SAD score, or minus the NCC score, so lower is always better
+// SAD gives up early once it cannot beat 'cutoff'
+static double matchCostPPM(const MatchLevel *image, const MatchLevel *pattern, int x, int y, int mode, double cutoff) {
+    int tableWidth = image->width + 1;
+    int rowSamples = pattern->width * pattern->channels;
+    double samples = (double)rowSamples * pattern->height;
+    double imageSum = windowSumPPM(image->sum, tableWidth, x, y, pattern->width, pattern->height);
+    double patternSum = pattern->sum[(size_t)pattern->height * (pattern->width + 1) + pattern->width];
+
+    if (mode == MATCH_SAD) {
+        // |sum I - sum T| can never exceed the SAD, so it rules most offsets out in O(1)
+        double limit = cutoff * samples;
+        if (fabs(imageSum - patternSum) > limit) {
+            return fabs(imageSum - patternSum) / samples;
+        }
+        double total = 0;
+        for (int row = 0; row < pattern->height && total <= limit; ++row) {
+            const float *a = image->data + ((size_t)(y + row) * image->width + x) * image->channels;
+            const float *b = pattern->data + (size_t)row * rowSamples;
+            float rowTotal = 0;
+            for (int i = 0; i < rowSamples; ++i) {
+                rowTotal += fabsf(a[i] - b[i]);
+            }
+            total += rowTotal;
+        }
+        return total / samples;
+    }
+
+    // NCC: only the cross term needs the pixels, the rest comes from the tables
+    double cross = 0;
+    for (int row = 0; row < pattern->height; ++row) {
+        const float *a = image->data + ((size_t)(y + row) * image->width + x) * image->channels;
+        const float *b = pattern->data + (size_t)row * rowSamples;
+        float rowCross = 0;
+        for (int i = 0; i < rowSamples; ++i) {
+            rowCross += a[i] * b[i];
+        }
+        cross += rowCross;
+    }
+    double imageSquares = windowSumPPM(image->squares, tableWidth, x, y, pattern->width, pattern->height);
+    double patternSquares = pattern->squares[(size_t)pattern->height * (pattern->width + 1) + pattern->width];
+    double imageVariance = imageSquares - imageSum * imageSum / samples;
+    double patternVariance = patternSquares - patternSum * patternSum / samples;
+
+    // Flat windows have no correlation to speak of: they only match a flat pattern
+    if (imageVariance <= 1e-6 || patternVariance <= 1e-6) {
+        return (imageVariance <= 1e-6 && patternVariance <= 1e-6) ? -1.0 : 0.0;
+    }
+    return -(cross - imageSum * patternSum / samples) / sqrt(imageVariance * patternVariance);
+}
+
+// X: Offer a candidate to a list, keeping only the best 'capacity'
+static void offerMatchPPM(MatchList *list, int x, int y, double cost) {
+    if (list->count == list->capacity && cost >= list->items[list->count - 1].score) {
+        return;
+    }
+    int i = list->count < list->capacity ? list->count++ : list->count - 1;
+    while (i > 0 && list->items[i - 1].score > cost) {
+        list->items[i] = list->items[i - 1];
+        --i;
+    }
+    list->items[i].x = x;
+    list->items[i].y = y;
+    list->items[i].score = cost;
+}
+
+// X: Score every offset in one band of rows of the smallest level
+static void matchBandPPM(void *arg, int band) {
+    MatchJob *job = (MatchJob *)arg;
+    MatchList *list = &job->lists[band];
+    int first = band * job->bandRows;
+    int last = first + job->bandRows;
+    if (last > job->image->height - job->pattern->height + 1) {
+        last = job->image->height - job->pattern->height + 1;
+    }
+
+    for (int y = first; y < last; ++y) {
+        for (int x = 0; x <= job->image->width - job->pattern->width; ++x) {
+            double cutoff = list->count == list->capacity ? list->items[list->count - 1].score : INFINITY;
+            offerMatchPPM(list, x, y, matchCostPPM(job->image, job->pattern, x, y, job->mode, cutoff));
+        }
+    }
+    if (last > first) {
+        TRACE_COUNT(TRACE_CANDIDATES, (size_t)(last - first) * (size_t)(job->image->width - job->pattern->width + 1));
+    }
+}
+
+// X: Find up to 'topK' places where image2 closely matches image1, best first
+// Matches must score within 'threshold' (see MATCH_SAD and MATCH_NCC) and may not overlap by more than
+// half the pattern. Sets '*matches' to a malloc'd array and returns how many there are, or -1 on error
+int matchPPM(PPMImage *image1, PPMImage *image2, int mode, double threshold, int topK, PPMMatch **matches) {
+    *matches = NULL;
+    if (image1->channels != image2->channels || image2->width > image1->width || image2->height > image1->height || topK <= 0) {
+        return 0;
+    }
+    if ((image1->planar && toInterleavedPPM(image1) != 0) || (image2->planar && toInterleavedPPM(image2) != 0)) {
+        return -1;
+    }
+    TRACE_BEGIN(span, TRACE_MATCH);
+
+    // Build the pyramids
+    MatchLevel images[MATCH_MAX_LEVELS], patterns[MATCH_MAX_LEVELS];
+    int levels = 0, status = 0;
+    while (levels < MATCH_MAX_LEVELS) {
+        if (buildLevelPPM(&images[levels], levels ? NULL : image1, levels ? &images[levels - 1] : NULL) != 0) {
+            status = -1;
+            break;
+        }
+        if (buildLevelPPM(&patterns[levels], levels ? NULL : image2, levels ? &patterns[levels - 1] : NULL) != 0) {
+            free(images[levels].data);
+            free(images[levels].sum);
+            status = -1;
+            break;
+        }
+        levels++;
+        if (patterns[levels - 1].width / 2 < MATCH_MIN_SIDE || patterns[levels - 1].height / 2 < MATCH_MIN_SIDE) {
+            break;
+        }
+    }
+
+    // Candidates carried up the pyramid: plenty more than asked for, as coarse scores are only a guide
+    int keep = topK * 4 < 64 ? 64 : topK * 4;
+    PPMMatch *candidates = (PPMMatch *)malloc(sizeof(PPMMatch) * (size_t)keep);
+    int count = 0;
+
+    if (status == 0 && candidates != NULL) {
+        // Score every offset of the smallest level, in bands across the thread pool
+        const MatchLevel *image = &images[levels - 1], *pattern = &patterns[levels - 1];
+        int rows = image->height - pattern->height + 1;
+        MatchJob job;
+        job.image = image;
+        job.pattern = pattern;
+        job.mode = mode;
+        job.bandRows = rows < 64 ? 1 : rows / 64;
+        int bands = (rows + job.bandRows - 1) / job.bandRows;
+        job.lists = (MatchList *)calloc((size_t)bands, sizeof(MatchList));
+        for (int band = 0; job.lists != NULL && band < bands; ++band) {
+            job.lists[band].capacity = keep;
+            job.lists[band].items = (PPMMatch *)malloc(sizeof(PPMMatch) * (size_t)keep);
+            if (job.lists[band].items == NULL) {
+                status = -1;
+            }
+        }
+
+        if (job.lists != NULL && status == 0) {
+            runParallelPPM(matchBandPPM, &job, bands);
+
+            // Merge the bands' lists
+            MatchList merged = {candidates, 0, keep, mode};
+            for (int band = 0; band < bands; ++band) {
+                for (int i = 0; i < job.lists[band].count; ++i) {
+                    offerMatchPPM(&merged, job.lists[band].items[i].x, job.lists[band].items[i].y, job.lists[band].items[i].score);
+                }
+            }
+            count = merged.count;
+        } else {
+            status = -1;
+        }
+        for (int band = 0; job.lists != NULL && band < bands; ++band) {
+            free(job.lists[band].items);
+        }
+        free(job.lists);
+
+        // Refine each candidate on every larger level, searching a little way around where it lands
+        for (int level = levels - 2; status == 0 && level >= 0; --level) {
+            image = &images[level];
+            pattern = &patterns[level];
+            for (int i = 0; i < count; ++i) {
+                int bestX = 0, bestY = 0;
+                double best = INFINITY;
+                for (int y = 2 * candidates[i].y - MATCH_REFINE; y <= 2 * candidates[i].y + MATCH_REFINE + 1; ++y) {
+                    for (int x = 2 * candidates[i].x - MATCH_REFINE; x <= 2 * candidates[i].x + MATCH_REFINE + 1; ++x) {
+                        if (x < 0 || y < 0 || x > image->width - pattern->width || y > image->height - pattern->height) {
+                            continue;
+                        }
+                        TRACE_COUNT(TRACE_CANDIDATES, 1);
+                        double cost = matchCostPPM(image, pattern, x, y, mode, best);
+                        if (cost < best) {
+                            best = cost;
+                            bestX = x;
+                            bestY = y;
+                        }
+                    }
+                }
+                candidates[i].x = bestX;
+                candidates[i].y = bestY;
+                candidates[i].score = best;
+            }
+        }
+    } else {
+        status = -1;
+    }
+
+    for (int level = 0; level < levels; ++level) {
+        free(images[level].data);
+        free(images[level].sum);
+        free(patterns[level].data);
+        free(patterns[level].sum);
+    }
+    if (status != 0) {
+        fprintf(stderr, "Memory allocation failed for the approximate search\n");
+        free(candidates);
+        TRACE_END(span);
+        return -1;
+    }
+
+    // Best first, then drop anything over the threshold or overlapping a better match
+    MatchList sorted = {(PPMMatch *)malloc(sizeof(PPMMatch) * (size_t)keep), 0, keep, mode};
+    if (sorted.items == NULL) {
+        free(candidates);
+        TRACE_END(span);
+        return -1;
+    }
+    for (int i = 0; i < count; ++i) {
+        offerMatchPPM(&sorted, candidates[i].x, candidates[i].y, candidates[i].score);
+    }
+    free(candidates);
+
+    int kept = 0;
+    for (int i = 0; i < sorted.count && kept < topK; ++i) {
+        PPMMatch match = sorted.items[i];
+        double score = (mode == MATCH_SAD) ? match.score : -match.score;
+        if ((mode == MATCH_SAD && score > threshold) || (mode == MATCH_NCC && score < threshold)) {
+            break; // The rest are worse still
+        }
+        int overlaps = 0;
+        for (int j = 0; j < kept && !overlaps; ++j) {
+            overlaps = abs(sorted.items[j].x - match.x) * 2 < image2->width && abs(sorted.items[j].y - match.y) * 2 < image2->height;
+        }
+        if (!overlaps) {
+            match.score = score;
+            sorted.items[kept++] = match;
+        }
+    }
+
+    *matches = sorted.items;
+    TRACE_END(span);
+    return kept;
+}
+
+// X: Approximate pattern detect (m): box the best close matches of image2 in a copy of image1
+PPMImage *approxPatternPPM(PPMImage *image1, PPMImage *image2, int mode, double threshold, int topK) {
+    PPMMatch *matches;
+    int count = matchPPM(image1, image2, mode, threshold, topK, &matches);
+    if (count <= 0) {
+        if (count == 0) {
+            printf("No close match for the second image was found in the first image!\n");
+        }
+        free(matches);
+        return NULL;
+    }
+
+    for (int i = 0; i < count; ++i) {
+        printf("Close match at position: (%d, %d), %s %.3f\n", matches[i].x, matches[i].y,
+               mode == MATCH_NCC ? "correlation" : "mean difference", matches[i].score);
+    }
+    PPMImage *matchImage = boxMatchesPPM(image1, image2, matches, count);
+    free(matches);
+    return matchImage;
+}
+
+//----------------FRAME AVERAGING----------//
+//-----------------------------------------//
+// Averages any number of frames (e.g. for temporal denoising) while holding only one frame and a
+// 32-bit sum per sample: frames are read, added in and released one at a time.
+// Weights go up to 256, so a weighted sample still fits in 16 bits for the vector multiply
+
+// X: Add 'count' samples times 'weight' into 'sums', 16 samples at a time where SSE2 is available
+static void accumulateRowPPM(uint32_t *sums, const unsigned char *data, size_t count, int weight) {
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i scale = _mm_set1_epi16((short)weight);
+    for (; i + 16 <= count; i += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i *)(data + i));
+        __m128i low = _mm_mullo_epi16(_mm_unpacklo_epi8(bytes, zero), scale);
+        __m128i high = _mm_mullo_epi16(_mm_unpackhi_epi8(bytes, zero), scale);
+        __m128i *out = (__m128i *)(sums + i);
+        _mm_storeu_si128(out, _mm_add_epi32(_mm_loadu_si128(out), _mm_unpacklo_epi16(low, zero)));
+        _mm_storeu_si128(out + 1, _mm_add_epi32(_mm_loadu_si128(out + 1), _mm_unpackhi_epi16(low, zero)));
+        _mm_storeu_si128(out + 2, _mm_add_epi32(_mm_loadu_si128(out + 2), _mm_unpacklo_epi16(high, zero)));
+        _mm_storeu_si128(out + 3, _mm_add_epi32(_mm_loadu_si128(out + 3), _mm_unpackhi_epi16(high, zero)));
+    }
+#endif
+    for (; i < count; i++) {
+        sums[i] += (uint32_t)data[i] * (uint32_t)weight;
+    }
+}
+
+// X: 'accumulateRowPPM' for 16-bit samples, 8 at a time: the low and high halves of each
+// product are multiplied separately and interleaved back into 32-bit sums
+static void accumulateRow16PPM(uint32_t *sums, const uint16_t *data, size_t count, int weight) {
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i scale = _mm_set1_epi16((short)weight);
+    for (; i + 8 <= count; i += 8) {
+        __m128i samples = _mm_loadu_si128((const __m128i *)(data + i));
+        __m128i low = _mm_mullo_epi16(samples, scale);
+        __m128i high = _mm_mulhi_epu16(samples, scale);
+        __m128i *out = (__m128i *)(sums + i);
+        _mm_storeu_si128(out, _mm_add_epi32(_mm_loadu_si128(out), _mm_unpacklo_epi16(low, high)));
+        _mm_storeu_si128(out + 1, _mm_add_epi32(_mm_loadu_si128(out + 1), _mm_unpackhi_epi16(low, high)));
+    }
+#endif
+    for (; i < count; i++) {
+        sums[i] += (uint32_t)data[i] * (uint32_t)weight;
+    }
+}
+
+// Bands of samples to add in (or divide out) on the thread pool
+typedef struct {
+    PPMAccumulator *sum;
+    const unsigned char *data; // Frame being added, or NULL when finishing
+    unsigned char *out; // Averaged samples when finishing
+    int weight;
+    size_t count, bandSamples;
+} AverageJob;
+
+static void averageBandPPM(void *arg, int band) {
+    AverageJob *job = (AverageJob *)arg;
+    size_t first = (size_t)band * job->bandSamples;
+    size_t last = first + job->bandSamples < job->count ? first + job->bandSamples : job->count;
+    uint32_t *sums = job->sum->sums;
+
+    int wide = SAMPLE_BYTES(job->sum->max_colour) == 2;
+    if (job->data != NULL && wide) {
+        accumulateRow16PPM(sums + first, (const uint16_t *)job->data + first, last - first, job->weight);
+    } else if (job->data != NULL) {
+        accumulateRowPPM(sums + first, job->data + first, last - first, job->weight);
+    } else {
+        // Round to nearest (halves up), exactly, whatever the total weight
+        uint32_t total = job->sum->weight;
+        for (size_t i = first; i < last; i++) {
+            uint32_t value = (sums[i] + total / 2) / total;
+            if (wide) {
+                ((uint16_t *)job->out)[i] = (uint16_t)value;
+            } else {
+                job->out[i] = (unsigned char)value;
+            }
+        }
+    }
+}
+
+// X: Run an 'AverageJob' over all samples in bands
+static void averageSamplesPPM(AverageJob *job) {
+    job->count = (size_t)job->sum->width * (size_t)job->sum->height * (size_t)job->sum->channels;
+    job->bandSamples = BAND_BYTES;
+    runParallelPPM(averageBandPPM, job, (int)((job->count + job->bandSamples - 1) / job->bandSamples));
+}
+
+// X: Start a sum shaped like 'first' (which is not added in). Returns 0 on success
+int beginAveragePPM(PPMAccumulator *sum, const PPMImage *first) {
+    if (first->planar) {
+        fprintf(stderr, "Error: Frames to average must be interleaved, not planar.\n");
+        return -1;
+    }
+    strcpy(sum->format, first->format);
+    sum->width = first->width;
+    sum->height = first->height;
+    sum->max_colour = first->max_colour;
+    sum->channels = first->channels;
+    sum->weight = 0;
+
+    size_t count = (size_t)first->width * (size_t)first->height * (size_t)first->channels;
+    sum->sums = (uint32_t *)takeBufferPPM(count * sizeof(uint32_t), &sum->poolClass);
+    if (sum->sums == NULL) {
+        fprintf(stderr, "Memory allocation failed for the frame sum\n");
+        return -1;
+    }
+    memset(sum->sums, 0, count * sizeof(uint32_t));
+    return 0;
+}
+
+// X: Add a frame into the sum with a weight from 1 to 256. Returns 0 on success
+int accumulatePPM(PPMAccumulator *sum, const PPMImage *frame, int weight) {
+    if (frame->width != sum->width || frame->height != sum->height || frame->channels != sum->channels
+        || SAMPLE_BYTES(frame->max_colour) != SAMPLE_BYTES(sum->max_colour) || frame->planar) {
+        fprintf(stderr, "Error: Frames to average must be the same size and type.\n");
+        return -1;
+    }
+    if (weight < 1 || weight > 256) {
+        fprintf(stderr, "Error: Frame weights must be from 1 to 256.\n");
+        return -1;
+    }
+    // The sums are 32-bit, which allows a total weight of about 16 million at 8 bits per sample
+    // and 65536 at 16 bits
+    if ((uint64_t)(sum->weight + weight) * (uint64_t)sum->max_colour > UINT32_MAX) {
+        fprintf(stderr, "Error: Too many frames to average.\n");
+        return -1;
+    }
+
+    TRACE_BEGIN(span, TRACE_AVERAGE);
+    AverageJob job;
+    job.sum = sum;
+    job.data = frame->data;
+    job.out = NULL;
+    job.weight = weight;
+    averageSamplesPPM(&job);
+    sum->weight += (uint32_t)weight;
+    TRACE_COUNT(TRACE_PIXELS, (size_t)frame->width * (size_t)frame->height);
+    TRACE_END(span);
+    return 0;
+}
+
+// X: Finish a sum: write the average into 'into' (which must be the same shape) or a new image if
+// 'into' is NULL, and release the sum. Returns the averaged image, or NULL on error
+PPMImage *endAveragePPM(PPMAccumulator *sum, PPMImage *into) {
+    PPMImage *average = into;
+    if (average == NULL) {
+        average = allocPPM(sum->format, sum->width, sum->height, sum->max_colour, sum->channels);
+    } else if (into->width != sum->width || into->height != sum->height || into->channels != sum->channels
+               || SAMPLE_BYTES(into->max_colour) != SAMPLE_BYTES(sum->max_colour)) {
+        fprintf(stderr, "Error: The average does not fit the image it is meant to go into.\n");
+        average = NULL;
+    }
+
+    if (average != NULL && sum->weight > 0) {
+        AverageJob job;
+        job.sum = sum;
+        job.data = NULL;
+        job.out = average->data;
+        averageSamplesPPM(&job);
+    }
+    giveBufferPPM((unsigned char *)sum->sums, sum->poolClass);
+    sum->sums = NULL;
+    return average;
+}
+
+// X: Average a list of files (each with its weight, or all equal if 'weights' is NULL) into 'output'
+// Only one input frame is held at a time. Returns 0 on success
+int averageFilesPPM(const char **files, int count, const int *weights, const char *output, int binary) {
+    PPMAccumulator sum;
+    sum.sums = NULL;
+    int status = 0, firstBinary = 0;
+
+    // The next few frames are read from disk while this one is added in
+    for (int i = 0; i < count && i < prefetchDepth; ++i) {
+        readAheadPPM(files[i]);
+    }
+    for (int i = 0; i < count && status == 0; ++i) {
+        if (i + prefetchDepth < count) {
+            readAheadPPM(files[i + prefetchDepth]);
+        }
+        PPMImage *frame = readPPM(files[i]);
+        if (frame == NULL) {
+            status = -1;
+            break;
+        }
+        if (i == 0) {
+            firstBinary = isBinaryPPM(frame);
+            status = beginAveragePPM(&sum, frame);
+        }
+        if (status == 0 && accumulatePPM(&sum, frame, weights ? weights[i] : 1) != 0) {
+            fprintf(stderr, "Error: Could not add %s to the average.\n", files[i]);
+            status = -1;
+        }
+        freePPM(frame);
+    }
+
+    if (sum.sums == NULL) {
+        return -1;
+    }
+    PPMImage *average = endAveragePPM(&sum, NULL);
+    if (status == 0 && average != NULL) {
+        status = savePPM(output, average, binary < 0 ? firstBinary : binary);
+    } else {
+        status = -1;
+    }
+    freePPM(average);
+    return status;
+}
+
+//----------------STATISTICS---------------//
+//-----------------------------------------//
+// 'statsPPM' reads the image once, on the thread pool. Each band covers whole rows of the preview and
+// keeps its own histograms, so bands never share counters; min, max, mean and deviation all come out
+// of the histograms afterwards, so the pass itself only counts samples and sums preview cells
+
+// Bands of preview rows, each with its own histograms
+typedef struct {
+    const PPMImage *image;
+    PPMStats *stats;
+    uint32_t *histograms; // 'bins' counts per channel, for each band
+    uint64_t *cells; // Sums of each sample of each preview cell
+    const int *cellOfColumn; // Preview column each image column falls in
+    int bandRows; // Preview rows per band
+} StatsJob;
+
+static void statsBandPPM(void *arg, int band) {
+    StatsJob *job = (StatsJob *)arg;
+    const PPMImage *image = job->image;
+    PPMStats *stats = job->stats;
+    int channels = image->channels;
+    uint32_t *histogram = job->histograms + (size_t)band * channels * stats->bins;
+    memset(histogram, 0, sizeof(uint32_t) * channels * stats->bins);
+
+    int firstCell = band * job->bandRows;
+    int lastCell = firstCell + job->bandRows < stats->previewHeight ? firstCell + job->bandRows : stats->previewHeight;
+    for (int cellRow = firstCell; cellRow < lastCell; ++cellRow) {
+        uint64_t *cells = job->cells + (size_t)cellRow * stats->previewWidth * channels;
+        int first = (int)((int64_t)cellRow * image->height / stats->previewHeight);
+        int last = (int)((int64_t)(cellRow + 1) * image->height / stats->previewHeight);
+        size_t samples = (size_t)image->width * channels;
+
+        for (int y = first; y < last; ++y) {
+            if (SAMPLE_BYTES(image->max_colour) == 2) {
+                const uint16_t *row = (const uint16_t *)image->data + (size_t)y * samples;
+                for (int x = 0; x < image->width; ++x) {
+                    uint64_t *cell = cells + (size_t)job->cellOfColumn[x] * channels;
+                    for (int c = 0; c < channels; ++c) {
+                        uint16_t value = row[(size_t)x * channels + c];
+                        histogram[(size_t)c * stats->bins + value]++;
+                        cell[c] += value;
+                    }
+                }
+            } else if (channels == 3) {
+                const unsigned char *row = image->data + (size_t)y * samples;
+                for (int x = 0; x < image->width; ++x) {
+                    uint64_t *cell = cells + (size_t)job->cellOfColumn[x] * 3;
+                    histogram[row[x * 3]]++;
+                    histogram[256 + row[x * 3 + 1]]++;
+                    histogram[512 + row[x * 3 + 2]]++;
+                    cell[0] += row[x * 3];
+                    cell[1] += row[x * 3 + 1];
+                    cell[2] += row[x * 3 + 2];
+                }
+            } else {
+                const unsigned char *row = image->data + (size_t)y * samples;
+                for (int x = 0; x < image->width; ++x) {
+                    histogram[row[x]]++;
+                    cells[job->cellOfColumn[x]] += row[x];
+                }
+            }
+        }
+    }
+}
+
+// X: Gather histograms, min/max/mean/deviation and out-of-range counts for each channel of an
+// interleaved image, and a box-filtered 'previewWidth' x 'previewHeight' thumbnail of its brightness
+// Returns 0 on success; release the results with 'freeStatsPPM'
+int statsPPM(const PPMImage *image, PPMStats *stats, int previewWidth, int previewHeight) {
+    if (image->planar) {
+        fprintf(stderr, "Error: Statistics need an interleaved image, not a planar one.\n");
+        return -1;
+    }
+    int channels = image->channels;
+    memset(stats, 0, sizeof(*stats));
+    stats->channels = channels;
+    stats->bins = SAMPLE_BYTES(image->max_colour) == 2 ? 65536 : 256;
+    stats->previewWidth = previewWidth < 1 ? 1 : previewWidth > image->width ? image->width : previewWidth;
+    stats->previewHeight = previewHeight < 1 ? 1 : previewHeight > image->height ? image->height : previewHeight;
+
+    // One band per few preview rows: enough to keep every thread busy
+    StatsJob job;
+    int bands = stats->previewHeight < 64 ? stats->previewHeight : 64;
+    job.bandRows = (stats->previewHeight + bands - 1) / bands;
+    bands = (stats->previewHeight + job.bandRows - 1) / job.bandRows;
+    size_t cellCount = (size_t)stats->previewWidth * stats->previewHeight;
+    job.image = image;
+    job.stats = stats;
+    job.histograms = (uint32_t *)malloc(sizeof(uint32_t) * (size_t)bands * channels * stats->bins);
+    job.cells = (uint64_t *)calloc(cellCount * channels, sizeof(uint64_t));
+    int *cellOfColumn = (int *)malloc(sizeof(int) * (size_t)image->width);
+    stats->histogram = (uint64_t *)calloc((size_t)channels * stats->bins, sizeof(uint64_t));
+    stats->preview = (unsigned char *)malloc(cellCount);
+    if (job.histograms == NULL || job.cells == NULL || cellOfColumn == NULL || stats->histogram == NULL || stats->preview == NULL) {
+        fprintf(stderr, "Memory allocation failed for the image statistics\n");
+        free(job.histograms);
+        free(job.cells);
+        free(cellOfColumn);
+        freeStatsPPM(stats);
+        return -1;
+    }
+    for (int x = 0; x < image->width; ++x) {
+        cellOfColumn[x] = (int)((int64_t)x * stats->previewWidth / image->width);
+    }
+    job.cellOfColumn = cellOfColumn;
+
+    TRACE_BEGIN(span, TRACE_STATS);
+    runParallelPPM(statsBandPPM, &job, bands);
+    TRACE_COUNT(TRACE_PIXELS, (uint64_t)image->width * image->height);
+
+    // Merge the bands' histograms, then read everything else off them
+    size_t total = (size_t)channels * stats->bins;
+    for (int band = 0; band < bands; ++band) {
+        const uint32_t *histogram = job.histograms + (size_t)band * total;
+        for (size_t i = 0; i < total; ++i) {
+            stats->histogram[i] += histogram[i];
+        }
+    }
+    double pixels = (double)image->width * image->height;
+    for (int c = 0; c < channels; ++c) {
+        const uint64_t *histogram = stats->histogram + (size_t)c * stats->bins;
+        double sum = 0, squares = 0;
+        stats->min[c] = -1;
+        for (int v = 0; v < stats->bins; ++v) {
+            if (histogram[v] == 0) {
+                continue;
+            }
+            stats->min[c] = stats->min[c] < 0 ? v : stats->min[c];
+            stats->max[c] = v;
+            sum += (double)v * histogram[v];
+            if (v > image->max_colour) {
+                stats->outOfRange[c] += histogram[v];
+            }
+        }
+        stats->mean[c] = sum / pixels;
+        for (int v = stats->min[c]; v <= stats->max[c]; ++v) {
+            double difference = v - stats->mean[c];
+            squares += difference * difference * histogram[v];
+        }
+        stats->deviation[c] = sqrt(squares / pixels);
+    }
+
+    // Each cell's average colour, as brightness (Rec. 601 weights for RGB)
+    for (size_t i = 0; i < cellCount; ++i) {
+        int cellX = (int)(i % stats->previewWidth), cellY = (int)(i / stats->previewWidth);
+        double area = (double)(((int64_t)(cellX + 1) * image->width + stats->previewWidth - 1) / stats->previewWidth
+                               - ((int64_t)cellX * image->width + stats->previewWidth - 1) / stats->previewWidth)
+                    * (double)((int64_t)(cellY + 1) * image->height / stats->previewHeight - (int64_t)cellY * image->height / stats->previewHeight);
+        const uint64_t *cell = job.cells + i * channels;
+        double level = channels == 3 ? 0.299 * cell[0] + 0.587 * cell[1] + 0.114 * cell[2] : (double)cell[0];
+        level = level / area / image->max_colour;
+        stats->preview[i] = (unsigned char)(level >= 1 ? 255 : level * 255 + 0.5);
+    }
+    TRACE_END(span);
+
+    free(job.histograms);
+    free(job.cells);
+    free(cellOfColumn);
+    return 0;
+}
+
+// X: Release what 'statsPPM' allocated
+void freeStatsPPM(PPMStats *stats) {
+    free(stats->histogram);
+    free(stats->preview);
+    stats->histogram = NULL;
+    stats->preview = NULL;
+}
+
+//----------------PLANAR LAYOUT------------//
+//-----------------------------------------//
+// RGB samples are normally interleaved (data[i * 3] red, data[i * 3 + 1] green, data[i * 3 + 2] blue).
+// A planar image keeps three separate planes instead, so a kernel working along a row of one plane
+// reads neighbouring samples of the same colour from consecutive, aligned addresses. 'edgePPM' and
+// 'addPPM' work on either layout; operations that need whole pixels convert planar images back first.
+
+// X: Split one interleaved RGB row into a row of each plane ('planeBytes' apart)
+static void splitRowPPM(const unsigned char *in, unsigned char *out, size_t planeBytes, int width, int depth) {
+    if (depth == 2) {
+        const uint16_t *samples = (const uint16_t *)in;
+        uint16_t *red = (uint16_t *)out, *green = (uint16_t *)(out + planeBytes), *blue = (uint16_t *)(out + planeBytes * 2);
+        for (int x = 0; x < width; ++x) {
+            red[x] = samples[x * 3];
+            green[x] = samples[x * 3 + 1];
+            blue[x] = samples[x * 3 + 2];
+        }
+    } else {
+        unsigned char *red = out, *green = out + planeBytes, *blue = out + planeBytes * 2;
+        for (int x = 0; x < width; ++x) {
+            red[x] = in[x * 3];
+            green[x] = in[x * 3 + 1];
+            blue[x] = in[x * 3 + 2];
+        }
+    }
+}
+
+// X: Put one row of each plane ('planeBytes' apart) back together as an interleaved RGB row
+static void mergeRowPPM(const unsigned char *in, size_t planeBytes, unsigned char *out, int width, int depth) {
+    if (depth == 2) {
+        const uint16_t *red = (const uint16_t *)in, *green = (const uint16_t *)(in + planeBytes), *blue = (const uint16_t *)(in + planeBytes * 2);
+        uint16_t *samples = (uint16_t *)out;
+        for (int x = 0; x < width; ++x) {
+            samples[x * 3] = red[x];
+            samples[x * 3 + 1] = green[x];
+            samples[x * 3 + 2] = blue[x];
+        }
+    } else {
+        const unsigned char *red = in, *green = in + planeBytes, *blue = in + planeBytes * 2;
+        for (int x = 0; x < width; ++x) {
+            out[x * 3] = red[x];
+            out[x * 3 + 1] = green[x];
+            out[x * 3 + 2] = blue[x];
+        }
+    }
+}
+
+// X: Decode the pixels of a mapped RGB file (see 'loadPPM') straight into planes 'stride' bytes per row
+// 8-bit binary rows are split from the mapping itself; anything else goes through one row of scratch
+static int decodePlanarPPM(PPMReader *reader, const PPMImage *image, unsigned char *data, size_t stride) {
+    int depth = SAMPLE_BYTES(image->max_colour);
+    size_t samples = (size_t)image->width * 3;
+    size_t planeBytes = stride * (size_t)image->height;
+    unsigned char *scratch = NULL;
+    if (!isBinaryPPM(image) || depth == 2) {
+        scratch = (unsigned char *)malloc(samples * depth);
+        if (scratch == NULL) {
+            fprintf(stderr, "Memory allocation failed for the row buffer\n");
+            return -1;
+        }
+    }
+
+    int status = 0;
+    for (int y = 0; status == 0 && y < image->height; ++y) {
+        const unsigned char *row = image->data + samples * depth * (size_t)y;
+        if (!isBinaryPPM(image)) {
+            status = depth == 2 ? readSamples16PPM(reader, (uint16_t *)scratch, samples, image->max_colour)
+                                : readSamplesPPM(reader, scratch, samples, image->max_colour);
+            row = scratch;
+        } else if (depth == 2) {
+            swapSamplesPPM((uint16_t *)scratch, row, samples);
+            row = scratch;
+        }
+        splitRowPPM(row, data + stride * (size_t)y, planeBytes, image->width, depth);
+    }
+    free(scratch);
+    return status;
+}
+
+// X: Create a planar image with an uninitialised pixel buffer from the pool
+// Grayscale images only have one plane, so they are created as usual by 'allocPPM'
+PPMImage *allocPlanarPPM(const char *format, int width, int height, int max_colour, int channels) {
+    if (channels != 3) {
+        return allocPPM(format, width, height, max_colour, channels);
+    }
+    PPMImage *image = newHeaderPPM();
+    if (image == NULL) {
+        return NULL;
+    }
+    strcpy(image->format, format);
+    image->width = width;
+    image->height = height;
+    image->max_colour = max_colour;
+    image->channels = channels;
+    image->planar = 1;
+    image->stride = ((size_t)width * SAMPLE_BYTES(max_colour) + PLANE_ALIGN - 1) / PLANE_ALIGN * PLANE_ALIGN;
+
+    image->data = takeBufferPPM(image->stride * (size_t)height * 3, &image->poolClass);
+    if (image->data == NULL) {
+        fprintf(stderr, "Memory allocation failed for image data\n");
+        freePPM(image);
+        return NULL;
+    }
+    return image;
+}
+
+// X: Read a PPM file, with RGB images decoded straight into planes (grayscale is read as usual)
+PPMImage *readPlanarPPM(const char *filename) {
+    return loadPPM(filename, 1);
+}
+
+// X: Swap an image's pixels for 'data', releasing the old ones (which may be a file mapping)
+static void replaceDataPPM(PPMImage *image, unsigned char *data, int poolClass) {
+    if (image->map != NULL) {
+        munmap(image->map, image->mapLength);
+        image->map = NULL;
+        image->mapLength = 0;
+    } else {
+        giveBufferPPM(image->data, image->poolClass);
+    }
+    image->data = data;
+    image->poolClass = poolClass;
+}
+
+// X: Convert an interleaved RGB image to planar in place. Grayscale and planar images are left as they are
+// Returns 0 on success, or -1 (leaving the image unchanged) if memory runs out
+int toPlanarPPM(PPMImage *image) {
+    if (image->planar || image->channels != 3) {
+        return 0;
+    }
+    int depth = SAMPLE_BYTES(image->max_colour);
+    size_t rowLength = (size_t)image->width * 3 * depth;
+    size_t stride = ((size_t)image->width * depth + PLANE_ALIGN - 1) / PLANE_ALIGN * PLANE_ALIGN;
+    int poolClass;
+    unsigned char *data = takeBufferPPM(stride * (size_t)image->height * 3, &poolClass);
+    if (data == NULL) {
+        fprintf(stderr, "Memory allocation failed for image data\n");
+        return -1;
+    }
+
+    for (int y = 0; y < image->height; ++y) {
+        splitRowPPM(image->data + rowLength * (size_t)y, data + stride * (size_t)y, stride * (size_t)image->height, image->width, depth);
+    }
+    replaceDataPPM(image, data, poolClass);
+    image->planar = 1;
+    image->stride = stride;
+    return 0;
+}
+
+// X: Convert a planar image back to interleaved in place. Returns 0 on success, or -1 if memory runs out
+int toInterleavedPPM(PPMImage *image) {
+    if (!image->planar) {
+        return 0;
+    }
+    int depth = SAMPLE_BYTES(image->max_colour);
+    size_t rowLength = (size_t)image->width * 3 * depth;
+    int poolClass;
+    unsigned char *data = takeBufferPPM(rowLength * (size_t)image->height, &poolClass);
+    if (data == NULL) {
+        fprintf(stderr, "Memory allocation failed for image data\n");
+        return -1;
+    }
+
+    for (int y = 0; y < image->height; ++y) {
+        mergeRowPPM(PLANE_ROW(image, 0, y), image->stride * (size_t)image->height, data + rowLength * (size_t)y, image->width, depth);
+    }
+    replaceDataPPM(image, data, poolClass);
+    image->planar = 0;
+    image->stride = 0;
+    return 0;
+}
+
+// X: Append the pixels of a planar image to a file started with 'beginSavePPM', a row at a time
+void writePlanarPPM(PPMWriter *writer, const PPMImage *image) {
+    int depth = SAMPLE_BYTES(image->max_colour);
+    size_t samples = (size_t)image->width * 3;
+    unsigned char *row = (unsigned char *)malloc(samples * depth);
+    if (row == NULL) {
+        fprintf(stderr, "Memory allocation failed for the row buffer\n");
+        writer->failed = 1;
+        return;
+    }
+    for (int y = 0; y < image->height && !writer->failed; ++y) {
+        mergeRowPPM(PLANE_ROW(image, 0, y), image->stride * (size_t)image->height, row, image->width, depth);
+        writePixelsPPM(writer, row, samples);
+    }
+    free(row);
+}
+
+//----------------REGION DECODE------------//
+//-----------------------------------------//
+// 'readRegionPPM' loads a window of an image without decoding the rest. Binary rows are at known
+// offsets, so only the pages holding the window are read from the mapped file. ASCII numbers vary in
+// length, so the first region read of an ASCII file builds a sidecar index (FILE.rowidx) holding the
+// byte offset of every INDEX_ROWS-th row and of every INDEX_COLUMNS-th pixel along it. Later reads jump
+// straight to the nearest offset and decode only a few hundred samples per row. The index records the
+// file's size and modification time, and is rebuilt if either changes.
+
+// Start of a region index file, followed by one entry per indexed row: the row's offset in the file
+// (uint64_t), then the offset of every INDEX_COLUMNS-th pixel after the first, relative to it (uint32_t)
+typedef struct {
+    char magic[8]; // "PPMIDX1\n"
+    uint64_t fileSize;
+    int64_t modified, modifiedNs; // Modification time of the file
+    uint32_t width, height;
+    uint32_t rowStep, columnStep; // Rows between entries, pixels between column offsets
+} RegionIndex;
+
+// X: Decode ASCII samples of either depth
+static int decodeSamplesPPM(PPMReader *reader, unsigned char *data, size_t count, int max_colour) {
+    return SAMPLE_BYTES(max_colour) == 2 ? readSamples16PPM(reader, (uint16_t *)data, count, max_colour)
+                                         : readSamplesPPM(reader, data, count, max_colour);
+}
+
+// X: Bytes in one index entry
+static size_t indexEntryPPM(const RegionIndex *index) {
+    return sizeof(uint64_t) + sizeof(uint32_t) * (size_t)((index->width - 1) / index->columnStep);
+}
+
+// X: Map the index of 'filename' if it exists and still matches the file. Returns NULL otherwise
+static unsigned char *openIndexPPM(const char *path, const RegionIndex *expected, size_t *length) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat info;
+    RegionIndex found;
+    size_t wanted = sizeof(RegionIndex) + indexEntryPPM(expected) * ((expected->height + expected->rowStep - 1) / expected->rowStep);
+    if (fstat(fd, &info) != 0 || (size_t)info.st_size != wanted || read(fd, &found, sizeof(found)) != (ssize_t)sizeof(found)
+        || memcmp(&found, expected, sizeof(found)) != 0) {
+        close(fd);
+        return NULL;
+    }
+    unsigned char *map = mmap(NULL, wanted, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+    *length = wanted;
+    return map;
+}
+
+// X: Decode a whole ASCII image once, noting where its rows and columns start, and save that as its index
+// Returns the index (header and entries) in a malloc'd buffer, or NULL on error. Failing to save is not an error
+static unsigned char *buildIndexPPM(const PPMImage *image, const char *path, const RegionIndex *header, size_t *length) {
+    size_t entry = indexEntryPPM(header);
+    size_t entries = (header->height + header->rowStep - 1) / header->rowStep;
+    size_t samples = (size_t)image->width * (size_t)image->channels;
+    *length = sizeof(RegionIndex) + entry * entries;
+    unsigned char *index = (unsigned char *)malloc(*length);
+    unsigned char *scratch = (unsigned char *)malloc(samples * SAMPLE_BYTES(image->max_colour));
+    if (index == NULL || scratch == NULL) {
+        fprintf(stderr, "Memory allocation failed for the region index\n");
+        free(index);
+        free(scratch);
+        return NULL;
+    }
+    memcpy(index, header, sizeof(RegionIndex));
+
+    PPMReader reader;
+    reader.pos = image->data;
+    reader.end = (unsigned char *)image->map + image->mapLength;
+    reader.fd = -1;
+    reader.buffer = NULL;
+    reader.capacity = 0;
+    const unsigned char *map = (const unsigned char *)image->map;
+    int status = 0;
+    for (int y = 0; y < image->height && status == 0; ++y) {
+        if (y % header->rowStep != 0) {
+            status = decodeSamplesPPM(&reader, scratch, samples, image->max_colour);
+            continue;
+        }
+        // Indexed rows are decoded INDEX_COLUMNS pixels at a time, noting where each piece ends
+        unsigned char *out = index + sizeof(RegionIndex) + entry * (size_t)(y / header->rowStep);
+        uint64_t start = (uint64_t)(reader.pos - map);
+        memcpy(out, &start, sizeof(start));
+        for (int x = 0, column = 0; x < image->width && status == 0; x += header->columnStep) {
+            int run = image->width - x < (int)header->columnStep ? image->width - x : (int)header->columnStep;
+            status = decodeSamplesPPM(&reader, scratch, (size_t)run * image->channels, image->max_colour);
+            if (x + run < image->width) {
+                uint32_t offset = (uint32_t)(reader.pos - map - start);
+                memcpy(out + sizeof(uint64_t) + sizeof(uint32_t) * (size_t)column++, &offset, sizeof(offset));
+            }
+        }
+    }
+    free(scratch);
+    if (status != 0) {
+        fprintf(stderr, "Error: Failed to read the pixel data in %s\n", path);
+        free(index);
+        return NULL;
+    }
+
+    // Saved under a temporary name and renamed, as another process may be reading the same file
+    char temporary[PATH_MAX + 8];
+    snprintf(temporary, sizeof(temporary), "%s.XXXXXX", path);
+    int fd = mkstemp(temporary);
+    if (fd >= 0) {
+        fchmod(fd, 0644);
+        int written = write(fd, index, *length) == (ssize_t)*length;
+        close(fd);
+        if (!written || rename(temporary, path) != 0) {
+            unlink(temporary);
+        }
+    }
+    return index;
+}
+
+// X: Read the window of 'width' x 'height' pixels at (x, y) of a PPM file into a new image
+// of the same format. Returns NULL if the window is not inside the image or the file cannot be read
+PPMImage *readRegionPPM(const char *filename, int x, int y, int width, int height) {
+    TRACE_BEGIN(span, TRACE_READ);
+    PPMImage *file = mapPPM(filename);
+    if (file == NULL) {
+        TRACE_END(span);
+        return NULL;
+    }
+    if (x < 0 || y < 0 || width <= 0 || height <= 0 || x > file->width - width || y > file->height - height) {
+        fprintf(stderr, "Error: The region %dx%d at (%d, %d) is not inside %s (%dx%d)\n", width, height, x, y, filename, file->width, file->height);
+        freePPM(file);
+        TRACE_END(span);
+        return NULL;
+    }
+    madvise(file->map, file->mapLength, MADV_RANDOM); // Only a few pages are wanted
+
+    PPMImage *region = allocPPM(file->format, width, height, file->max_colour, file->channels);
+    if (region == NULL) {
+        freePPM(file);
+        TRACE_END(span);
+        return NULL;
+    }
+    int depth = SAMPLE_BYTES(file->max_colour);
+    size_t pixelBytes = (size_t)file->channels * depth;
+    size_t regionRow = (size_t)width * pixelBytes;
+    int status = 0;
+
+    if (isBinaryPPM(file)) {
+        // Binary rows are copied (and 16-bit samples put in the machine's byte order) straight from the mapping
+        for (int row = 0; row < height; ++row) {
+            const unsigned char *in = file->data + ((size_t)(y + row) * file->width + x) * pixelBytes;
+            unsigned char *out = region->data + regionRow * (size_t)row;
+            if (depth == 2) {
+                swapSamplesPPM((uint16_t *)out, in, regionRow / 2);
+            } else {
+                memcpy(out, in, regionRow);
+            }
+        }
+    } else {
+        // ASCII: find (or make) the index
+        struct stat info;
+        RegionIndex header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, "PPMIDX1\n", 8);
+        stat(filename, &info);
+        header.fileSize = (uint64_t)info.st_size;
+        header.modified = (int64_t)info.st_mtim.tv_sec;
+        header.modifiedNs = (int64_t)info.st_mtim.tv_nsec;
+        header.width = (uint32_t)file->width;
+        header.height = (uint32_t)file->height;
+        header.rowStep = getenv("IMAGEPROC_INDEX_ROWS") && atoi(getenv("IMAGEPROC_INDEX_ROWS")) > 0 ? (uint32_t)atoi(getenv("IMAGEPROC_INDEX_ROWS")) : INDEX_ROWS;
+        header.columnStep = INDEX_COLUMNS;
+
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s.rowidx", filename);
+        size_t indexLength;
+        int mapped = 1;
+        unsigned char *index = openIndexPPM(path, &header, &indexLength);
+        if (index == NULL) {
+            madvise(file->map, file->mapLength, MADV_SEQUENTIAL);
+            index = buildIndexPPM(file, path, &header, &indexLength);
+            mapped = 0;
+        }
+
+        size_t entry = indexEntryPPM(&header);
+        size_t samples = (size_t)file->width * file->channels;
+        unsigned char *scratch = (unsigned char *)malloc(samples * depth);
+        status = (index != NULL && scratch != NULL) ? 0 : -1;
+        PPMReader reader;
+        reader.end = (unsigned char *)file->map + file->mapLength;
+        reader.fd = -1;
+        reader.buffer = NULL;
+        reader.capacity = 0;
+
+        for (int row = 0; row < height && status == 0; ++row) {
+            // Jump to the indexed row at or above this one and decode down to it
+            const unsigned char *at = index + sizeof(RegionIndex) + entry * (size_t)((y + row) / header.rowStep);
+            uint64_t start;
+            memcpy(&start, at, sizeof(start));
+            reader.pos = (unsigned char *)file->map + start;
+            for (int skip = (y + row) % header.rowStep; skip > 0 && status == 0; --skip) {
+                status = decodeSamplesPPM(&reader, scratch, samples, file->max_colour);
+            }
+
+            // Then to the nearest column offset at or before x (only indexed rows have them)
+            size_t before = (size_t)x * file->channels;
+            if ((y + row) % header.rowStep == 0 && x >= (int)header.columnStep) {
+                uint32_t offset;
+                memcpy(&offset, at + sizeof(uint64_t) + sizeof(uint32_t) * (size_t)(x / header.columnStep - 1), sizeof(offset));
+                reader.pos = (unsigned char *)file->map + start + offset;
+                before = (size_t)(x % header.columnStep) * file->channels;
+            }
+            if (status == 0 && before > 0) {
+                status = decodeSamplesPPM(&reader, scratch, before, file->max_colour);
+            }
+            if (status == 0) {
+                status = decodeSamplesPPM(&reader, region->data + regionRow * (size_t)row, (size_t)width * file->channels, file->max_colour);
+            }
+        }
+        if (status != 0 && index != NULL && scratch != NULL) {
+            fprintf(stderr, "Error: Failed to read the pixel data in %s\n", filename);
+        }
+        free(scratch);
+        if (mapped) {
+            munmap(index, indexLength);
+        } else {
+            free(index);
+        }
+    }
+
+    freePPM(file);
+    if (status != 0) {
+        freePPM(region);
+        region = NULL;
+    }
+    TRACE_END(span);
+    return region;
+}
+
+//----------------PIPELINE-----------------//
+//-----------------------------------------//
+// Operators are chained into a pipeline and nothing is computed until it is saved. The output is then
+// produced in row bands, each band pulling just the rows it needs through the chain, so e.g. add then
+// edge reads each input pixel about once and never builds the combined image.
+// Build one with 'PPMPipeline pipe; pipe.count = 0;' then the 'pipe...PPM' functions, which return
+// the new stage's index, or -1 on error (an input of -1 is passed through, so checks can wait until the end)
+
+// X: Append a stage shaped like 'input' (or like 'image' for sources). Returns its index, or -1
+static int pipeStagePPM(PPMPipeline *pipe, int operation, int input1, int input2, PPMImage *image) {
+    if (input1 < 0 && image == NULL) {
+        return -1;
+    }
+    if (pipe->count == PIPE_STAGES) {
+        fprintf(stderr, "Error: Too many pipeline stages (at most %d)\n", PIPE_STAGES);
+        return -1;
+    }
+
+    PipeStage *stage = &pipe->stages[pipe->count];
+    memset(stage, 0, sizeof(PipeStage));
+    stage->operation = operation;
+    stage->inputs[0] = input1;
+    stage->inputs[1] = input2;
+    if (image != NULL) {
+        strcpy(stage->format, image->format);
+        stage->width = image->width;
+        stage->height = image->height;
+        stage->max_colour = image->max_colour;
+        stage->channels = image->channels;
+        stage->image = image;
+    } else {
+        const PipeStage *from = &pipe->stages[input1];
+        strcpy(stage->format, from->format);
+        stage->width = from->width;
+        stage->height = from->height;
+        stage->max_colour = from->max_colour;
+        stage->channels = from->channels;
+    }
+    return pipe->count++;
+}
+
+// X: Pipeline stage that reads an image already in memory
+int pipeSourcePPM(PPMPipeline *pipe, PPMImage *image) {
+    // Rows are pulled through the pipeline whole, so planar images are put back together first
+    if (image == NULL || (image->planar && toInterleavedPPM(image) != 0)) {
+        return -1;
+    }
+    return pipeStagePPM(pipe, PIPE_SOURCE, -1, -1, image);
+}
+
+// X: Pipeline stage averaging two stages of the same size and type
+int pipeAddPPM(PPMPipeline *pipe, int input1, int input2) {
+    if (input1 < 0 || input2 < 0) {
+        return -1;
+    }
+    const PipeStage *a = &pipe->stages[input1], *b = &pipe->stages[input2];
+    if (a->width != b->width || a->height != b->height || a->channels != b->channels
+        || SAMPLE_BYTES(a->max_colour) != SAMPLE_BYTES(b->max_colour)) {
+        fprintf(stderr, "Error: Images to add must be the same size and type\n");
+        return -1;
+    }
+    return pipeStagePPM(pipe, PIPE_ADD, input1, input2, NULL);
+}
+
+// X: Pipeline stage edge detecting another
+int pipeEdgePPM(PPMPipeline *pipe, int input) {
+    return pipeStagePPM(pipe, PIPE_EDGE, input, -1, NULL);
+}
+
+// X: Pipeline stage turning another into black and max_colour at 'level'
+int pipeThresholdPPM(PPMPipeline *pipe, int input, int level) {
+    int index = pipeStagePPM(pipe, PIPE_THRESHOLD, input, -1, NULL);
+    if (index >= 0) {
+        pipe->stages[index].level = level;
+    }
+    return index;
+}
+
+// X: Pipeline stage drawing a box around each match on another stage. 'matches' must outlive the pipeline
+int pipeBoxesPPM(PPMPipeline *pipe, int input, const PPMMatch *matches, int count, int boxWidth, int boxHeight) {
+    int index = pipeStagePPM(pipe, PIPE_BOXES, input, -1, NULL);
+    if (index >= 0) {
+        PipeStage *stage = &pipe->stages[index];
+        stage->matches = matches;
+        stage->count = count;
+        stage->boxWidth = boxWidth;
+        stage->boxHeight = boxHeight;
+    }
+    return index;
+}
+
+// Rows one band keeps for each stage: a ring of recent rows, tagged with their row numbers.
+// A stage can be asked for any row within 'reach' of the output row, so a ring of 2 * reach + 1
+// rows never overwrites a row that is still in use
+typedef struct {
+    const PPMPipeline *pipe;
+    unsigned char *rows[PIPE_STAGES];
+    int *tags[PIPE_STAGES];
+    int ringSize[PIPE_STAGES];
+} PipeBand;
+
+// X: Get row 'y' of a stage, computing it (and the input rows it needs) if the ring does not have it
+static const unsigned char *pipeRowPPM(PipeBand *band, int index, int y) {
+    const PipeStage *stage = &band->pipe->stages[index];
+    size_t samples = (size_t)stage->width * (size_t)stage->channels;
+    int wide = SAMPLE_BYTES(stage->max_colour) == 2; // 16-bit samples
+    size_t rowLength = samples << wide;
+    if (stage->operation == PIPE_SOURCE) {
+        return stage->image->data + rowLength * (size_t)y;
+    }
+
+    int slot = y % band->ringSize[index];
+    unsigned char *out = band->rows[index] + rowLength * (size_t)slot;
+    if (band->tags[index][slot] == y) {
+        return out;
+    }
+
+    switch (stage->operation) {
+        case PIPE_ADD: {
+            const unsigned char *a = pipeRowPPM(band, stage->inputs[0], y);
+            const unsigned char *b = pipeRowPPM(band, stage->inputs[1], y);
+            if (wide) {
+                const uint16_t *a16 = (const uint16_t *)a, *b16 = (const uint16_t *)b;
+                uint16_t *out16 = (uint16_t *)out;
+                for (size_t i = 0; i < samples; i++) {
+                    out16[i] = (uint16_t)((a16[i] & b16[i]) + ((a16[i] ^ b16[i]) >> 1));
+                }
+            } else {
+                for (size_t i = 0; i < samples; i++) {
+                    out[i] = (a[i] + b[i]) / 2;
+                }
+            }
+            break;
+        }
+        case PIPE_EDGE:
+            // The top and bottom rows are left black, as in 'edgePPM'
+            if (y == 0 || y == stage->height - 1) {
+                memset(out, 0, rowLength);
+            } else {
+                const unsigned char *above = pipeRowPPM(band, stage->inputs[0], y - 1);
+                const unsigned char *row = pipeRowPPM(band, stage->inputs[0], y);
+                const unsigned char *below = pipeRowPPM(band, stage->inputs[0], y + 1);
+                (wide ? edgeRow16PPM : edgeRowPPM)(above, row, below, out, stage->width, stage->channels, stage->max_colour);
+            }
+            break;
+        case PIPE_THRESHOLD: {
+            const unsigned char *in = pipeRowPPM(band, stage->inputs[0], y);
+            if (wide) {
+                const uint16_t *in16 = (const uint16_t *)in;
+                uint16_t *out16 = (uint16_t *)out, high = (uint16_t)stage->max_colour;
+                for (size_t i = 0; i < samples; i++) {
+                    out16[i] = in16[i] >= stage->level ? high : 0;
+                }
+            } else {
+                unsigned char high = (unsigned char)stage->max_colour;
+                for (size_t i = 0; i < samples; i++) {
+                    out[i] = in[i] >= stage->level ? high : 0;
+                }
+            }
+            break;
+        }
+        case PIPE_BOXES: {
+            memcpy(out, pipeRowPPM(band, stage->inputs[0], y), rowLength);
+
+            // Same colours as 'drawBox': max_colour for grayscale, red for RGB (full red for 16-bit)
+            unsigned char colour[6] = {(unsigned char)stage->max_colour, 0, 0, 0, 0, 0};
+            if (wide) {
+                uint16_t value = (uint16_t)stage->max_colour;
+                memcpy(colour, &value, 2);
+            } else if (stage->channels == 3) {
+                colour[0] = 255;
+            }
+            size_t pixelBytes = (size_t)stage->channels << wide;
+            for (int i = 0; i < stage->count; ++i) {
+                int top = stage->matches[i].y, left = stage->matches[i].x;
+                if (y < top || y >= top + stage->boxHeight) {
+                    continue;
+                }
+                // The top and bottom rows of a box are solid, the rows between only have their two sides
+                int edgeRow = (y == top || y == top + stage->boxHeight - 1);
+                int step = edgeRow ? 1 : stage->boxWidth - 1;
+                for (int x = left; x < left + stage->boxWidth && x < stage->width; x += step > 0 ? step : 1) {
+                    memcpy(out + (size_t)x * pixelBytes, colour, pixelBytes);
+                }
+            }
+            break;
+        }
+    }
+    band->tags[index][slot] = y;
+    return out;
+}
+
+// Rows 'first' to 'first + rows' of a pipeline, split into bands for the thread pool
+typedef struct {
+    const PPMPipeline *pipe;
+    int stage; // Stage being produced
+    int ringSize[PIPE_STAGES];
+    unsigned char *chunk; // Output for the rows, one after another
+    int first, rows, bandRows;
+} PipeJob;
+
+static void pipeBandPPM(void *arg, int band) {
+    PipeJob *job = (PipeJob *)arg;
+    const PPMPipeline *pipe = job->pipe;
+    const PipeStage *top = &pipe->stages[job->stage];
+    size_t rowLength = (size_t)top->width * (size_t)top->channels * SAMPLE_BYTES(top->max_colour);
+
+    int first = band * job->bandRows;
+    int last = first + job->bandRows;
+    if (last > job->rows) {
+        last = job->rows;
+    }
+
+    // Give each stage this band needs its ring of rows, all in one buffer
+    PipeBand rings;
+    rings.pipe = pipe;
+    size_t rowBytes = 0, tagCount = 0;
+    for (int i = 0; i <= job->stage; ++i) {
+        rowBytes += (size_t)job->ringSize[i] * (size_t)pipe->stages[i].width * (size_t)pipe->stages[i].channels * SAMPLE_BYTES(pipe->stages[i].max_colour);
+        tagCount += (size_t)job->ringSize[i];
+    }
+    int poolClass;
+    unsigned char *buffer = takeBufferPPM(tagCount * sizeof(int) + rowBytes, &poolClass);
+    if (buffer == NULL) {
+        fprintf(stderr, "Memory allocation failed for pipeline rows\n");
+        memset(job->chunk + rowLength * (size_t)first, 0, rowLength * (size_t)(last - first));
+        return;
+    }
+    int *tags = (int *)buffer;
+    unsigned char *rows = buffer + tagCount * sizeof(int);
+    for (int i = 0; i <= job->stage; ++i) {
+        rings.ringSize[i] = job->ringSize[i];
+        rings.tags[i] = tags;
+        rings.rows[i] = rows;
+        for (int slot = 0; slot < job->ringSize[i]; ++slot) {
+            tags[slot] = -1;
+        }
+        tags += job->ringSize[i];
+        rows += (size_t)job->ringSize[i] * (size_t)pipe->stages[i].width * (size_t)pipe->stages[i].channels * SAMPLE_BYTES(pipe->stages[i].max_colour);
+    }
+
+    for (int y = first; y < last; ++y) {
+        memcpy(job->chunk + rowLength * (size_t)y, pipeRowPPM(&rings, job->stage, job->first + y), rowLength);
+    }
+    giveBufferPPM(buffer, poolClass);
+}
+
+// X: Evaluate a pipeline stage and save it, a chunk of row bands at a time. Returns 0 on success
+int savePipelinePPM(const PPMPipeline *pipe, int stage, const char *filename, int binary) {
+    if (stage < 0 || stage >= pipe->count) {
+        return -1;
+    }
+    const PipeStage *top = &pipe->stages[stage];
+    size_t samples = (size_t)top->width * (size_t)top->channels;
+    size_t rowLength = samples * SAMPLE_BYTES(top->max_colour);
+
+    // Work out how far above and below the output row each stage can be read (one row more per edge
+    // stage on the way), which sets the size of its ring. Inputs always come before their stage
+    PipeJob job;
+    job.pipe = pipe;
+    job.stage = stage;
+    int reach[PIPE_STAGES];
+    for (int i = 0; i <= stage; ++i) {
+        reach[i] = -1;
+    }
+    reach[stage] = 0;
+    for (int i = stage; i >= 0; --i) {
+        const PipeStage *current = &pipe->stages[i];
+        int extra = current->operation == PIPE_EDGE ? 1 : 0;
+        for (int k = 0; k < 2 && reach[i] >= 0 && current->operation != PIPE_SOURCE; ++k) {
+            int input = current->inputs[k];
+            if (input >= 0 && reach[input] < reach[i] + extra) {
+                reach[input] = reach[i] + extra;
+            }
+        }
+        job.ringSize[i] = (reach[i] < 0 || current->operation == PIPE_SOURCE) ? 0 : 2 * reach[i] + 1;
+    }
+
+    // Each chunk is a few bands per thread, written out before the next is computed
+    pthread_once(&threadPoolOnce, startPoolPPM);
+    job.bandRows = (int)(BAND_BYTES / rowLength) + 1;
+    int chunkRows = job.bandRows * 2 * (threadPool.threadCount + 1);
+    if (chunkRows > top->height) {
+        chunkRows = top->height;
+    }
+    int poolClass;
+    job.chunk = takeBufferPPM(rowLength * (size_t)chunkRows, &poolClass);
+    if (job.chunk == NULL) {
+        fprintf(stderr, "Memory allocation failed for pipeline output\n");
+        return -1;
+    }
+
+    PPMImage header;
+    strcpy(header.format, top->format);
+    header.width = top->width;
+    header.height = top->height;
+    header.max_colour = top->max_colour;
+    header.channels = top->channels;
+    PPMWriter *writer = beginSavePPM(filename, &header, binary);
+    if (writer == NULL) {
+        giveBufferPPM(job.chunk, poolClass);
+        return -1;
+    }
+
+    TRACE_BEGIN(span, TRACE_PIPELINE);
+    for (job.first = 0; job.first < top->height; job.first += chunkRows) {
+        job.rows = top->height - job.first < chunkRows ? top->height - job.first : chunkRows;
+        runParallelPPM(pipeBandPPM, &job, (job.rows + job.bandRows - 1) / job.bandRows);
+        writePixelsPPM(writer, job.chunk, samples * (size_t)job.rows);
+    }
+    giveBufferPPM(job.chunk, poolClass);
+    TRACE_COUNT(TRACE_PIXELS, (size_t)top->width * (size_t)top->height);
+
+    int status = endSavePPM(writer);
+    TRACE_END(span);
+    if (status != 0) {
+        fprintf(stderr, "Error: Failed to write %s\n", filename);
+        return -1;
+    }
+    return 0;
+}
+
+//----------------BENCHMARKS---------------//
+//-----------------------------------------//
+// 'imageproc bench' times each operation on generated images and prints one JSON object per line,
+// so the reports of two versions can be diffed. Images are made from a fixed seed, so every run
+// (and every version) works on exactly the same pixels
+#define BENCH_READ 0
+#define BENCH_SAVE 1
+#define BENCH_EDGE 2
+#define BENCH_ADD 3
+#define BENCH_PATTERN 4
+#define BENCH_FILTER 5
+
+// X: Create an image of random pixels, the same every time for the same arguments
+// A seed of 0 gives a flat image (every sample max_colour / 2), the worst case for pattern search
+PPMImage *generatePPM(const char *format, int width, int height, int max_colour, uint32_t seed) {
+    int channels = (format[1] == '2' || format[1] == '5') ? 1 : 3;
+    PPMImage *image = allocPPM(format, width, height, max_colour, channels);
+    if (image == NULL) {
+        return NULL;
+    }
+
+    size_t count = (size_t)width * (size_t)height * (size_t)channels;
+    uint32_t state = seed;
+    for (size_t i = 0; i < count; ++i) {
+        uint32_t value = (uint32_t)max_colour / 2;
+        if (seed != 0) {
+            // xorshift32
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            value = state % (uint32_t)(max_colour + 1);
+        }
+        if (SAMPLE_BYTES(max_colour) == 2) {
+            ((uint16_t *)image->data)[i] = (uint16_t)value;
+        } else {
+            image->data[i] = (unsigned char)value;
+        }
+    }
+    return image;
+}
+
+// Images and files one set of measurements works on
+typedef struct {
+    PPMImage *image, *other, *needle;
+    const char *input; // 'image' saved in the format being measured
+    const char *output; // Scratch file for saves
+    int binary;
+    int filter, border, magnitude; // For BENCH_FILTER
+} BenchSet;
+
+// X: Milliseconds on a steady clock
+static double nowPPM(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1e3 + now.tv_nsec / 1e6;
+}
+
+static int compareTimesPPM(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// X: Run one operation once. Returns 0 on success
+static int benchOncePPM(int operation, const BenchSet *set) {
+    PPMImage *result = NULL;
+    int status = 0;
+
+    switch (operation) {
+        case BENCH_READ:
+            result = readPPM(set->input);
+            status = result ? 0 : -1;
+            break;
+        case BENCH_SAVE:
+            status = savePPM(set->output, set->image, set->binary);
+            break;
+        case BENCH_EDGE:
+            result = edgePPM(set->image);
+            status = result ? 0 : -1;
+            break;
+        case BENCH_FILTER:
+            result = filterPPM(set->image, set->filter, set->border, set->magnitude);
+            status = result ? 0 : -1;
+            break;
+        case BENCH_ADD:
+            result = addPPM(set->image, set->other);
+            status = result ? 0 : -1;
+            break;
+        case BENCH_PATTERN: {
+            // The search plus the boxes, as 'patternPPM' does without its printing
+            PPMMatch *matches;
+            int count = findPatternPPM(set->image, set->needle, &matches);
+            if (count < 0) {
+                return -1;
+            }
+            result = count > 0 ? boxMatchesPPM(set->image, set->needle, matches, count) : NULL;
+            status = (count > 0 && result == NULL) ? -1 : 0;
+            free(matches);
+            break;
+        }
+    }
+    freePPM(result);
+    return status;
+}
+
+// X: Time 'runs' runs of an operation (after one warm-up run) and write a line of results
+// 'bytes' is the data each run handles, for the MB/s figure. Returns 0 on success
+static int benchReportPPM(FILE *out, const char *name, const char *label, int operation, const BenchSet *set, size_t bytes, int runs) {
+    if (benchOncePPM(operation, set) != 0) {
+        fprintf(stderr, "Error: Benchmark '%s' (%s) failed\n", name, label);
+        return -1;
+    }
+    double *times = (double *)malloc(sizeof(double) * (size_t)runs);
+    if (times == NULL) {
+        fprintf(stderr, "Memory allocation failed for %d benchmark runs\n", runs);
+        return -1;
+    }
+    for (int run = 0; run < runs; ++run) {
+        double start = nowPPM();
+        benchOncePPM(operation, set);
+        times[run] = nowPPM() - start;
+    }
+    qsort(times, (size_t)runs, sizeof(double), compareTimesPPM);
+
+    // Nearest-rank percentiles
+    double p50 = times[(runs - 1) / 2];
+    double p99 = times[(int)ceil(runs * 0.99) - 1];
+    free(times);
+    double pixels = (double)set->image->width * set->image->height;
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    fprintf(out, "{\"operation\": \"%s\", \"format\": \"%s\", \"width\": %d, \"height\": %d, \"max_colour\": %d, \"runs\": %d, "
+                 "\"p50_ms\": %.3f, \"p99_ms\": %.3f, \"mb_per_s\": %.1f, \"mpixels_per_s\": %.1f, \"peak_rss_kb\": %ld}\n",
+            name, label, set->image->width, set->image->height, set->image->max_colour, runs,
+            p50, p99, bytes / 1e6 / (p50 / 1e3), pixels / 1e6 / (p50 / 1e3), usage.ru_maxrss);
+    fflush(out);
+    return 0;
+}
+
+// X: Benchmark every operation at each size in 'sizes' (e.g. "64,512,1920x1080"), 'runs' times each
+// Generated files go in a scratch directory that is removed afterwards. Returns 0 on success
+int benchPPM(const char *sizes, int runs, FILE *out) {
+    // P2/P3/P5/P6 at 8 bits, plus 16-bit RGB
+    static const char *formats[] = {"P2", "P3", "P5", "P6", "P6"};
+    static const int maxColours[] = {255, 255, 255, 255, 65535};
+    static const char *labels[] = {"P2", "P3", "P5", "P6", "P6/16"};
+
+    char directory[] = "/tmp/imageproc-bench-XXXXXX";
+    if (mkdtemp(directory) == NULL) {
+        perror("Error creating the benchmark directory");
+        return -1;
+    }
+    char input[sizeof(directory) + 16], output[sizeof(directory) + 16];
+    snprintf(input, sizeof(input), "%s/input.ppm", directory);
+    snprintf(output, sizeof(output), "%s/output.ppm", directory);
+
+    int status = 0;
+    char list[256];
+    snprintf(list, sizeof(list), "%s", sizes);
+    char *rest;
+    for (char *size = strtok_r(list, ",", &rest); size != NULL && status == 0; size = strtok_r(NULL, ",", &rest)) {
+        int width = atoi(size);
+        int height = strchr(size, 'x') ? atoi(strchr(size, 'x') + 1) : width;
+        if (width < 16 || height < 16) {
+            fprintf(stderr, "Error: Benchmark sizes must be at least 16x16 ('%s')\n", size);
+            status = -1;
+            break;
+        }
+
+        for (int f = 0; f < 5 && status == 0; ++f) {
+            BenchSet set;
+            set.image = generatePPM(formats[f], width, height, maxColours[f], 12345);
+            set.other = generatePPM(formats[f], width, height, maxColours[f], 67890);
+            set.needle = NULL;
+            set.input = input;
+            set.output = output;
+            set.binary = isBinaryPPM(set.image);
+            if (set.image == NULL || set.other == NULL || savePPM(input, set.image, set.binary) != 0) {
+                freePPM(set.image);
+                freePPM(set.other);
+                status = -1;
+                break;
+            }
+
+            struct stat info;
+            size_t fileBytes = stat(input, &info) == 0 ? (size_t)info.st_size : 0;
+            size_t imageBytes = (size_t)width * height * set.image->channels * SAMPLE_BYTES(maxColours[f]);
+            status |= benchReportPPM(out, "read", labels[f], BENCH_READ, &set, fileBytes, runs);
+            status |= benchReportPPM(out, "save", labels[f], BENCH_SAVE, &set, fileBytes, runs);
+
+            // Pixel operations do not depend on the file format, so they are measured once per sample size
+            if (strcmp(formats[f], "P5") == 0 || strcmp(formats[f], "P6") == 0) {
+                status |= benchReportPPM(out, "edge", labels[f], BENCH_EDGE, &set, imageBytes, runs);
+
+                // The other kernels of the convolution engine, each with a border mode that needs no black edge
+                static const struct { const char *name; int filter, border, magnitude; } filters[] = {
+                    {"filter-scharr-l2", FILTER_SCHARR, BORDER_REFLECT, MAGNITUDE_L2},
+                    {"filter-laplacian", FILTER_LAPLACIAN, BORDER_CLAMP, MAGNITUDE_L1},
+                    {"filter-gaussian", FILTER_GAUSSIAN, BORDER_REFLECT, MAGNITUDE_L1},
+                    {"filter-box", FILTER_BOX, BORDER_ZERO, MAGNITUDE_L1},
+                };
+                for (size_t k = 0; k < sizeof(filters) / sizeof(filters[0]); ++k) {
+                    set.filter = filters[k].filter;
+                    set.border = filters[k].border;
+                    set.magnitude = filters[k].magnitude;
+                    status |= benchReportPPM(out, filters[k].name, labels[f], BENCH_FILTER, &set, imageBytes, runs);
+                }
+                status |= benchReportPPM(out, "add", labels[f], BENCH_ADD, &set, imageBytes * 2, runs);
+
+                // A 16x16 piece cut from the middle (one match), then a flat image and needle, where
+                // every window matches and has to be confirmed pixel by pixel
+                int pixelBytes = set.image->channels * SAMPLE_BYTES(maxColours[f]);
+                set.needle = allocPPM(formats[f], 16, 16, maxColours[f], set.image->channels);
+                if (set.needle != NULL) {
+                    for (int row = 0; row < 16; ++row) {
+                        memcpy(set.needle->data + (size_t)row * 16 * pixelBytes,
+                               set.image->data + ((size_t)((height - 16) / 2 + row) * width + (width - 16) / 2) * pixelBytes, (size_t)16 * pixelBytes);
+                    }
+                    status |= benchReportPPM(out, "pattern", labels[f], BENCH_PATTERN, &set, imageBytes, runs);
+                    freePPM(set.needle);
+                }
+
+                PPMImage *flat = generatePPM(formats[f], width, height, maxColours[f], 0);
+                set.needle = generatePPM(formats[f], 16, 16, maxColours[f], 0);
+                if (flat != NULL && set.needle != NULL) {
+                    PPMImage *random = set.image;
+                    set.image = flat;
+                    status |= benchReportPPM(out, "pattern-flat", labels[f], BENCH_PATTERN, &set, imageBytes, runs);
+                    set.image = random;
+                }
+                freePPM(flat);
+                freePPM(set.needle);
+
+                // The same kernels on separate R, G and B planes
+                if (set.image->channels == 3 && toPlanarPPM(set.image) == 0 && toPlanarPPM(set.other) == 0) {
+                    status |= benchReportPPM(out, "edge-planar", labels[f], BENCH_EDGE, &set, imageBytes, runs);
+                    status |= benchReportPPM(out, "add-planar", labels[f], BENCH_ADD, &set, imageBytes * 2, runs);
+                }
+            }
+            freePPM(set.image);
+            freePPM(set.other);
+        }
+    }
+
+    unlink(input);
+    unlink(output);
+    rmdir(directory);
+    return status;
+}
+
+//----------------INSTRUMENTATION----------//
+//-----------------------------------------//
+// The hot paths are wrapped in TRACE_BEGIN/TRACE_END spans and TRACE_COUNT counters. Once tracing is
+// switched on, every stage's calls, wall time and CPU time are totalled and written as JSON when the
+// program exits, and with a Chrome trace file each span is kept too, so the thread pool's bands can be
+// seen side by side in chrome://tracing or Perfetto. CPU time is that of the thread running the span,
+// so work a stage hands to the pool shows up in its 'band' spans
+static const char *traceStageNames[TRACE_STAGES] = {
+    "read", "decode", "alloc", "save", "edge", "stream", "add", "pattern", "match", "average", "pipeline", "job", "band", "stats"
+};
+static const char *traceCounterNames[TRACE_COUNTERS] = {
+    "bytes_read", "bytes_written", "pixels", "candidates", "candidates_verified", "pool_hits", "pool_misses",
+    "cache_hits", "cache_misses"
+};
+
+// One finished span, for the Chrome trace
+typedef struct {
+    int stage, thread;
+    uint64_t start, length; // Nanoseconds since tracing began
+} TraceEvent;
+
+static struct {
+    uint64_t calls[TRACE_STAGES], wall[TRACE_STAGES], cpu[TRACE_STAGES]; // Totals in nanoseconds
+    uint64_t counters[TRACE_COUNTERS];
+    TraceEvent *events; // TRACE_EVENTS of them, or NULL without a Chrome trace
+    uint64_t eventCount; // Spans recorded, including any that did not fit
+    uint64_t origin; // Monotonic clock when tracing began
+    int threads; // Threads given an id so far
+    const char *summaryFile, *chromeFile;
+} trace;
+static __thread int traceThread; // This thread's id in the Chrome trace, 0 until its first span
+
+// X: Read a clock in nanoseconds
+static uint64_t traceClockPPM(clockid_t clock) {
+    struct timespec now;
+    clock_gettime(clock, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+// X: Start timing a stage (called through TRACE_BEGIN)
+void traceBeginPPM(TraceSpan *span, int stage) {
+    span->stage = stage;
+    span->wall = traceClockPPM(CLOCK_MONOTONIC);
+    span->cpu = traceClockPPM(CLOCK_THREAD_CPUTIME_ID);
+}
+
+// X: Finish timing a stage (called through TRACE_END). Totals are added atomically, so any thread may trace
+void traceEndPPM(TraceSpan *span) {
+    uint64_t wall = traceClockPPM(CLOCK_MONOTONIC) - span->wall;
+    uint64_t cpu = traceClockPPM(CLOCK_THREAD_CPUTIME_ID) - span->cpu;
+    __atomic_fetch_add(&trace.calls[span->stage], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&trace.wall[span->stage], wall, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&trace.cpu[span->stage], cpu, __ATOMIC_RELAXED);
+
+    if (trace.events != NULL) {
+        uint64_t slot = __atomic_fetch_add(&trace.eventCount, 1, __ATOMIC_RELAXED);
+        if (slot < TRACE_EVENTS) {
+            if (traceThread == 0) {
+                traceThread = __atomic_add_fetch(&trace.threads, 1, __ATOMIC_RELAXED);
+            }
+            TraceEvent *event = &trace.events[slot];
+            event->stage = span->stage;
+            event->thread = traceThread;
+            event->start = span->wall - trace.origin;
+            event->length = wall;
+        }
+    }
+}
+
+// X: Add to a counter (called through TRACE_COUNT)
+void traceCountPPM(int counter, uint64_t amount) {
+    __atomic_fetch_add(&trace.counters[counter], amount, __ATOMIC_RELAXED);
+}
+
+// X: Write the totals, and the Chrome trace if one was asked for. Registered with atexit
+static void writeTracePPM(void) {
+    traceEnabled = 0;
+    double elapsed = (traceClockPPM(CLOCK_MONOTONIC) - trace.origin) / 1e6;
+
+    FILE *out = trace.summaryFile ? fopen(trace.summaryFile, "w") : NULL;
+    if (trace.summaryFile != NULL && out == NULL) {
+        perror("Error opening the trace file");
+    }
+    if (out != NULL) {
+        fprintf(out, "{\"wall_ms\": %.3f, \"stages\": {", elapsed);
+        int first = 1;
+        for (int i = 0; i < TRACE_STAGES; ++i) {
+            if (trace.calls[i] == 0) {
+                continue;
+            }
+            fprintf(out, "%s\n  \"%s\": {\"calls\": %llu, \"wall_ms\": %.3f, \"cpu_ms\": %.3f}", first ? "" : ",",
+                    traceStageNames[i], (unsigned long long)trace.calls[i], trace.wall[i] / 1e6, trace.cpu[i] / 1e6);
+            first = 0;
+        }
+        fprintf(out, "},\n \"counters\": {");
+        for (int i = 0; i < TRACE_COUNTERS; ++i) {
+            fprintf(out, "%s\"%s\": %llu", i ? ", " : "", traceCounterNames[i], (unsigned long long)trace.counters[i]);
+        }
+        fprintf(out, "}}\n");
+        fclose(out);
+    }
+
+    out = trace.chromeFile ? fopen(trace.chromeFile, "w") : NULL;
+    if (trace.chromeFile != NULL && out == NULL) {
+        perror("Error opening the trace file");
+    }
+    if (out != NULL && trace.events != NULL) {
+        // Complete ("X") events in microseconds, then the counters as one counter ("C") event at the end
+        uint64_t kept = trace.eventCount < TRACE_EVENTS ? trace.eventCount : TRACE_EVENTS;
+        fprintf(out, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+        for (uint64_t i = 0; i < kept; ++i) {
+            const TraceEvent *event = &trace.events[i];
+            fprintf(out, "{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f},\n",
+                    traceStageNames[event->stage], event->thread, event->start / 1e3, event->length / 1e3);
+        }
+        fprintf(out, "{\"name\": \"counters\", \"ph\": \"C\", \"pid\": 1, \"tid\": 0, \"ts\": %.3f, \"args\": {", elapsed * 1e3);
+        for (int i = 0; i < TRACE_COUNTERS; ++i) {
+            fprintf(out, "%s\"%s\": %llu", i ? ", " : "", traceCounterNames[i], (unsigned long long)trace.counters[i]);
+        }
+        fprintf(out, "}}\n], \"otherData\": {\"dropped_events\": %llu}}\n",
+                (unsigned long long)(trace.eventCount - kept));
+    }
+    if (out != NULL) {
+        fclose(out);
+    }
+    free(trace.events);
+    trace.events = NULL;
+}
+
+// X: Switch tracing on, writing the totals to 'summaryFile' and the spans to 'chromeFile' at exit
+// Either file may be NULL. Returns 0, or -1 if the program was built without instrumentation
+int enableTracePPM(const char *summaryFile, const char *chromeFile) {
+    if (!IMAGEPROC_TRACE) {
+        fprintf(stderr, "Error: This build has no instrumentation (built with IMAGEPROC_TRACE=0)\n");
+        return -1;
+    }
+    if (traceEnabled) {
+        return 0;
+    }
+    trace.summaryFile = summaryFile;
+    trace.chromeFile = chromeFile;
+    if (chromeFile != NULL) {
+        trace.events = (TraceEvent *)malloc(sizeof(TraceEvent) * TRACE_EVENTS);
+        if (trace.events == NULL) {
+            fprintf(stderr, "Memory allocation failed for the trace\n");
+        }
+    }
+    trace.origin = traceClockPPM(CLOCK_MONOTONIC);
+    atexit(writeTracePPM);
+    traceEnabled = 1;
+    return 0;
+}
+
+//----------------RESULT CACHE-------------//
+//-----------------------------------------//
+// With '--cache DIR' (or IMAGEPROC_CACHE=DIR) the outputs of edge, add and chain jobs are kept
+// in DIR, named after a hash of the operation, its settings and the bytes of every input, so a job that
+// has run before is answered by reading one file. Results are stored as binary PPM (and converted on the
+// way out if ASCII is wanted). A file is touched whenever it is used, and once the directory holds more
+// than its limit the least recently used files are deleted.
+// Pattern jobs are not cached: their printed matches are part of the result, and a search that finds
+// nothing writes no file at all.
+#define CACHE_VERSION 1 // Part of every key: bump it whenever a cached operation's output changes
+#define CACHE_LIMIT_MB 1024 // Default size limit (--cache-mb or IMAGEPROC_CACHE_MB overrides)
+
+static struct {
+    const char *directory; // NULL while the cache is off
+    size_t limit; // Bytes the directory may hold
+    size_t used; // Bytes it holds, counted on the first store and kept up to date after that
+    int counted;
+    unsigned long hits, misses;
+    pthread_mutex_t lock;
+} resultCache = {NULL, 0, 0, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER};
+
+// One cached file, for eviction
+typedef struct {
+    char name[32];
+    time_t used;
+    size_t size;
+} CacheEntry;
+
+static inline uint64_t rotateLeftPPM(uint64_t x, int bits) {
+    return (x << bits) | (x >> (64 - bits));
+}
+
+// X: Fast 64-bit hash of 'length' bytes, continuing from 'seed'
+// Four independent lanes take 32 bytes per step, so the multiplies overlap and it runs at several GB/s
+static uint64_t hashBytesPPM(const void *data, size_t length, uint64_t seed) {
+    const uint64_t prime1 = 0x9E3779B185EBCA87ULL, prime2 = 0xC2B2AE3D27D4EB4FULL, prime3 = 0x165667B19E3779F9ULL;
+    const unsigned char *bytes = (const unsigned char *)data;
+    uint64_t lanes[4] = {seed + prime1 + prime2, seed + prime2, seed, seed - prime1};
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        for (int lane = 0; lane < 4; ++lane) {
+            uint64_t word;
+            memcpy(&word, bytes + i + lane * 8, 8);
+            lanes[lane] = rotateLeftPPM(lanes[lane] + word * prime2, 31) * prime1;
+        }
+    }
+
+    uint64_t hash = rotateLeftPPM(lanes[0], 1) + rotateLeftPPM(lanes[1], 7) + rotateLeftPPM(lanes[2], 12)
+                  + rotateLeftPPM(lanes[3], 18) + (uint64_t)length;
+    for (; i + 8 <= length; i += 8) {
+        uint64_t word;
+        memcpy(&word, bytes + i, 8);
+        hash = rotateLeftPPM(hash ^ (rotateLeftPPM(word * prime2, 31) * prime1), 27) * prime1 + prime3;
+    }
+    for (; i < length; ++i) {
+        hash = rotateLeftPPM(hash ^ (bytes[i] * prime3), 11) * prime1;
+    }
+
+    // Mix the last bits into every bit of the result
+    hash ^= hash >> 33;
+    hash *= prime2;
+    hash ^= hash >> 29;
+    hash *= prime3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+// X: Switch the cache on, creating 'directory' if needed. 'megabytes' of 0 or less uses the default
+// Returns 0 on success
+int enableCachePPM(const char *directory, long megabytes) {
+    if (mkdir(directory, 0755) != 0 && errno != EEXIST) {
+        perror("Error creating the cache directory");
+        return -1;
+    }
+    if (megabytes <= 0 && getenv("IMAGEPROC_CACHE_MB") != NULL) {
+        megabytes = atol(getenv("IMAGEPROC_CACHE_MB"));
+    }
+    resultCache.limit = (size_t)(megabytes > 0 ? megabytes : CACHE_LIMIT_MB) << 20;
+    resultCache.directory = directory;
+    return 0;
+}
+
+// X: Work out a job's cache key (16 hex digits, so 'key' needs 17 bytes) from its operation, steps and
+// inputs, and whether its output is binary. Returns 0, or -1 if an input cannot be read
+int cacheKeyPPM(const PPMJob *job, char *key, int *binary) {
+    uint64_t hash = hashBytesPPM(job->operation, strlen(job->operation), CACHE_VERSION);
+    if (job->steps != NULL) {
+        hash = hashBytesPPM(job->steps, strlen(job->steps), hash);
+    }
+    if (job->region != NULL) {
+        hash = hashBytesPPM(job->region, strlen(job->region), hash ^ 1);
+    }
+    if (job->filter != NULL) {
+        hash = hashBytesPPM(job->filter, strlen(job->filter), hash ^ 2);
+    }
+
+    for (int i = 0; i < job->inputCount; ++i) {
+        int fd = job->inputs[i] ? open(job->inputs[i], O_RDONLY) : -1;
+        struct stat info;
+        if (fd < 0 || fstat(fd, &info) != 0 || info.st_size < 2) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            return -1;
+        }
+        unsigned char *map = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) {
+            return -1;
+        }
+        madvise(map, (size_t)info.st_size, MADV_SEQUENTIAL);
+        hash = hashBytesPPM(map, (size_t)info.st_size, hash);
+        if (i == 0) {
+            // Jobs keep the encoding of their first input unless told otherwise
+            *binary = job->binary >= 0 ? job->binary : (map[1] == '5' || map[1] == '6');
+        }
+        munmap(map, (size_t)info.st_size);
+    }
+
+    snprintf(key, 17, "%016llx", (unsigned long long)hash);
+    return 0;
+}
+
+// X: Write the cached result for 'key' to 'output'. Returns 0 on a hit, -1 if there is none
+int cacheFetchPPM(const char *key, const char *output, int binary) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s.ppm", resultCache.directory, key);
+    if (access(path, R_OK) != 0) {
+        return -1;
+    }
+
+    // An 8-bit result is mapped and written out in one go
+    PPMImage *image = readPPM(path);
+    if (image == NULL) {
+        unlink(path); // Damaged, so it is made again
+        return -1;
+    }
+    int status = savePPM(output, image, binary);
+    freePPM(image);
+    if (status == 0) {
+        utimensat(AT_FDCWD, path, NULL, 0); // Most recently used
+    }
+    return status;
+}
+
+// X: Scan the cache directory (call with the cache locked). Sets '*entries' to a malloc'd array of the
+// cached files and returns how many there are, updating the byte count
+static int scanCachePPM(CacheEntry **entries) {
+    *entries = NULL;
+    DIR *directory = opendir(resultCache.directory);
+    if (directory == NULL) {
+        return 0;
+    }
+
+    int count = 0, capacity = 0;
+    size_t used = 0;
+    char path[PATH_MAX];
+    struct dirent *item;
+    while ((item = readdir(directory)) != NULL) {
+        size_t length = strlen(item->d_name);
+        struct stat info;
+        if (length != 20 || strcmp(item->d_name + 16, ".ppm") != 0) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", resultCache.directory, item->d_name);
+        if (stat(path, &info) != 0) {
+            continue;
+        }
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            CacheEntry *grown = (CacheEntry *)realloc(*entries, sizeof(CacheEntry) * (size_t)capacity);
+            if (grown == NULL) {
+                break;
+            }
+            *entries = grown;
+        }
+        strcpy((*entries)[count].name, item->d_name);
+        (*entries)[count].used = info.st_mtime;
+        (*entries)[count].size = (size_t)info.st_size;
+        used += (size_t)info.st_size;
+        count++;
+    }
+    closedir(directory);
+    resultCache.used = used;
+    resultCache.counted = 1;
+    return count;
+}
+
+static int compareEntriesPPM(const void *a, const void *b) {
+    time_t x = ((const CacheEntry *)a)->used, y = ((const CacheEntry *)b)->used;
+    return (x > y) - (x < y);
+}
+
+// X: Store a finished job's output under 'key', then trim the cache if it has grown past its limit
+void cacheStorePPM(const char *key, const char *output) {
+    PPMImage *image = readPPM(output);
+    if (image == NULL) {
+        return;
+    }
+
+    // Written under a temporary name and renamed, so other jobs (or processes) never see half a file
+    char path[PATH_MAX], temporary[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s.ppm", resultCache.directory, key);
+    snprintf(temporary, sizeof(temporary), "%s/%s.XXXXXX", resultCache.directory, key);
+    int fd = mkstemp(temporary);
+    if (fd < 0) {
+        freePPM(image);
+        return;
+    }
+    close(fd);
+    int status = savePPM(temporary, image, 1);
+    freePPM(image);
+    struct stat info;
+    if (status != 0 || stat(temporary, &info) != 0 || rename(temporary, path) != 0) {
+        unlink(temporary);
+        return;
+    }
+
+    // The directory is only scanned on the first store and when it is full
+    pthread_mutex_lock(&resultCache.lock);
+    CacheEntry *entries = NULL;
+    if (!resultCache.counted) {
+        scanCachePPM(&entries); // Counts the new file too
+        free(entries);
+        entries = NULL;
+    } else {
+        resultCache.used += (size_t)info.st_size;
+    }
+
+    // Delete the least recently used files until the cache is a little under its limit
+    if (resultCache.used > resultCache.limit) {
+        int count = scanCachePPM(&entries);
+        qsort(entries, (size_t)count, sizeof(CacheEntry), compareEntriesPPM);
+        for (int i = 0; i < count && resultCache.used > resultCache.limit / 10 * 9; ++i) {
+            snprintf(path, sizeof(path), "%s/%s", resultCache.directory, entries[i].name);
+            if (unlink(path) == 0) {
+                resultCache.used -= entries[i].size;
+            }
+        }
+    }
+    pthread_mutex_unlock(&resultCache.lock);
+    free(entries);
+}
+
+// X: Run a job through the cache: answer it from there if it has run before, otherwise run it
+// and keep the result. Jobs the cache does not cover are just run. Returns as 'runJobPPM'
+int runCachedJobPPM(PPMJob *job) {
+    const char *operation = job->operation;
+    if (resultCache.directory == NULL || job->output == NULL
+        || (strcmp(operation, "edge") != 0 && strcmp(operation, "add") != 0 && strcmp(operation, "chain") != 0)) {
+        return runJobPPM(job);
+    }
+
+    char key[17];
+    int binary;
+    if (cacheKeyPPM(job, key, &binary) != 0) {
+        return runJobPPM(job); // Let the job report the unreadable input
+    }
+    if (cacheFetchPPM(key, job->output, binary) == 0) {
+        __atomic_fetch_add(&resultCache.hits, 1, __ATOMIC_RELAXED);
+        TRACE_COUNT(TRACE_CACHE_HITS, 1);
+        fprintf(stderr, "cache hit: %s %s -> %s\n", operation, job->inputs[0], job->output);
+        return 0;
+    }
+
+    __atomic_fetch_add(&resultCache.misses, 1, __ATOMIC_RELAXED);
+    TRACE_COUNT(TRACE_CACHE_MISSES, 1);
+    fprintf(stderr, "cache miss: %s %s -> %s\n", operation, job->inputs[0], job->output);
+    int status = runJobPPM(job);
+    if (status == 0) {
+        cacheStorePPM(key, job->output);
+    }
+    return status;
+}
+
+//----------------SERVER-----------------//
+//-----------------------------------------//
+// 'imageproc serve SOCKET' stays running and answers requests on a Unix domain socket, keeping the images
+// it reads in memory so repeat requests skip reading and parsing them. Each client gets its own thread,
+// and their edge detection and searches share the thread pool. Requests are one line each, with one
+// line in reply, starting "ok" or "error":
+//   load NAME FILE                 read FILE and keep it as NAME
+//   drop NAME                      forget NAME
+//   edge IMAGE OUT                 edge detect IMAGE into the file OUT
+//   add IMAGE1 IMAGE2 OUT          average two images into OUT
+//   pattern IMAGE NEEDLE [OUT]     reply with the positions of NEEDLE in IMAGE (and save them boxed)
+//   save IMAGE OUT                 write IMAGE to OUT
+//   list                           reply with the resident images
+//   shutdown                       stop the server
+// IMAGE is a name given to 'load', or a file (relative to the server's directory), which is then kept
+// under its path until the file changes. Resident images are evicted least recently used first once
+// they take more than the memory budget, but never while a request is using them
+#define SERVER_MEMORY_MB 1024 // Default budget for resident images (--memory-mb overrides)
+#define SERVER_WORDS 8 // Most words in one request
+
+// One resident image
+typedef struct ResidentImage {
+    char *name; // Given by 'load', or the path of a file used directly
+    int named; // 1 if loaded by name, 0 if kept under its path (and checked against the file on each use)
+    off_t size; // Size and modification time of the file when it was read
+    struct timespec modified;
+    PPMImage *image;
+    size_t bytes; // Memory held by the pixels
+    int users; // Requests using the image right now
+    int dropped; // Taken off the list while in use: freed by the last user
+    unsigned long lastUse;
+    struct ResidentImage *next;
+} ResidentImage;
+
+static struct {
+    ResidentImage *images;
+    size_t limit, used; // Bytes of pixels allowed and held
+    unsigned long clock; // Counts uses, for least recently used eviction
+    unsigned long hits, loads;
+    int listener; // Listening socket
+    volatile int stopping;
+    pthread_mutex_t lock;
+} server = {NULL, 0, 0, 0, 0, 0, -1, 0, PTHREAD_MUTEX_INITIALIZER};
+
+// X: Free a resident image that is off the list and unused
+static void freeResidentPPM(ResidentImage *entry) {
+    freePPM(entry->image);
+    free(entry->name);
+    free(entry);
+}
+
+// X: Take an image off the list, freeing it now if nothing is using it. Called with the server lock held
+static void removeResidentPPM(ResidentImage *entry) {
+    for (ResidentImage **link = &server.images; *link != NULL; link = &(*link)->next) {
+        if (*link == entry) {
+            *link = entry->next;
+            break;
+        }
+    }
+    server.used -= entry->bytes;
+    if (entry->users == 0) {
+        freeResidentPPM(entry);
+    } else {
+        entry->dropped = 1;
+    }
+}
+
+// X: Remove the least recently used idle images until the rest fit the budget. Called with the server lock held
+static void evictResidentPPM(void) {
+    while (server.used > server.limit) {
+        ResidentImage *oldest = NULL;
+        for (ResidentImage *entry = server.images; entry != NULL; entry = entry->next) {
+            if (entry->users == 0 && (oldest == NULL || entry->lastUse < oldest->lastUse)) {
+                oldest = entry;
+            }
+        }
+        if (oldest == NULL) {
+            break; // Everything left is in use
+        }
+        removeResidentPPM(oldest);
+    }
+}
+
+// X: Add an image to the list. Called with the server lock held
+static ResidentImage *addResidentPPM(const char *name, int named, PPMImage *image, const struct stat *info, int users) {
+    ResidentImage *entry = (ResidentImage *)calloc(1, sizeof(ResidentImage));
+    if (entry == NULL || (entry->name = strdup(name)) == NULL) {
+        free(entry);
+        return NULL;
+    }
+    entry->named = named;
+    entry->size = info->st_size;
+    entry->modified = info->st_mtim;
+    entry->image = image;
+    entry->bytes = (size_t)image->width * image->height * image->channels * SAMPLE_BYTES(image->max_colour);
+    entry->users = users;
+    entry->lastUse = ++server.clock;
+    entry->next = server.images;
+    server.images = entry;
+    server.used += entry->bytes;
+    server.loads++;
+    evictResidentPPM();
+    return entry;
+}
+
+// X: Find a resident image by name (or path), reading the file if it is not resident or has changed
+// since. The image stays until 'releaseImagePPM'. Returns NULL, with the reason in 'error', if there is none
+static ResidentImage *acquireImagePPM(const char *name, char *error, size_t size) {
+    struct stat info;
+    int isFile = stat(name, &info) == 0 && S_ISREG(info.st_mode);
+
+    pthread_mutex_lock(&server.lock);
+    for (ResidentImage *entry = server.images; entry != NULL; entry = entry->next) {
+        if (strcmp(entry->name, name) != 0) {
+            continue;
+        }
+        if (!entry->named && (!isFile || entry->size != info.st_size || entry->modified.tv_sec != info.st_mtim.tv_sec
+                              || entry->modified.tv_nsec != info.st_mtim.tv_nsec)) {
+            removeResidentPPM(entry); // The file has changed
+            break;
+        }
+        entry->users++;
+        entry->lastUse = ++server.clock;
+        server.hits++;
+        pthread_mutex_unlock(&server.lock);
+        return entry;
+    }
+    pthread_mutex_unlock(&server.lock);
+
+    if (!isFile) {
+        snprintf(error, size, "error no image or file named %s", name);
+        return NULL;
+    }
+    PPMImage *image = readPPM(name);
+    if (image == NULL) {
+        snprintf(error, size, "error cannot read %s", name);
+        return NULL;
+    }
+    pthread_mutex_lock(&server.lock);
+    // Another client may have read the same file meanwhile, in which case its copy is used
+    ResidentImage *entry;
+    for (entry = server.images; entry != NULL; entry = entry->next) {
+        if (!entry->named && strcmp(entry->name, name) == 0 && entry->size == info.st_size
+            && entry->modified.tv_sec == info.st_mtim.tv_sec && entry->modified.tv_nsec == info.st_mtim.tv_nsec) {
+            entry->users++;
+            entry->lastUse = ++server.clock;
+            pthread_mutex_unlock(&server.lock);
+            freePPM(image);
+            return entry;
+        }
+    }
+    entry = addResidentPPM(name, 0, image, &info, 1);
+    pthread_mutex_unlock(&server.lock);
+    if (entry == NULL) {
+        freePPM(image);
+        snprintf(error, size, "error out of memory");
+    }
+    return entry;
+}
+
+// X: Let go of an image from 'acquireImagePPM'
+static void releaseImagePPM(ResidentImage *entry) {
+    if (entry == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&server.lock);
+    if (--entry->users == 0 && entry->dropped) {
+        freeResidentPPM(entry);
+    } else {
+        evictResidentPPM(); // Images over the budget may have been kept only because they were in use
+    }
+    pthread_mutex_unlock(&server.lock);
+}
+
+// X: Carry out one request line, writing the one-line reply into 'reply'
+static void serveRequestPPM(char *line, char *reply, size_t size) {
+    char *words[SERVER_WORDS];
+    int count = 0;
+    char *rest;
+    for (char *word = strtok_r(line, " \t\r\n", &rest); word != NULL && count < SERVER_WORDS; word = strtok_r(NULL, " \t\r\n", &rest)) {
+        words[count++] = word;
+    }
+    const char *request = count > 0 ? words[0] : "";
+
+    if (strcmp(request, "load") == 0 && count == 3) {
+        struct stat info;
+        PPMImage *image = stat(words[2], &info) == 0 ? readPPM(words[2]) : NULL;
+        if (image == NULL) {
+            snprintf(reply, size, "error cannot read %s", words[2]);
+            return;
+        }
+        size_t bytes = (size_t)image->width * image->height * image->channels * SAMPLE_BYTES(image->max_colour);
+        if (bytes > server.limit) {
+            snprintf(reply, size, "error %s needs %.1f MB, more than the %zu MB the server may hold", words[2], bytes / 1048576.0, server.limit >> 20);
+            freePPM(image);
+            return;
+        }
+        pthread_mutex_lock(&server.lock);
+        for (ResidentImage *entry = server.images; entry != NULL; entry = entry->next) {
+            if (strcmp(entry->name, words[1]) == 0) {
+                removeResidentPPM(entry);
+                break;
+            }
+        }
+        // Held while the reply is written, so it cannot be evicted (by this load or another client) first
+        ResidentImage *entry = addResidentPPM(words[1], 1, image, &info, 1);
+        pthread_mutex_unlock(&server.lock);
+        if (entry == NULL) {
+            freePPM(image);
+            snprintf(reply, size, "error out of memory");
+        } else {
+            snprintf(reply, size, "ok %s %dx%d", words[1], image->width, image->height);
+            releaseImagePPM(entry);
+        }
+    } else if (strcmp(request, "drop") == 0 && count == 2) {
+        int found = 0;
+        pthread_mutex_lock(&server.lock);
+        for (ResidentImage *entry = server.images; entry != NULL; entry = entry->next) {
+            if (strcmp(entry->name, words[1]) == 0) {
+                removeResidentPPM(entry);
+                found = 1;
+                break;
+            }
+        }
+        pthread_mutex_unlock(&server.lock);
+        snprintf(reply, size, found ? "ok" : "error no image named %s", words[1]);
+    } else if (strcmp(request, "list") == 0 && count == 1) {
+        pthread_mutex_lock(&server.lock);
+        int used = snprintf(reply, size, "ok %.1f of %zu MB, %lu hits, %lu loads:", server.used / 1048576.0, server.limit >> 20, server.hits, server.loads);
+        for (ResidentImage *entry = server.images; entry != NULL && used < (int)size; entry = entry->next) {
+            used += snprintf(reply + used, size - used, " %s(%dx%d)", entry->name, entry->image->width, entry->image->height);
+        }
+        pthread_mutex_unlock(&server.lock);
+    } else if (strcmp(request, "shutdown") == 0 && count == 1) {
+        server.stopping = 1; // The listening socket is shut once this reply has gone
+        snprintf(reply, size, "ok");
+    } else if ((strcmp(request, "edge") == 0 && count == 3) || (strcmp(request, "save") == 0 && count == 3)
+               || (strcmp(request, "add") == 0 && count == 4) || (strcmp(request, "pattern") == 0 && (count == 3 || count == 4))) {
+        int inputs = (strcmp(request, "edge") == 0 || strcmp(request, "save") == 0) ? 1 : 2;
+        const char *output = count > inputs + 1 ? words[inputs + 1] : NULL;
+        ResidentImage *first = acquireImagePPM(words[1], reply, size);
+        ResidentImage *second = (first != NULL && inputs == 2) ? acquireImagePPM(words[2], reply, size) : NULL;
+        if (first == NULL || (inputs == 2 && second == NULL)) {
+            releaseImagePPM(first);
+            return;
+        }
+        PPMImage *image1 = first->image, *image2 = second ? second->image : NULL;
+        int binary = isBinaryPPM(image1);
+        int status = -1;
+
+        if (strcmp(request, "save") == 0) {
+            status = savePPM(output, image1, binary);
+        } else if (strcmp(request, "edge") == 0) {
+            PPMImage *result = edgePPM(image1);
+            status = result ? savePPM(output, result, binary) : -1;
+            freePPM(result);
+        } else if (strcmp(request, "add") == 0) {
+            PPMPipeline pipe;
+            pipe.count = 0;
+            int sum = pipeAddPPM(&pipe, pipeSourcePPM(&pipe, image1), pipeSourcePPM(&pipe, image2));
+            status = sum < 0 ? -1 : savePipelinePPM(&pipe, sum, output, binary);
+        } else {
+            PPMMatch *matches;
+            int found = findPatternPPM(image1, image2, &matches);
+            status = found < 0 ? -1 : 0;
+            if (found > 0 && output != NULL) {
+                PPMPipeline pipe;
+                pipe.count = 0;
+                int boxes = pipeBoxesPPM(&pipe, pipeSourcePPM(&pipe, image1), matches, found, image2->width, image2->height);
+                status = savePipelinePPM(&pipe, boxes, output, binary);
+            }
+            if (status == 0) {
+                // Positions as x,y, cut short if the reply fills up
+                int used = snprintf(reply, size, "ok %d", found);
+                for (int i = 0; i < found && used < (int)size - 32; ++i) {
+                    used += snprintf(reply + used, size - used, " %d,%d", matches[i].x, matches[i].y);
+                }
+                if (used >= (int)size - 32 && found > 0) {
+                    snprintf(reply + used, size - used, " ...");
+                }
+            }
+            free(matches);
+        }
+        if (status != 0) {
+            snprintf(reply, size, "error %s failed (see the server's output)", request);
+        } else if (strcmp(request, "pattern") != 0) {
+            snprintf(reply, size, "ok %s", output);
+        }
+        releaseImagePPM(second);
+        releaseImagePPM(first);
+    } else {
+        snprintf(reply, size, "error unknown request '%s'", request);
+    }
+}
+
+// X: Client thread: answer request lines until the client hangs up
+static void *clientPPM(void *arg) {
+    int fd = (int)(intptr_t)arg;
+    FILE *in = fdopen(fd, "r");
+    if (in == NULL) {
+        close(fd);
+        return NULL;
+    }
+    char *line = NULL, reply[WRITE_BUFFER_SIZE];
+    size_t capacity = 0;
+    while (getline(&line, &capacity, in) > 0) {
+        serveRequestPPM(line, reply, sizeof(reply) - 1);
+        size_t length = strlen(reply);
+        reply[length++] = '\n';
+        if (write(fd, reply, length) != (ssize_t)length) {
+            break;
+        }
+        if (server.stopping) {
+            shutdown(server.listener, SHUT_RDWR); // Wakes the accept loop
+            break;
+        }
+    }
+    free(line);
+    fclose(in);
+    return NULL;
+}
+
+// X: Serve requests on a Unix socket at 'socketPath' until a 'shutdown' request, keeping up to 'megabytes'
+// (0 for the default) of images resident. Returns 0 once stopped, or -1 if the socket cannot be opened
+int servePPM(const char *socketPath, long megabytes) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socketPath) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Error: The socket path %s is too long\n", socketPath);
+        return -1;
+    }
+    strcpy(address.sun_path, socketPath);
+    signal(SIGPIPE, SIG_IGN); // A client hanging up mid-reply is not fatal
+
+    // A socket file left behind by a server that has gone is replaced; one that answers is not
+    int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (probe >= 0 && connect(probe, (struct sockaddr *)&address, sizeof(address)) == 0) {
+        fprintf(stderr, "Error: A server is already running on %s\n", socketPath);
+        close(probe);
+        return -1;
+    }
+    if (probe >= 0) {
+        close(probe);
+    }
+    unlink(socketPath);
+
+    server.listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server.listener < 0 || bind(server.listener, (struct sockaddr *)&address, sizeof(address)) != 0
+        || listen(server.listener, SOMAXCONN) != 0) {
+        perror("Error opening the socket");
+        if (server.listener >= 0) {
+            close(server.listener);
+        }
+        return -1;
+    }
+    server.limit = (size_t)(megabytes > 0 ? megabytes : SERVER_MEMORY_MB) << 20;
+    fprintf(stderr, "Serving on %s, keeping up to %zu MB of images\n", socketPath, server.limit >> 20);
+
+    while (!server.stopping) {
+        int client = accept(server.listener, NULL, NULL);
+        if (client < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            break; // Shut down (or broken)
+        }
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, clientPPM, (void *)(intptr_t)client) != 0) {
+            close(client);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+    close(server.listener);
+    unlink(socketPath);
+    fprintf(stderr, "Server stopped: %lu requests answered from memory, %lu images read\n", server.hits, server.loads);
+    return 0;
+}
+
+// X: Send one request (the words given), or every line of standard input if there are no words, to the
+// server at 'socketPath' and print the replies. Returns 0 if every reply was "ok"
+int sendRequestPPM(const char *socketPath, int count, char **words) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, socketPath, sizeof(address.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+        fprintf(stderr, "Error: No server is answering on %s\n", socketPath);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    FILE *replies = fdopen(fd, "r");
+    if (replies == NULL) {
+        close(fd);
+        return -1;
+    }
+
+    char *line = NULL, *reply = NULL;
+    size_t capacity = 0, replyCapacity = 0;
+    int status = 0;
+    for (int more = 1; more;) {
+        // One request from the words, or the next line of standard input
+        if (count > 0) {
+            size_t length = 1;
+            for (int i = 0; i < count; ++i) {
+                length += strlen(words[i]) + 1;
+            }
+            line = (char *)malloc(length);
+            if (line == NULL) {
+                break;
+            }
+            line[0] = '\0';
+            for (int i = 0; i < count; ++i) {
+                strcat(line, words[i]);
+                strcat(line, i + 1 < count ? " " : "\n");
+            }
+            more = 0;
+        } else if (getline(&line, &capacity, stdin) <= 0) {
+            break;
+        } else if (line[strspn(line, " \t\r\n")] == '\0') {
+            continue;
+        }
+
+        // The last line of the input may not end in a newline, but every request must
+        size_t length = strlen(line);
+        int ended = line[length - 1] == '\n';
+        if (write(fd, line, length) != (ssize_t)length || (!ended && write(fd, "\n", 1) != 1)
+            || getline(&reply, &replyCapacity, replies) <= 0) {
+            fprintf(stderr, "Error: The server on %s hung up\n", socketPath);
+            status = -1;
+            break;
+        }
+        fputs(reply, stdout);
+        if (strncmp(reply, "ok", 2) != 0) {
+            status = -1;
+        }
+    }
+    free(line);
+    free(reply);
+    fclose(replies);
+    return status;
+}
+
+//----------------BATCH MODE---------------//
+//-----------------------------------------//
+// Runs operations straight from the command line, or from a manifest of thousands of jobs, in one
+// process. Jobs are shared across the thread pool (one job per band, so '-j' sets how many run at
+// once) and a job that fails is reported without stopping the rest.
+
+// X: Print command line help
+static void batchUsagePPM(void) {
+    fprintf(stderr,
+        "Usage: imageproc [-t N] [--trace FILE] [--trace-chrome FILE] (no command: interactive menu)\n"
+        "       imageproc edge FILE... [-o OUT] [--stream] [options]\n"
+        "       imageproc add FILE1 FILE2 [-o OUT] [options]\n"
+        "       imageproc pattern HAYSTACK NEEDLE... [-o OUT] [options]   (several needles are found in one pass)\n"
+        "       imageproc match HAYSTACK NEEDLE [-o OUT] [--ncc] [--threshold T] [--top K] [options]\n"
+        "       imageproc chain FILE1 [FILE2] --steps add,edge,threshold=T [-o OUT] [options]\n"
+        "       imageproc average FILE... [--weights W1,W2,...] [-o OUT] [options]\n"
+        "       imageproc convert FILE... -o OUT [options]\n"
+        "       imageproc display FILE... [--dump] [--region X,Y,WxH]   (statistics and a preview; --dump prints every pixel)\n"
+        "       imageproc edge|convert|chain - [-o OUT] [options]   (a stream of frames, stdin to stdout)\n"
+        "       imageproc run MANIFEST [options]\n"
+        "       imageproc serve SOCKET [--memory-mb N]   (keep images in memory and answer requests on a Unix socket)\n"
+        "       imageproc send SOCKET [REQUEST...]   (one request, e.g. 'pattern big.ppm small.ppm', or one per line of stdin)\n"
+        "       imageproc bench [--sizes 64,512,1920x1080] [--runs N] [-o REPORT]\n"
+        "Options: -j N       jobs (and threads) to run at once\n"
+        "         -o OUT     output file, or a directory (ending in '/') for several inputs\n"
+        "         --binary   write P5/P6     --ascii   write P2/P3 (default: same as the input)\n"
+        "         --planar   edge detect and add RGB images as separate R, G and B planes\n"
+        "         --filter K[,B][,M]    edge detect with kernel K (sobel, scharr, laplacian, gaussian, box), border B\n"
+        "                               (none, clamp, reflect, zero) and gradient magnitude M (l1, l2); default sobel,none,l1\n"
+        "         --region X,Y,WxH      load only this window of the (first) input; ASCII files get a FILE.rowidx index\n"
+        "         --cache DIR           reuse edge, add and chain results kept in DIR\n"
+        "         --cache-mb N          most the cache directory may hold (default 1024)\n"
+        "         --prefetch N          files to read ahead of the ones being processed (default 4, 0 for none)\n"
+        "         --trace FILE          write per-stage timings and counters as JSON at exit\n"
+        "         --trace-chrome FILE   also write every timed span, for chrome://tracing or Perfetto\n"
+        "Manifest lines hold one job each: 'edge IN OUT', 'add IN1 IN2 OUT', 'pattern IN1 IN2 OUT',\n"
+        "'save IN OUT' or 'read IN'. Blank lines and lines starting with '#' are skipped.\n");
+}
+
+// X: Name the output for one input: OUT itself, OUT/name for a directory, or name.operation.ppm beside the input
+static char *outputNamePPM(const char *output, const char *input, const char *operation, int severalInputs) {
+    struct stat info;
+    int directory = output != NULL && (output[strlen(output) - 1] == '/' || (stat(output, &info) == 0 && S_ISDIR(info.st_mode)));
+    char *copy = strdup(input);
+    char *name = NULL;
+    if (copy == NULL) {
+        return NULL;
+    }
+
+    if (output != NULL && !directory && !severalInputs) {
+        name = strdup(output);
+    } else if (directory) {
+        size_t length = strlen(output) + strlen(copy) + 2;
+        name = (char *)malloc(length);
+        if (name != NULL) {
+            snprintf(name, length, "%s%s%s", output, output[strlen(output) - 1] == '/' ? "" : "/", basename(copy));
+        }
+    } else {
+        // Strip the extension and add the operation, e.g. photo.ppm -> photo.edge.ppm
+        char *dot = strrchr(copy, '.');
+        if (dot != NULL && strchr(dot, '/') == NULL) {
+            *dot = '\0';
+        }
+        size_t length = strlen(copy) + strlen(operation) + 7;
+        name = (char *)malloc(length);
+        if (name != NULL) {
+            snprintf(name, length, "%s.%s.ppm", copy, operation);
+        }
+    }
+    free(copy);
+    return name;
+}
+
+// X: Build a pipeline from a list of steps such as "add,edge,threshold=64" and save its result
+// Steps apply in order to the first image; 'add' averages in the second. Returns 0 on success
+static int chainPPM(PPMImage *image1, PPMImage *image2, const char *steps, const char *output, int binary) {
+    PPMPipeline pipe;
+    pipe.count = 0;
+    int current = pipeSourcePPM(&pipe, image1);
+    int second = -1;
+
+    char list[256];
+    snprintf(list, sizeof(list), "%s", steps ? steps : "");
+    char *rest;
+    for (char *step = strtok_r(list, ",", &rest); step != NULL && current >= 0; step = strtok_r(NULL, ",", &rest)) {
+        if (strcmp(step, "add") == 0 && image2 != NULL) {
+            if (second < 0) {
+                second = pipeSourcePPM(&pipe, image2);
+            }
+            current = pipeAddPPM(&pipe, current, second);
+        } else if (strcmp(step, "edge") == 0) {
+            current = pipeEdgePPM(&pipe, current);
+        } else if (strncmp(step, "threshold=", 10) == 0) {
+            current = pipeThresholdPPM(&pipe, current, atoi(step + 10));
+        } else {
+            fprintf(stderr, "Error: Unknown step '%s'%s\n", step, strcmp(step, "add") == 0 ? " (add needs a second file)" : "");
+            current = -1;
+        }
+    }
+    if (current < 0 || pipe.count == 1) {
+        if (pipe.count == 1) {
+            fprintf(stderr, "Error: No steps given (use --steps)\n");
+        }
+        return -1;
+    }
+    return savePipelinePPM(&pipe, current, output, binary);
+}
+
+// X: Apply an operation to every frame of a stream of PPM images on standard input, writing each result
+// to standard output (or 'output', one after another) as soon as it is done: 'imageproc edge -'
+// Only a frame and its result are held at a time, and while frames keep their size their buffers are
+// reused. A blocking pipe in either direction simply pauses the loop. In a chain, 'add' averages each
+// frame with the one before it. Returns 0 if every frame was processed
+static int streamFramesPPM(const char *operation, const char *steps, const char *output, int binary) {
+    if (output != NULL && strcmp(output, "-") != 0) {
+        int fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0 || dup2(fd, STDOUT_FILENO) < 0) {
+            perror("Error opening the output");
+            return -1;
+        }
+        close(fd);
+    }
+
+    PPMReader reader;
+    PPMImage *header = openStreamPPM("-", &reader);
+    if (header == NULL) {
+        return -1;
+    }
+
+    // Two frame buffers, so a chain can still see the previous frame
+    PPMImage *frames[2] = {NULL, NULL};
+    int status = 0, count = 0, more = 1;
+    while (more == 1 && status == 0) {
+        PPMImage *frame = frames[count % 2], *previous = frames[(count + 1) % 2];
+        if (frame == NULL || frame->width != header->width || frame->height != header->height
+            || frame->channels != header->channels || SAMPLE_BYTES(frame->max_colour) != SAMPLE_BYTES(header->max_colour)) {
+            freePPM(frame);
+            frame = frames[count % 2] = allocPPM(header->format, header->width, header->height, header->max_colour, header->channels);
+            if (frame == NULL) {
+                status = -1;
+                break;
+            }
+        }
+        strcpy(frame->format, header->format);
+        frame->max_colour = header->max_colour;
+
+        size_t rowLength = (size_t)frame->width * (size_t)frame->channels * SAMPLE_BYTES(frame->max_colour);
+        for (int y = 0; y < frame->height && status == 0; ++y) {
+            status = readRowPPM(&reader, frame, frame->data + rowLength * (size_t)y);
+        }
+        if (status != 0) {
+            fprintf(stderr, "Error: Frame %d of the input stream is cut short\n", count + 1);
+            break;
+        }
+
+        int frameBinary = binary < 0 ? isBinaryPPM(frame) : binary;
+        if (strcmp(operation, "edge") == 0) {
+            PPMImage *result = edgePPM(frame);
+            status = result ? savePPM("-", result, frameBinary) : -1;
+            freePPM(result);
+        } else if (strcmp(operation, "chain") == 0) {
+            int matching = previous != NULL && previous->width == frame->width && previous->height == frame->height
+                        && previous->channels == frame->channels && SAMPLE_BYTES(previous->max_colour) == SAMPLE_BYTES(frame->max_colour);
+            status = chainPPM(frame, matching ? previous : frame, steps, "-", frameBinary);
+        } else {
+            status = savePPM("-", frame, frameBinary);
+        }
+        count++;
+        more = nextFramePPM(&reader, header, "the input stream");
+    }
+    if (more < 0) {
+        status = -1;
+    }
+
+    freePPM(frames[0]);
+    freePPM(frames[1]);
+    freePPM(header);
+    closeStreamPPM(&reader);
+    fprintf(stderr, "%d frame%s%s\n", count, count == 1 ? "" : "s", status == 0 ? "" : ", stopped on an error");
+    return status;
+}
+
+// X: Run one job: read its inputs, apply the operation and save the result. Returns 0 on success
+int runJobPPM(PPMJob *job) {
+    const char *operation = job->operation;
+    int needed = (strcmp(operation, "add") == 0 || strcmp(operation, "pattern") == 0 || strcmp(operation, "match") == 0) ? 2 : 1;
+    if (strcmp(operation, "chain") == 0) {
+        needed = job->inputCount == 2 ? 2 : 1; // The second input is only used by 'add' steps
+    }
+    if (job->inputCount != needed || (job->output == NULL && strcmp(operation, "read") != 0)) {
+        fprintf(stderr, "Error: Wrong number of files for '%s'\n", operation);
+        return -1;
+    }
+
+    // Streamed edge detection never loads the image
+    if (strcmp(operation, "edge") == 0 && job->stream) {
+        return edgeStreamPPM(job->inputs[0], job->output);
+    }
+
+    // Everything the job allocates belongs to its arena and is released together at the end
+    TRACE_BEGIN(span, TRACE_JOB);
+    // Only edge and add have planar kernels; anything else would just convert back
+    PPMArena arena;
+    beginArenaPPM(&arena);
+    int planar = job->planar && (strcmp(operation, "edge") == 0 || strcmp(operation, "add") == 0);
+    PPMImage *image1 = NULL;
+    if (job->region != NULL) {
+        int x, y, width, height;
+        if (sscanf(job->region, "%d,%d,%dx%d", &x, &y, &width, &height) != 4) {
+            fprintf(stderr, "Error: Regions are given as X,Y,WxH, not '%s'\n", job->region);
+        } else if ((image1 = readRegionPPM(job->inputs[0], x, y, width, height)) != NULL && planar && toPlanarPPM(image1) != 0) {
+            image1 = NULL; // Freed with the arena
+        }
+    } else {
+        image1 = planar ? readPlanarPPM(job->inputs[0]) : readPPM(job->inputs[0]);
+    }
+    PPMImage *image2 = (needed == 2 && image1 != NULL) ? (planar ? readPlanarPPM(job->inputs[1]) : readPPM(job->inputs[1])) : NULL;
+    PPMImage *result = NULL;
+    int status = 0;
+
+    if (image1 == NULL || (needed == 2 && image2 == NULL)) {
+        status = -1;
+    } else if (needed == 2 && image1->channels != image2->channels) {
+        fprintf(stderr, "Error: %s and %s have different magic values.\n", job->inputs[0], job->inputs[1]);
+        status = -1;
+    } else if (needed == 2 && SAMPLE_BYTES(image1->max_colour) != SAMPLE_BYTES(image2->max_colour)) {
+        fprintf(stderr, "Error: %s and %s have different sample depths (8 and 16-bit).\n", job->inputs[0], job->inputs[1]);
+        status = -1;
+    } else if (strcmp(operation, "read") == 0) {
+        status = 0;
+    } else if (strcmp(operation, "save") == 0 || strcmp(operation, "convert") == 0) {
+        status = savePPM(job->output, image1, job->binary < 0 ? isBinaryPPM(image1) : job->binary);
+    } else if (strcmp(operation, "edge") == 0 && job->filter != NULL) {
+        int filter, border, magnitude;
+        result = parseFilterPPM(job->filter, &filter, &border, &magnitude) == 0 ? filterPPM(image1, filter, border, magnitude) : NULL;
+    } else if (strcmp(operation, "edge") == 0) {
+        result = edgePPM(image1);
+    } else if (strcmp(operation, "add") == 0) {
+        if (image1->width != image2->width || image1->height != image2->height) {
+            fprintf(stderr, "Error: %s and %s are not of the same size.\n", job->inputs[0], job->inputs[1]);
+            status = -1;
+        } else if (planar) {
+            result = addPPM(image1, image2);
+            status = result ? 0 : -1;
+        } else {
+            // Averaged straight into the output file, without building the combined image
+            PPMPipeline pipe;
+            pipe.count = 0;
+            int sum = pipeAddPPM(&pipe, pipeSourcePPM(&pipe, image1), pipeSourcePPM(&pipe, image2));
+            status = savePipelinePPM(&pipe, sum, job->output, job->binary < 0 ? isBinaryPPM(image1) : job->binary);
+        }
+    } else if (strcmp(operation, "pattern") == 0) {
+        PPMMatch *matches;
+        int count = findPatternPPM(image1, image2, &matches);
+        if (count < 0) {
+            status = -1;
+        } else {
+            printf("%s: %d match%s for %s\n", job->inputs[0], count, count == 1 ? "" : "es", job->inputs[1]);
+            if (count > 0) {
+                // Boxes are drawn as the rows are written, without copying the image first
+                PPMPipeline pipe;
+                pipe.count = 0;
+                int boxes = pipeBoxesPPM(&pipe, pipeSourcePPM(&pipe, image1), matches, count, image2->width, image2->height);
+                status = savePipelinePPM(&pipe, boxes, job->output, job->binary < 0 ? isBinaryPPM(image1) : job->binary);
+            }
+        }
+        free(matches);
+    } else if (strcmp(operation, "chain") == 0) {
+        status = chainPPM(image1, image2, job->steps, job->output, job->binary < 0 ? isBinaryPPM(image1) : job->binary);
+    } else {
+        fprintf(stderr, "Error: Unknown operation '%s'\n", operation);
+        status = -1;
+    }
+
+    // Save the result, keeping the first input's encoding unless told otherwise
+    if (status == 0 && result != NULL) {
+        status = savePPM(job->output, result, job->binary < 0 ? isBinaryPPM(image1) : job->binary);
+    } else if (status == 0 && strcmp(operation, "edge") == 0 && result == NULL) {
+        status = -1;
+    }
+
+    releaseArenaPPM(&arena);
+    TRACE_END(span);
+    return status;
+}
+
+// X: Run the jobs in one band (one job per band)
+static void jobBandPPM(void *arg, int band) {
+    PPMJob *job = (PPMJob *)arg + band;
+    if (job->ahead != NULL) {
+        readAheadPPM(job->ahead->inputs[0]);
+        readAheadPPM(job->ahead->inputCount > 1 ? job->ahead->inputs[1] : NULL);
+    }
+    job->status = runCachedJobPPM(job);
+    if (job->status != 0) {
+        fprintf(stderr, "FAILED: %s %s%s%s%s%s\n", job->operation, job->inputs[0], job->inputCount > 1 ? " " : "",
+                job->inputCount > 1 ? job->inputs[1] : "", job->output ? " -> " : "", job->output ? job->output : "");
+    }
+}
+
+// X: Read a manifest into jobs. Returns the number of jobs, or -1 if the file cannot be read
+static int readManifestPPM(const char *filename, PPMJob **jobs, int binary) {
+    FILE *file = fopen(filename, "r");
+    if (!file) {
+        perror("Error opening manifest");
+        return -1;
+    }
+
+    int count = 0, capacity = 0;
+    char line[4 * MAX_FILENAME_LENGTH];
+    *jobs = NULL;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        char *words[4];
+        int wordCount = 0;
+        for (char *word = strtok(line, " \t\r\n"); word != NULL && wordCount < 4; word = strtok(NULL, " \t\r\n")) {
+            words[wordCount++] = word;
+        }
+        if (wordCount == 0 || words[0][0] == '#') {
+            continue;
+        }
+
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            PPMJob *grown = (PPMJob *)realloc(*jobs, sizeof(PPMJob) * (size_t)capacity);
+            if (grown == NULL) {
+                fprintf(stderr, "Memory allocation failed for the manifest\n");
+                break;
+            }
+            *jobs = grown;
+        }
+
+        // The last word is the output, except for 'read'
+        PPMJob *job = &(*jobs)[count++];
+        memset(job, 0, sizeof(PPMJob));
+        job->operation = strdup(words[0]);
+        job->binary = binary;
+        int inputs = strcmp(words[0], "read") == 0 ? wordCount - 1 : wordCount - 2;
+        for (int i = 0; i < inputs && i < 2; ++i) {
+            job->inputs[i] = strdup(words[1 + i]);
+        }
+        job->inputCount = inputs < 0 ? 0 : inputs;
+        job->output = (strcmp(words[0], "read") != 0 && wordCount > 1) ? strdup(words[wordCount - 1]) : NULL;
+    }
+
+    fclose(file);
+    return count;
+}
+
+// X: Command line entry point. Returns the process exit status: 0 if every job succeeded
+int runBatchPPM(int argc, char *argv[]) {
+    const char *command = argv[1];
+
+    // A request for the server is passed on word for word, so it is not read as options
+    if (strcmp(command, "send") == 0) {
+        if (argc < 3) {
+            batchUsagePPM();
+            return 2;
+        }
+        return sendRequestPPM(argv[2], argc - 3, argv + 3) == 0 ? 0 : 1;
+    }
+    const char *output = NULL, *steps = NULL, *weightList = NULL, *sizes = "64,512,1920x1080";
+    const char *cacheDirectory = getenv("IMAGEPROC_CACHE");
+    long cacheMegabytes = 0, serverMegabytes = 0;
+    const char *files[argc];
+    const char *region = NULL, *filterSpec = NULL;
+    int fileCount = 0, binary = -1, stream = 0, planar = 0, dump = 0, topK = 10, mode = MATCH_SAD, runs = 10;
+    double threshold = -1;
+
+    // Options may appear anywhere after the command
+    for (int i = 2; i < argc; ++i) {
+        if ((strcmp(argv[i], "-t") == 0 || strcmp(argv[i], "--threads") == 0 || strcmp(argv[i], "-j") == 0
+             || strcmp(argv[i], "--trace") == 0 || strcmp(argv[i], "--trace-chrome") == 0) && i + 1 < argc) {
+            ++i; // Already applied in main
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            output = argv[++i];
+        } else if (strcmp(argv[i], "--binary") == 0) {
+            binary = 1;
+        } else if (strcmp(argv[i], "--ascii") == 0) {
+            binary = 0;
+        } else if (strcmp(argv[i], "--stream") == 0) {
+            stream = 1;
+        } else if (strcmp(argv[i], "--planar") == 0) {
+            planar = 1;
+        } else if (strcmp(argv[i], "--region") == 0 && i + 1 < argc) {
+            region = argv[++i];
+        } else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+            filterSpec = argv[++i];
+        } else if (strcmp(argv[i], "--dump") == 0) {
+            dump = 1;
+        } else if (strcmp(argv[i], "--ncc") == 0) {
+            mode = MATCH_NCC;
+        } else if (strcmp(argv[i], "--threshold") == 0 && i + 1 < argc) {
+            threshold = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--top") == 0 && i + 1 < argc) {
+            topK = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--steps") == 0 && i + 1 < argc) {
+            steps = argv[++i];
+        } else if (strcmp(argv[i], "--weights") == 0 && i + 1 < argc) {
+            weightList = argv[++i];
+        } else if (strcmp(argv[i], "--sizes") == 0 && i + 1 < argc) {
+            sizes = argv[++i];
+        } else if (strcmp(argv[i], "--runs") == 0 && i + 1 < argc) {
+            runs = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+            cacheDirectory = argv[++i];
+        } else if (strcmp(argv[i], "--cache-mb") == 0 && i + 1 < argc) {
+            cacheMegabytes = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--memory-mb") == 0 && i + 1 < argc) {
+            serverMegabytes = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--prefetch") == 0 && i + 1 < argc) {
+            prefetchDepth = atoi(argv[++i]);
+        } else if (argv[i][0] == '-' && argv[i][1] != '\0') {
+            fprintf(stderr, "Unknown option '%s'\n", argv[i]);
+            batchUsagePPM();
+            return 2;
+        } else {
+            files[fileCount++] = argv[i];
+        }
+    }
+
+    int filter, border, magnitude;
+    if (filterSpec != NULL && parseFilterPPM(filterSpec, &filter, &border, &magnitude) != 0) {
+        return 2;
+    }
+
+    verbosePPM = 0;
+    if (cacheDirectory != NULL && cacheDirectory[0] != '\0' && enableCachePPM(cacheDirectory, cacheMegabytes) != 0) {
+        return 1;
+    }
+    if (prefetchDepth > 0) {
+        startAsyncIOPPM();
+    }
+    // An output ending in '/' is a directory for the results, created here rather than failing every job
+    if (output != NULL && output[0] != '\0' && output[strlen(output) - 1] == '/' && mkdir(output, 0755) != 0 && errno != EEXIST) {
+        perror("Error creating the output directory");
+        return 1;
+    }
+    PPMJob *jobs = NULL;
+    int jobCount = 0;
+
+    // A lone "-" streams frames from standard input to standard output
+    if (fileCount == 1 && strcmp(files[0], "-") == 0
+        && (strcmp(command, "edge") == 0 || strcmp(command, "convert") == 0 || strcmp(command, "chain") == 0)) {
+        return streamFramesPPM(command, steps, output, binary) == 0 ? 0 : 1;
+    }
+
+    if (strcmp(command, "help") == 0) {
+        batchUsagePPM();
+        return 0;
+    } else if (strcmp(command, "run") == 0) {
+        if (fileCount != 1) {
+            batchUsagePPM();
+            return 2;
+        }
+        jobCount = readManifestPPM(files[0], &jobs, binary);
+        if (jobCount < 0) {
+            return 1;
+        }
+        for (int i = 0; i < jobCount; ++i) {
+            jobs[i].stream = stream && region == NULL && filterSpec == NULL;
+            jobs[i].planar = planar;
+            jobs[i].region = region;
+            jobs[i].filter = filterSpec;
+        }
+    } else if (strcmp(command, "match") == 0) {
+        // Approximate matching takes its settings from the command line, so it runs on its own
+        if (fileCount != 2) {
+            batchUsagePPM();
+            return 2;
+        }
+        PPMImage *image1 = readPPM(files[0]);
+        PPMImage *image2 = image1 ? readPPM(files[1]) : NULL;
+        int status = 1;
+        if (image1 != NULL && image2 != NULL && image1->channels == image2->channels) {
+            if (threshold < 0) {
+                threshold = (mode == MATCH_NCC) ? 0.9 : 8;
+            }
+            verbosePPM = 1;
+            PPMImage *result = approxPatternPPM(image1, image2, mode, threshold, topK);
+            if (result != NULL) {
+                char *name = outputNamePPM(output, files[0], "match", 0);
+                status = (name != NULL && savePPM(name, result, binary < 0 ? isBinaryPPM(image1) : binary) == 0) ? 0 : 1;
+                free(name);
+            }
+            freePPM(result);
+        }
+        freePPM(image1);
+        freePPM(image2);
+        return status;
+    } else if (strcmp(command, "serve") == 0) {
+        // Runs until a 'shutdown' request
+        if (fileCount != 1) {
+            batchUsagePPM();
+            return 2;
+        }
+        return servePPM(files[0], serverMegabytes) == 0 ? 0 : 1;
+    } else if (strcmp(command, "display") == 0) {
+        // Printed in order, one file after another, so this also runs on its own
+        if (fileCount == 0) {
+            batchUsagePPM();
+            return 2;
+        }
+        int status = 0;
+        for (int i = 0; i < fileCount; ++i) {
+            int x, y, width, height;
+            PPMImage *image = NULL;
+            if (region == NULL) {
+                image = readPPM(files[i]);
+            } else if (sscanf(region, "%d,%d,%dx%d", &x, &y, &width, &height) == 4) {
+                image = readRegionPPM(files[i], x, y, width, height);
+            } else {
+                fprintf(stderr, "Error: Regions are given as X,Y,WxH, not '%s'\n", region);
+            }
+            if (image == NULL) {
+                status = 1;
+                continue;
+            }
+            printf("%s%s:\n", i > 0 ? "\n" : "", files[i]);
+            if (dump) {
+                dumpPPM(image);
+            } else {
+                displayPPM(image);
+            }
+            freePPM(image);
+        }
+        fflush(stdout);
+        return status;
+    } else if (strcmp(command, "bench") == 0) {
+        // Report to stdout, or to the -o file
+        FILE *report = output ? fopen(output, "w") : stdout;
+        if (report == NULL || runs < 1) {
+            if (report == NULL) {
+                perror("Error opening the report");
+            }
+            return 2;
+        }
+        int status = benchPPM(sizes, runs, report) == 0 ? 0 : 1;
+        if (report != stdout) {
+            fclose(report);
+        }
+        return status;
+    } else if (strcmp(command, "average") == 0) {
+        // Every input goes into one output, so this also runs on its own
+        if (fileCount == 0) {
+            batchUsagePPM();
+            return 2;
+        }
+        int weights[fileCount];
+        int weightCount = 0;
+        for (const char *w = weightList; w != NULL && weightCount < fileCount; w = strchr(w, ',') ? strchr(w, ',') + 1 : NULL) {
+            weights[weightCount++] = atoi(w);
+        }
+        if (weightList != NULL && weightCount != fileCount) {
+            fprintf(stderr, "Error: Give one weight for each of the %d files\n", fileCount);
+            return 2;
+        }
+        char *name = outputNamePPM(output, files[0], "average", 0);
+        int status = (name != NULL && averageFilesPPM(files, fileCount, weightList ? weights : NULL, name, binary) == 0) ? 0 : 1;
+        free(name);
+        finishAsyncIOPPM();
+        return status;
+    } else if (strcmp(command, "pattern") == 0 && fileCount > 2) {
+        // Several needles are searched for together in one pass, so this runs on its own
+        int needleCount = fileCount - 1, status = 0;
+        PPMImage *image1 = readPPM(files[0]);
+        PPMImage *needles[needleCount];
+        for (int i = 0; i < needleCount; ++i) {
+            needles[i] = image1 ? readPPM(files[i + 1]) : NULL;
+            status |= needles[i] == NULL ? 1 : 0;
+        }
+        PPMMatch *matches = NULL;
+        int found = status == 0 ? findPatternsPPM(image1, needles, needleCount, &matches) : -1;
+        if (found < 0) {
+            status = 1;
+        } else {
+            for (int i = 0; i < needleCount; ++i) {
+                int times = 0;
+                for (int j = 0; j < found; ++j) {
+                    times += matches[j].pattern == i;
+                }
+                printf("%s: %d match%s for %s\n", files[0], times, times == 1 ? "" : "es", files[i + 1]);
+            }
+            // Every match boxed in one copy of the haystack
+            PPMImage *result = found > 0 ? boxPatternsPPM(image1, needles, matches, found) : NULL;
+            char *name = found > 0 ? outputNamePPM(output, files[0], "pattern", 0) : NULL;
+            if (found > 0 && (result == NULL || name == NULL || savePPM(name, result, binary < 0 ? isBinaryPPM(image1) : binary) != 0)) {
+                status = 1;
+            }
+            free(name);
+            freePPM(result);
+        }
+        free(matches);
+        for (int i = 0; i < needleCount; ++i) {
+            freePPM(needles[i]);
+        }
+        freePPM(image1);
+        return status;
+    } else if (strcmp(command, "add") == 0 || strcmp(command, "pattern") == 0 || strcmp(command, "chain") == 0) {
+        // Two inputs (one or two for a chain), one job
+        if (fileCount != 2 && !(strcmp(command, "chain") == 0 && fileCount == 1)) {
+            batchUsagePPM();
+            return 2;
+        }
+        jobs = (PPMJob *)calloc(1, sizeof(PPMJob));
+        if (jobs == NULL) {
+            return 1;
+        }
+        jobs[0].operation = command;
+        jobs[0].inputs[0] = files[0];
+        jobs[0].inputs[1] = fileCount == 2 ? files[1] : NULL;
+        jobs[0].inputCount = fileCount;
+        jobs[0].steps = steps;
+        jobs[0].planar = planar;
+        jobs[0].region = region;
+        jobs[0].output = outputNamePPM(output, files[0], command, 0);
+        jobs[0].binary = binary;
+        jobCount = 1;
+    } else if (strcmp(command, "edge") == 0 || strcmp(command, "convert") == 0 || strcmp(command, "read") == 0) {
+        // One job per input
+        if (fileCount == 0) {
+            batchUsagePPM();
+            return 2;
+        }
+        jobs = (PPMJob *)calloc((size_t)fileCount, sizeof(PPMJob));
+        if (jobs == NULL) {
+            return 1;
+        }
+        for (int i = 0; i < fileCount; ++i) {
+            jobs[i].operation = command;
+            jobs[i].inputs[0] = files[i];
+            jobs[i].inputCount = 1;
+            jobs[i].output = strcmp(command, "read") == 0 ? NULL : outputNamePPM(output, files[i], command, fileCount > 1);
+            jobs[i].binary = binary;
+            jobs[i].stream = stream && region == NULL && filterSpec == NULL;
+            jobs[i].planar = planar;
+            jobs[i].region = region;
+            jobs[i].filter = filterSpec;
+        }
+        jobCount = fileCount;
+    } else {
+        fprintf(stderr, "Unknown command '%s'\n", command);
+        batchUsagePPM();
+        return 2;
+    }
+
+    // Run every job across the pool, reading each job's inputs ahead while the ones before it run, then report
+    for (int i = 0; prefetchDepth > 0 && i < jobCount; ++i) {
+        jobs[i].ahead = i + prefetchDepth < jobCount ? &jobs[i + prefetchDepth] : NULL;
+        if (i < prefetchDepth) {
+            readAheadPPM(jobs[i].inputs[0]);
+            readAheadPPM(jobs[i].inputCount > 1 ? jobs[i].inputs[1] : NULL);
+        }
+    }
+    runParallelPPM(jobBandPPM, jobs, jobCount);
+    finishAsyncIOPPM();
+
+    int failed = 0;
+    for (int i = 0; i < jobCount; ++i) {
+        failed += jobs[i].status != 0;
+    }
+    if (jobCount > 1 || failed > 0) {
+        fprintf(stderr, "%d job%s, %d failed\n", jobCount, jobCount == 1 ? "" : "s", failed);
+    }
+    if (resultCache.directory != NULL && resultCache.hits + resultCache.misses > 0) {
+        fprintf(stderr, "cache: %lu hit%s, %lu miss%s\n", resultCache.hits, resultCache.hits == 1 ? "" : "s",
+                resultCache.misses, resultCache.misses == 1 ? "" : "es");
+    }
+
+    // Manifest jobs own copies of their strings; command line jobs point into argv
+    for (int i = 0; i < jobCount; ++i) {
+        if (strcmp(command, "run") == 0) {
+            free((char *)jobs[i].operation);
+            free((char *)jobs[i].inputs[0]);
+            free((char *)jobs[i].inputs[1]);
+        }
+        free(jobs[i].output);
+    }
+    free(jobs);
+    return failed ? 1 : 0;
+}